@@ -55,6 +55,7 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
     int N = plist->size;
     clock_t time;
 
+    set_image_cache_size(option_find_int_quiet(options, "image_cache", 0));
     load_args args = {0};
     args.w = net.w;
     args.h = net.h;
@@ -78,18 +79,13 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
     args.type = CLASSIFICATION_DATA;
 
     data train;
-    data buffer;
-    pthread_t load_thread;
-    args.d = &buffer;
-    load_thread = load_data(args);
+    data_loader *loader = make_data_loader(args, 2);
 
     int epoch = (*net.seen)/N;
     while(get_current_batch(net) < net.max_batches || net.max_batches == 0){
         time=clock();
 
-        pthread_join(load_thread, 0);
-        train = buffer;
-        load_thread = load_data(args);
+        train = data_loader_next(loader);
 
         printf("Loaded: %lf seconds\n", sec(clock()-time));
         time=clock();
@@ -107,7 +103,7 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
         if(avg_loss == -1) avg_loss = loss;
         avg_loss = avg_loss*.9 + loss*.1;
         printf("%d, %.3f: %f, %f avg, %f rate, %lf seconds, %d images\n", get_current_batch(net), (float)(*net.seen)/N, loss, avg_loss, get_current_rate(net), sec(clock()-time), *net.seen);
-        free_data(train);
+        data_loader_release(loader, train);
         if(*net.seen/N > epoch){
             epoch = *net.seen/N;
             char buff[256];
@@ -124,6 +120,7 @@ void train_classifier(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
     sprintf(buff, "%s/%s.weights", backup_directory, base);
     save_weights(net, buff);
 
+    free_data_loader(loader);
     free_network(net);
     free_ptrs((void**)labels, classes);
     free_ptrs((void**)paths, plist->size);
@@ -273,6 +270,7 @@ void validate_classifier_crop(char *datacfg, char *filename, char *weightfile)
 
     data val, buffer;
 
+    set_image_cache_size(option_find_int_quiet(options, "image_cache", 0));
     load_args args = {0};
     args.w = net.w;
     args.h = net.h;
@@ -312,11 +310,7 @@ void validate_classifier_crop(char *datacfg, char *filename, char *weightfile)
 void validate_classifier_10(char *datacfg, char *filename, char *weightfile)
 {
     int i, j;
-    network net = parse_network_cfg(filename);
-    set_batch_network(&net, 1);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
+    network net = load_network_inference_custom(filename, weightfile, 10);
     srand(time(0));
 
     list *options = read_data_cfg(datacfg);
@@ -336,6 +330,8 @@ void validate_classifier_10(char *datacfg, char *filename, char *weightfile)
     float avg_acc = 0;
     float avg_topk = 0;
     int *indexes = calloc(topk, sizeof(int));
+    int size = net.w*net.h*net.c;
+    float *input = calloc(10*size, sizeof(float));
 
     for(i = 0; i < m; ++i){
         int class = -1;
@@ -364,10 +360,14 @@ void validate_classifier_10(char *datacfg, char *filename, char *weightfile)
         images[9] = crop_image(im, shift, shift, w, h);
         float *pred = calloc(classes, sizeof(float));
         for(j = 0; j < 10; ++j){
-            float *p = network_predict(net, images[j].data);
+            copy_cpu(size, images[j].data, 1, input + j*size, 1);
+            free_image(images[j]);
+        }
+        float *out = network_predict(net, input);
+        for(j = 0; j < 10; ++j){
+            float *p = out + j*net.outputs;
             if(net.hierarchy) hierarchy_predictions(p, net.outputs, net.hierarchy, 1, 1);
             axpy_cpu(classes, 1, p, 1, pred, 1);
-            free_image(images[j]);
         }
         free_image(im);
         top_k(pred, classes, topk, indexes);
@@ -379,16 +379,13 @@ void validate_classifier_10(char *datacfg, char *filename, char *weightfile)
 
         printf("%d: top 1: %f, top %d: %f\n", i, avg_acc/(i+1), topk, avg_topk/(i+1));
     }
+    free(input);
 }
 
 void validate_classifier_full(char *datacfg, char *filename, char *weightfile)
 {
     int i, j;
-    network net = parse_network_cfg(filename);
-    set_batch_network(&net, 1);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
+    network net = load_network_inference(filename, weightfile);
     srand(time(0));
 
     list *options = read_data_cfg(datacfg);
@@ -442,14 +439,10 @@ void validate_classifier_full(char *datacfg, char *filename, char *weightfile)
 }
 
 
-void validate_classifier_single(char *datacfg, char *filename, char *weightfile)
+void validate_classifier_single(char *datacfg, char *filename, char *weightfile, int batch)
 {
-    int i, j;
-    network net = parse_network_cfg(filename);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
-    set_batch_network(&net, 1);
+    int i, j, t;
+    network net = load_network_inference_custom(filename, weightfile, batch);
     srand(time(0));
 
     list *options = read_data_cfg(datacfg);
@@ -471,47 +464,52 @@ void validate_classifier_single(char *datacfg, char *filename, char *weightfile)
     float avg_acc = 0;
     float avg_topk = 0;
     int *indexes = calloc(topk, sizeof(int));
-
-    for(i = 0; i < m; ++i){
-        int class = -1;
-        char *path = paths[i];
-        for(j = 0; j < classes; ++j){
-            if(strstr(path, labels[j])){
-                class = j;
-                break;
-            }
+    int size = net.w*net.h*net.c;
+    float *input = calloc(batch*size, sizeof(float));
+
+    for(i = 0; i < m; i += batch){
+        int n = (m - i < batch) ? m - i : batch;
+        for(t = 0; t < n; ++t){
+            image im = load_image_color(paths[i+t], 0, 0);
+            image resized = resize_min(im, net.w);
+            image crop = crop_image(resized, (resized.w - net.w)/2, (resized.h - net.h)/2, net.w, net.h);
+            //show_image(im, "orig");
+            //show_image(crop, "cropped");
+            //cvWaitKey(0);
+            copy_cpu(size, crop.data, 1, input + t*size, 1);
+            if(resized.data != im.data) free_image(resized);
+            free_image(im);
+            free_image(crop);
         }
-        image im = load_image_color(paths[i], 0, 0);
-        image resized = resize_min(im, net.w);
-        image crop = crop_image(resized, (resized.w - net.w)/2, (resized.h - net.h)/2, net.w, net.h);
-        //show_image(im, "orig");
-        //show_image(crop, "cropped");
-        //cvWaitKey(0);
-        float *pred = network_predict(net, crop.data);
-        if(net.hierarchy) hierarchy_predictions(pred, net.outputs, net.hierarchy, 1, 1);
+        float *out = network_predict(net, input);
+        for(t = 0; t < n; ++t){
+            int class = -1;
+            char *path = paths[i+t];
+            for(j = 0; j < classes; ++j){
+                if(strstr(path, labels[j])){
+                    class = j;
+                    break;
+                }
+            }
+            float *pred = out + t*net.outputs;
+            if(net.hierarchy) hierarchy_predictions(pred, net.outputs, net.hierarchy, 1, 1);
+            top_k(pred, classes, topk, indexes);
 
-        if(resized.data != im.data) free_image(resized);
-        free_image(im);
-        free_image(crop);
-        top_k(pred, classes, topk, indexes);
+            if(indexes[0] == class) avg_acc += 1;
+            for(j = 0; j < topk; ++j){
+                if(indexes[j] == class) avg_topk += 1;
+            }
 
-        if(indexes[0] == class) avg_acc += 1;
-        for(j = 0; j < topk; ++j){
-            if(indexes[j] == class) avg_topk += 1;
+            printf("%d: top 1: %f, top %d: %f\n", i+t, avg_acc/(i+t+1), topk, avg_topk/(i+t+1));
         }
-
-        printf("%d: top 1: %f, top %d: %f\n", i, avg_acc/(i+1), topk, avg_topk/(i+1));
     }
+    free(input);
 }
 
 void validate_classifier_multi(char *datacfg, char *filename, char *weightfile)
 {
     int i, j;
-    network net = parse_network_cfg(filename);
-    set_batch_network(&net, 1);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
+    network net = load_network_inference_custom(filename, weightfile, 2);
     srand(time(0));
 
     list *options = read_data_cfg(datacfg);
@@ -533,6 +531,9 @@ void validate_classifier_multi(char *datacfg, char *filename, char *weightfile)
     float avg_acc = 0;
     float avg_topk = 0;
     int *indexes = calloc(topk, sizeof(int));
+    /* Holds an image and its flip. Only grows, so it ends up sized for the largest scale. */
+    float *input = 0;
+    int input_size = 0;
 
     for(i = 0; i < m; ++i){
         int class = -1;
@@ -548,12 +549,21 @@ void validate_classifier_multi(char *datacfg, char *filename, char *weightfile)
         for(j = 0; j < nscales; ++j){
             image r = resize_min(im, scales[j]);
             resize_network(&net, r.w, r.h);
-            float *p = network_predict(net, r.data);
-            if(net.hierarchy) hierarchy_predictions(p, net.outputs, net.hierarchy, 1 , 1);
-            axpy_cpu(classes, 1, p, 1, pred, 1);
+            int size = r.w*r.h*r.c;
+            if(2*size > input_size){
+                input_size = 2*size;
+                input = realloc(input, input_size*sizeof(float));
+            }
+            copy_cpu(size, r.data, 1, input, 1);
             flip_image(r);
-            p = network_predict(net, r.data);
+            copy_cpu(size, r.data, 1, input + size, 1);
+            float *p = network_predict(net, input);
+            if(net.hierarchy){
+                hierarchy_predictions(p, net.outputs, net.hierarchy, 1 , 1);
+                hierarchy_predictions(p + net.outputs, net.outputs, net.hierarchy, 1 , 1);
+            }
             axpy_cpu(classes, 1, p, 1, pred, 1);
+            axpy_cpu(classes, 1, p + net.outputs, 1, pred, 1);
             if(r.data != im.data) free_image(r);
         }
         free_image(im);
@@ -566,6 +576,7 @@ void validate_classifier_multi(char *datacfg, char *filename, char *weightfile)
 
         printf("%d: top 1: %f, top %d: %f\n", i, avg_acc/(i+1), topk, avg_topk/(i+1));
     }
+    free(input);
 }
 
 void try_classifier(char *datacfg, char *cfgfile, char *weightfile, char *filename, int layer_num)
@@ -651,11 +662,7 @@ void try_classifier(char *datacfg, char *cfgfile, char *weightfile, char *filena
 
 void predict_classifier(char *datacfg, char *cfgfile, char *weightfile, char *filename, int top)
 {
-    network net = parse_network_cfg(cfgfile);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
-    set_batch_network(&net, 1);
+    network net = load_network_inference(cfgfile, weightfile);
     srand(2222222);
 
     list *options = read_data_cfg(datacfg);
@@ -1033,11 +1040,7 @@ void demo_classifier(char *datacfg, char *cfgfile, char *weightfile, int cam_ind
 {
 #ifdef OPENCV
     printf("Classifier Demo\n");
-    network net = parse_network_cfg(cfgfile);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
-    set_batch_network(&net, 1);
+    network net = load_network_inference(cfgfile, weightfile);
     list *options = read_data_cfg(datacfg);
 
     srand(2222222);
@@ -1112,6 +1115,7 @@ void run_classifier(int argc, char **argv)
     int cam_index = find_int_arg(argc, argv, "-c", 0);
     int top = find_int_arg(argc, argv, "-t", 0);
     int clear = find_arg(argc, argv, "-clear");
+    int batch = find_int_arg(argc, argv, "-batch", 1);
     char *data = argv[3];
     char *cfg = argv[4];
     char *weights = (argc > 5) ? argv[5] : 0;
@@ -1126,7 +1130,7 @@ void run_classifier(int argc, char **argv)
     else if(0==strcmp(argv[2], "threat")) threat_classifier(data, cfg, weights, cam_index, filename);
     else if(0==strcmp(argv[2], "test")) test_classifier(data, cfg, weights, layer);
     else if(0==strcmp(argv[2], "label")) label_classifier(data, cfg, weights);
-    else if(0==strcmp(argv[2], "valid")) validate_classifier_single(data, cfg, weights);
+    else if(0==strcmp(argv[2], "valid")) validate_classifier_single(data, cfg, weights, batch);
     else if(0==strcmp(argv[2], "validmulti")) validate_classifier_multi(data, cfg, weights);
     else if(0==strcmp(argv[2], "valid10")) validate_classifier_10(data, cfg, weights);
     else if(0==strcmp(argv[2], "validcrop")) validate_classifier_crop(data, cfg, weights);
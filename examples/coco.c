@@ -97,14 +97,15 @@ void train_coco(char *cfgfile, char *weightfile)
     save_weights(net, buff);
 }
 
-void print_cocos(FILE *fp, int image_id, box *boxes, float **probs, int num_boxes, int classes, int w, int h)
+void print_cocos(FILE *fp, int image_id, detection *dets, int num_boxes, int w, int h)
 {
     int i, j;
     for(i = 0; i < num_boxes; ++i){
-        float xmin = boxes[i].x - boxes[i].w/2.;
-        float xmax = boxes[i].x + boxes[i].w/2.;
-        float ymin = boxes[i].y - boxes[i].h/2.;
-        float ymax = boxes[i].y + boxes[i].h/2.;
+        box b = dets[i].bbox;
+        float xmin = b.x - b.w/2.;
+        float xmax = b.x + b.w/2.;
+        float ymin = b.y - b.h/2.;
+        float ymax = b.y + b.h/2.;
 
         if (xmin < 0) xmin = 0;
         if (ymin < 0) ymin = 0;
@@ -116,8 +117,9 @@ void print_cocos(FILE *fp, int image_id, box *boxes, float **probs, int num_boxe
         float bw = xmax - xmin;
         float bh = ymax - ymin;
 
-        for(j = 0; j < classes; ++j){
-            if (probs[i][j]) fprintf(fp, "{\"image_id\":%d, \"category_id\":%d, \"bbox\":[%f, %f, %f, %f], \"score\":%f},\n", image_id, coco_ids[j], bx, by, bw, bh, probs[i][j]);
+        for(j = 0; j < dets[i].nscores; ++j){
+            detection_score s = dets[i].scores[j];
+            if (s.prob) fprintf(fp, "{\"image_id\":%d, \"category_id\":%d, \"bbox\":[%f, %f, %f, %f], \"score\":%f},\n", image_id, coco_ids[s.id], bx, by, bw, bh, s.prob);
         }
     }
 }
@@ -130,11 +132,7 @@ int get_coco_image_id(char *filename)
 
 void validate_coco(char *cfgfile, char *weightfile)
 {
-    network net = parse_network_cfg(cfgfile);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
-    set_batch_network(&net, 1);
+    network net = load_network_inference(cfgfile, weightfile);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net.learning_rate, net.momentum, net.decay);
     srand(time(0));
 
@@ -146,17 +144,13 @@ void validate_coco(char *cfgfile, char *weightfile)
 
     layer l = net.layers[net.n-1];
     int classes = l.classes;
-    int side = l.side;
 
-    int j;
     char buff[1024];
     snprintf(buff, 1024, "%s/coco_results.json", base);
     FILE *fp = fopen(buff, "w");
     fprintf(fp, "[\n");
 
-    box *boxes = calloc(side*side*l.n, sizeof(box));
-    float **probs = calloc(side*side*l.n, sizeof(float *));
-    for(j = 0; j < side*side*l.n; ++j) probs[j] = calloc(classes, sizeof(float *));
+    detection_list dets = {0};
 
     int m = plist->size;
     int i=0;
@@ -205,9 +199,9 @@ void validate_coco(char *cfgfile, char *weightfile)
             network_predict(net, X);
             int w = val[t].w;
             int h = val[t].h;
-            get_detection_boxes(l, w, h, thresh, probs, boxes, 0);
-            if (nms) do_nms_sort(boxes, probs, side*side*l.n, classes, iou_thresh);
-            print_cocos(fp, image_id, boxes, probs, side*side*l.n, classes, w, h);
+            get_detection_detections(l, w, h, thresh, 0, &dets);
+            if (nms) do_nms_sort(dets.dets, dets.n, classes, iou_thresh);
+            print_cocos(fp, image_id, dets.dets, dets.n, w, h);
             free_image(val[t]);
             free_image(val_resized[t]);
         }
@@ -215,17 +209,14 @@ void validate_coco(char *cfgfile, char *weightfile)
     fseek(fp, -2, SEEK_CUR); 
     fprintf(fp, "\n]\n");
     fclose(fp);
+    free_detections(&dets);
 
     fprintf(stderr, "Total Detection Time: %f Seconds\n", (double)(time(0) - start));
 }
 
 void validate_coco_recall(char *cfgfile, char *weightfile)
 {
-    network net = parse_network_cfg(cfgfile);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
-    set_batch_network(&net, 1);
+    network net = load_network_inference(cfgfile, weightfile);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net.learning_rate, net.momentum, net.decay);
     srand(time(0));
 
@@ -235,7 +226,6 @@ void validate_coco_recall(char *cfgfile, char *weightfile)
 
     layer l = net.layers[net.n-1];
     int classes = l.classes;
-    int side = l.side;
 
     int j, k;
     FILE **fps = calloc(classes, sizeof(FILE *));
@@ -244,9 +234,7 @@ void validate_coco_recall(char *cfgfile, char *weightfile)
         snprintf(buff, 1024, "%s%s.txt", base, coco_classes[j]);
         fps[j] = fopen(buff, "w");
     }
-    box *boxes = calloc(side*side*l.n, sizeof(box));
-    float **probs = calloc(side*side*l.n, sizeof(float *));
-    for(j = 0; j < side*side*l.n; ++j) probs[j] = calloc(classes, sizeof(float *));
+    detection_list dets = {0};
 
     int m = plist->size;
     int i=0;
@@ -267,8 +255,8 @@ void validate_coco_recall(char *cfgfile, char *weightfile)
         image sized = resize_image(orig, net.w, net.h);
         char *id = basecfg(path);
         network_predict(net, sized.data);
-        get_detection_boxes(l, 1, 1, thresh, probs, boxes, 1);
-        if (nms) do_nms(boxes, probs, side*side*l.n, 1, nms_thresh);
+        get_detection_detections(l, 1, 1, thresh, 1, &dets);
+        if (nms) do_nms(dets.dets, dets.n, nms_thresh);
 
         char labelpath[4096];
         find_replace(path, "images", "labels", labelpath);
@@ -278,8 +266,8 @@ void validate_coco_recall(char *cfgfile, char *weightfile)
 
         int num_labels = 0;
         box_label *truth = read_boxes(labelpath, &num_labels);
-        for(k = 0; k < side*side*l.n; ++k){
-            if(probs[k][0] > thresh){
+        for(k = 0; k < dets.n; ++k){
+            if(detection_prob(dets.dets[k], 0) > thresh){
                 ++proposals;
             }
         }
@@ -287,9 +275,9 @@ void validate_coco_recall(char *cfgfile, char *weightfile)
             ++total;
             box t = {truth[j].x, truth[j].y, truth[j].w, truth[j].h};
             float best_iou = 0;
-            for(k = 0; k < side*side*l.n; ++k){
-                float iou = box_iou(boxes[k], t);
-                if(probs[k][0] > thresh && iou > best_iou){
+            for(k = 0; k < dets.n; ++k){
+                float iou = box_iou(dets.dets[k].bbox, t);
+                if(detection_prob(dets.dets[k], 0) > thresh && iou > best_iou){
                     best_iou = iou;
                 }
             }
@@ -304,26 +292,20 @@ void validate_coco_recall(char *cfgfile, char *weightfile)
         free_image(orig);
         free_image(sized);
     }
+    free_detections(&dets);
 }
 
 void test_coco(char *cfgfile, char *weightfile, char *filename, float thresh)
 {
     image **alphabet = load_alphabet();
-    network net = parse_network_cfg(cfgfile);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
+    network net = load_network_inference(cfgfile, weightfile);
     detection_layer l = net.layers[net.n-1];
-    set_batch_network(&net, 1);
     srand(2222222);
     float nms = .4;
     clock_t time;
     char buff[256];
     char *input = buff;
-    int j;
-    box *boxes = calloc(l.side*l.side*l.n, sizeof(box));
-    float **probs = calloc(l.side*l.side*l.n, sizeof(float *));
-    for(j = 0; j < l.side*l.side*l.n; ++j) probs[j] = calloc(l.classes, sizeof(float *));
+    detection_list dets = {0};
     while(1){
         if(filename){
             strncpy(input, filename, 256);
@@ -340,9 +322,9 @@ void test_coco(char *cfgfile, char *weightfile, char *filename, float thresh)
         time=clock();
         network_predict(net, X);
         printf("%s: Predicted in %f seconds.\n", input, sec(clock()-time));
-        get_detection_boxes(l, 1, 1, thresh, probs, boxes, 0);
-        if (nms) do_nms_sort(boxes, probs, l.side*l.side*l.n, l.classes, nms);
-        draw_detections(im, l.side*l.side*l.n, thresh, boxes, probs, coco_classes, alphabet, 80);
+        get_detection_detections(l, 1, 1, thresh, 0, &dets);
+        if (nms) do_nms_sort(dets.dets, dets.n, l.classes, nms);
+        draw_detections(im, dets.dets, dets.n, thresh, coco_classes, alphabet, 80);
         save_image(im, "prediction");
         show_image(im, "predictions");
         free_image(im);
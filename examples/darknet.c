@@ -186,6 +186,15 @@ void rescale_net(char *cfgfile, char *weightfile, char *outfile)
     save_weights(net, outfile);
 }
 
+void convert_weights(char *cfgfile, char *weightfile, char *outfile, int legacy)
+{
+    gpu_index = -1;
+    network net = parse_network_cfg(cfgfile);
+    load_weights(&net, weightfile);
+    if(legacy) save_weights(net, outfile);
+    else save_weights_container(net, outfile);
+}
+
 void rgbgr_net(char *cfgfile, char *weightfile, char *outfile)
 {
     gpu_index = -1;
@@ -344,6 +353,23 @@ void denormalize_net(char *cfgfile, char *weightfile, char *outfile)
     save_weights(net, outfile);
 }
 
+void fuse_net(char *cfgfile, char *weightfile, char *outfile)
+{
+    gpu_index = -1;
+    network net = parse_network_cfg(cfgfile);
+    if (weightfile) {
+        load_weights(&net, weightfile);
+    }
+    fuse_network_for_inference(&net);
+    /* Folded layers keep identity statistics, so save them in the batchnorm format the cfg expects. */
+    int i;
+    for (i = 0; i < net.n; ++i) {
+        layer *l = net.layers + i;
+        if ((l->type == CONVOLUTIONAL || l->type == CONNECTED) && l->rolling_mean) l->batch_normalize = 1;
+    }
+    save_weights(net, outfile);
+}
+
 void mkimg(char *cfgfile, char *weightfile, int h, int w, int num, char *prefix)
 {
     network net = load_network(cfgfile, weightfile, 0);
@@ -392,6 +418,8 @@ int main(int argc, char **argv)
         return 0;
     }
     gpu_index = find_int_arg(argc, argv, "-i", 0);
+    int threads = find_int_arg(argc, argv, "-threads", 0);
+    if(threads > 0) set_cpu_threads(threads);
     if(find_arg(argc, argv, "-nogpu")) {
         gpu_index = -1;
     }
@@ -464,12 +492,48 @@ int main(int argc, char **argv)
         reset_normalize_net(argv[2], argv[3], argv[4]);
     } else if (0 == strcmp(argv[1], "denormalize")){
         denormalize_net(argv[2], argv[3], argv[4]);
+    } else if (0 == strcmp(argv[1], "fuse")){
+        fuse_net(argv[2], argv[3], argv[4]);
     } else if (0 == strcmp(argv[1], "statistics")){
         statistics_net(argv[2], argv[3]);
     } else if (0 == strcmp(argv[1], "normalize")){
         normalize_net(argv[2], argv[3], argv[4]);
     } else if (0 == strcmp(argv[1], "rescale")){
         rescale_net(argv[2], argv[3], argv[4]);
+    } else if (0 == strcmp(argv[1], "gemm")){
+        test_blas();
+    } else if (0 == strcmp(argv[1], "winograd")){
+        test_winograd();
+    } else if (0 == strcmp(argv[1], "resize")){
+        test_resize_plans();
+    } else if (0 == strcmp(argv[1], "nms")){
+        test_nms();
+    } else if (0 == strcmp(argv[1], "activations")){
+        test_activations();
+    } else if (0 == strcmp(argv[1], "pack")){
+        int max = find_int_arg(argc, argv, "-max", 0);
+        if(argc < 4 || !argv[2] || !argv[3]){
+            fprintf(stderr, "usage: %s pack <image list> <output> [-max size]\n", argv[0]);
+            return 0;
+        }
+        pack_dataset(argv[2], argv[3], max);
+    } else if (0 == strcmp(argv[1], "container") || 0 == strcmp(argv[1], "legacy")){
+        if(argc < 5){
+            fprintf(stderr, "usage: %s %s <cfg> <weights> <output>\n", argv[0], argv[1]);
+            return 0;
+        }
+        convert_weights(argv[2], argv[3], argv[4], 0 == strcmp(argv[1], "legacy"));
+    } else if (0 == strcmp(argv[1], "checkweights")){
+        if(argc < 3){
+            fprintf(stderr, "usage: %s checkweights <weights container> [cfg]\n", argv[0]);
+            return 0;
+        }
+        if(!check_weights_container(argv[2])) return 1;
+        if(argc > 3){
+            network net = parse_network_cfg(argv[3]);
+            load_weights(&net, argv[2]);
+            printf("%s matches %s\n", argv[2], argv[3]);
+        }
     } else if (0 == strcmp(argv[1], "ops")){
         operations(argv[2]);
     } else if (0 == strcmp(argv[1], "speed")){
@@ -34,7 +34,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
 
     int imgs = net.batch * net.subdivisions * ngpus;
     printf("Learning Rate: %g, Momentum: %g, Decay: %g\n", net.learning_rate, net.momentum, net.decay);
-    data train, buffer;
+    data train;
 
     layer l = net.layers[net.n - 1];
 
@@ -45,6 +45,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     //int N = plist->size;
     char **paths = (char **)list_to_array(plist);
 
+    set_image_cache_size(option_find_int_quiet(options, "image_cache", 0));
     load_args args = {0};
     args.w = net.w;
     args.h = net.h;
@@ -54,7 +55,6 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     args.classes = classes;
     args.jitter = jitter;
     args.num_boxes = l.max_boxes;
-    args.d = &buffer;
     args.type = DETECTION_DATA;
     args.threads = 8;
 
@@ -63,7 +63,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     args.saturation = net.saturation;
     args.hue = net.hue;
 
-    pthread_t load_thread = load_data(args);
+    data_loader *loader = make_data_loader(args, 2);
     clock_t time;
     int count = 0;
     //while(i*imgs < N*120){
@@ -77,10 +77,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             args.w = dim;
             args.h = dim;
 
-            pthread_join(load_thread, 0);
-            train = buffer;
-            free_data(train);
-            load_thread = load_data(args);
+            data_loader_reset(loader, args);
 
             for(i = 0; i < ngpus; ++i){
                 resize_network(nets + i, dim, dim);
@@ -88,9 +85,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             net = nets[0];
         }
         time=clock();
-        pthread_join(load_thread, 0);
-        train = buffer;
-        load_thread = load_data(args);
+        train = data_loader_next(loader);
 
         /*
         int k;
@@ -150,7 +145,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
             sprintf(buff, "%s/%s_%d.weights", backup_directory, base, i);
             save_weights(net, buff);
         }
-        free_data(train);
+        data_loader_release(loader, train);
     }
 #ifdef GPU
     if(ngpus != 1) sync_nets(nets, ngpus, 0);
@@ -158,6 +153,7 @@ void train_detector(char *datacfg, char *cfgfile, char *weightfile, int *gpus, i
     char buff[256];
     sprintf(buff, "%s/%s_final.weights", backup_directory, base);
     save_weights(net, buff);
+    free_data_loader(loader);
 }
 
 
@@ -167,15 +163,16 @@ static int get_coco_image_id(char *filename)
     return atoi(p+1);
 }
 
-static void print_cocos(FILE *fp, char *image_path, box *boxes, float **probs, int num_boxes, int classes, int w, int h)
+static void print_cocos(FILE *fp, char *image_path, detection *dets, int num_boxes, int w, int h)
 {
     int i, j;
     int image_id = get_coco_image_id(image_path);
     for(i = 0; i < num_boxes; ++i){
-        float xmin = boxes[i].x - boxes[i].w/2.;
-        float xmax = boxes[i].x + boxes[i].w/2.;
-        float ymin = boxes[i].y - boxes[i].h/2.;
-        float ymax = boxes[i].y + boxes[i].h/2.;
+        box b = dets[i].bbox;
+        float xmin = b.x - b.w/2.;
+        float xmax = b.x + b.w/2.;
+        float ymin = b.y - b.h/2.;
+        float ymax = b.y + b.h/2.;
 
         if (xmin < 0) xmin = 0;
         if (ymin < 0) ymin = 0;
@@ -187,50 +184,54 @@ static void print_cocos(FILE *fp, char *image_path, box *boxes, float **probs, i
         float bw = xmax - xmin;
         float bh = ymax - ymin;
 
-        for(j = 0; j < classes; ++j){
-            if (probs[i][j]) fprintf(fp, "{\"image_id\":%d, \"category_id\":%d, \"bbox\":[%f, %f, %f, %f], \"score\":%f},\n", image_id, coco_ids[j], bx, by, bw, bh, probs[i][j]);
+        for(j = 0; j < dets[i].nscores; ++j){
+            detection_score s = dets[i].scores[j];
+            if (s.prob) fprintf(fp, "{\"image_id\":%d, \"category_id\":%d, \"bbox\":[%f, %f, %f, %f], \"score\":%f},\n", image_id, coco_ids[s.id], bx, by, bw, bh, s.prob);
         }
     }
 }
 
-void print_detector_detections(FILE **fps, char *id, box *boxes, float **probs, int total, int classes, int w, int h)
+void print_detector_detections(FILE **fps, char *id, detection *dets, int total, int w, int h)
 {
     int i, j;
     for(i = 0; i < total; ++i){
-        float xmin = boxes[i].x - boxes[i].w/2. + 1;
-        float xmax = boxes[i].x + boxes[i].w/2. + 1;
-        float ymin = boxes[i].y - boxes[i].h/2. + 1;
-        float ymax = boxes[i].y + boxes[i].h/2. + 1;
+        box b = dets[i].bbox;
+        float xmin = b.x - b.w/2. + 1;
+        float xmax = b.x + b.w/2. + 1;
+        float ymin = b.y - b.h/2. + 1;
+        float ymax = b.y + b.h/2. + 1;
 
         if (xmin < 1) xmin = 1;
         if (ymin < 1) ymin = 1;
         if (xmax > w) xmax = w;
         if (ymax > h) ymax = h;
 
-        for(j = 0; j < classes; ++j){
-            if (probs[i][j]) fprintf(fps[j], "%s %f %f %f %f %f\n", id, probs[i][j],
+        for(j = 0; j < dets[i].nscores; ++j){
+            detection_score s = dets[i].scores[j];
+            if (s.prob) fprintf(fps[s.id], "%s %f %f %f %f %f\n", id, s.prob,
                     xmin, ymin, xmax, ymax);
         }
     }
 }
 
-void print_imagenet_detections(FILE *fp, int id, box *boxes, float **probs, int total, int classes, int w, int h)
+void print_imagenet_detections(FILE *fp, int id, detection *dets, int total, int w, int h)
 {
     int i, j;
     for(i = 0; i < total; ++i){
-        float xmin = boxes[i].x - boxes[i].w/2.;
-        float xmax = boxes[i].x + boxes[i].w/2.;
-        float ymin = boxes[i].y - boxes[i].h/2.;
-        float ymax = boxes[i].y + boxes[i].h/2.;
+        box b = dets[i].bbox;
+        float xmin = b.x - b.w/2.;
+        float xmax = b.x + b.w/2.;
+        float ymin = b.y - b.h/2.;
+        float ymax = b.y + b.h/2.;
 
         if (xmin < 0) xmin = 0;
         if (ymin < 0) ymin = 0;
         if (xmax > w) xmax = w;
         if (ymax > h) ymax = h;
 
-        for(j = 0; j < classes; ++j){
-            int class = j;
-            if (probs[i][class]) fprintf(fp, "%d %d %f %f %f %f %f\n", id, j+1, probs[i][class],
+        for(j = 0; j < dets[i].nscores; ++j){
+            detection_score s = dets[i].scores[j];
+            if (s.prob) fprintf(fp, "%d %d %f %f %f %f %f\n", id, s.id+1, s.prob,
                     xmin, ymin, xmax, ymax);
         }
     }
@@ -248,11 +249,12 @@ void validate_detector_flip(char *datacfg, char *cfgfile, char *weightfile, char
     int *map = 0;
     if (mapf) map = read_map(mapf);
 
-    network net = parse_network_cfg(cfgfile);
+    network net = parse_network_cfg_custom(cfgfile, 2, 0);
     if(weightfile){
         load_weights(&net, weightfile);
     }
-    set_batch_network(&net, 2);
+    fuse_network_for_inference(&net);
+    plan_network_memory(&net);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net.learning_rate, net.momentum, net.decay);
     srand(time(0));
 
@@ -290,9 +292,7 @@ void validate_detector_flip(char *datacfg, char *cfgfile, char *weightfile, char
     }
 
 
-    box *boxes = calloc(l.w*l.h*l.n, sizeof(box));
-    float **probs = calloc(l.w*l.h*l.n, sizeof(float *));
-    for(j = 0; j < l.w*l.h*l.n; ++j) probs[j] = calloc(classes+1, sizeof(float *));
+    detection_list dets = {0};
 
     int m = plist->size;
     int i=0;
@@ -310,6 +310,7 @@ void validate_detector_flip(char *datacfg, char *cfgfile, char *weightfile, char
 
     image input = make_image(net.w, net.h, net.c*2);
 
+    set_image_cache_size(option_find_int_quiet(options, "image_cache", 0));
     load_args args = {0};
     args.w = net.w;
     args.h = net.h;
@@ -346,14 +347,14 @@ void validate_detector_flip(char *datacfg, char *cfgfile, char *weightfile, char
             network_predict(net, input.data);
             int w = val[t].w;
             int h = val[t].h;
-            get_region_boxes(l, w, h, net.w, net.h, thresh, probs, boxes, 0, map, .5, 0);
-            if (nms) do_nms_sort(boxes, probs, l.w*l.h*l.n, classes, nms);
+            get_region_detections(l, w, h, net.w, net.h, thresh, 0, map, .5, 0, &dets);
+            if (nms) do_nms_sort(dets.dets, dets.n, classes, nms);
             if (coco){
-                print_cocos(fp, path, boxes, probs, l.w*l.h*l.n, classes, w, h);
+                print_cocos(fp, path, dets.dets, dets.n, w, h);
             } else if (imagenet){
-                print_imagenet_detections(fp, i+t-nthreads+1, boxes, probs, l.w*l.h*l.n, classes, w, h);
+                print_imagenet_detections(fp, i+t-nthreads+1, dets.dets, dets.n, w, h);
             } else {
-                print_detector_detections(fps, id, boxes, probs, l.w*l.h*l.n, classes, w, h);
+                print_detector_detections(fps, id, dets.dets, dets.n, w, h);
             }
             free(id);
             free_image(val[t]);
@@ -368,11 +369,101 @@ void validate_detector_flip(char *datacfg, char *cfgfile, char *weightfile, char
         fprintf(fp, "\n]\n");
         fclose(fp);
     }
+    free_detections(&dets);
     fprintf(stderr, "Total Detection Time: %f Seconds\n", (double)(time(0) - start));
 }
 
 
-void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *outfile)
+typedef struct{
+    int index;
+    char *path;
+    int w, h;
+    image resized;
+    float *output;
+    detection_list dets;
+} valid_item;
+
+typedef struct{
+    network *nets;
+    float **inputs;
+    int *map;
+    int classes;
+    float thresh;
+    float nms;
+    int coco;
+    int imagenet;
+    FILE *fp;
+    FILE **fps;
+} valid_ctx;
+
+static void valid_load(void *ptr, int worker, void **items, int n)
+{
+    valid_ctx *v = ptr;
+    valid_item *it = items[0];
+    image im = load_image_color(it->path, 0, 0);
+    it->w = im.w;
+    it->h = im.h;
+    it->resized = letterbox_image(im, v->nets[0].w, v->nets[0].h);
+    free_image(im);
+}
+
+static void valid_forward(void *ptr, int worker, void **items, int n)
+{
+    valid_ctx *v = ptr;
+    network net = v->nets[worker];
+    int size = net.w*net.h*net.c;
+    int t;
+    for(t = 0; t < n; ++t){
+        valid_item *it = items[t];
+        copy_cpu(size, it->resized.data, 1, v->inputs[worker] + t*size, 1);
+        free_image(it->resized);
+    }
+    network_predict(net, v->inputs[worker]);
+    layer l = net.layers[net.n-1];
+    for(t = 0; t < n; ++t){
+        valid_item *it = items[t];
+        it->output = calloc(l.outputs, sizeof(float));
+        copy_cpu(l.outputs, l.output + t*l.outputs, 1, it->output, 1);
+    }
+}
+
+static void valid_decode(void *ptr, int worker, void **items, int n)
+{
+    valid_ctx *v = ptr;
+    network net = v->nets[0];
+    valid_item *it = items[0];
+    layer l = net.layers[net.n-1];
+    l.batch = 1;
+    l.output = it->output;
+    get_region_detections(l, it->w, it->h, net.w, net.h, v->thresh, 0, v->map, .5, 0, &it->dets);
+    if (v->nms) do_nms_sort(it->dets.dets, it->dets.n, v->classes, v->nms);
+    free(it->output);
+}
+
+static void valid_write(void *ptr, int worker, void **items, int n)
+{
+    valid_ctx *v = ptr;
+    valid_item *it = items[0];
+    detection_list dets = it->dets;
+    if (v->coco){
+        print_cocos(v->fp, it->path, dets.dets, dets.n, it->w, it->h);
+    } else if (v->imagenet){
+        print_imagenet_detections(v->fp, it->index+1, dets.dets, dets.n, it->w, it->h);
+    } else {
+        char *id = basecfg(it->path);
+        print_detector_detections(v->fps, id, dets.dets, dets.n, it->w, it->h);
+        free(id);
+    }
+    if(it->index % 100 == 99) fprintf(stderr, "%d\n", it->index+1);
+    free_detections(&it->dets);
+    free(it);
+}
+
+/* Images go through a pipeline: workers[0] threads load and letterbox them,
+ * workers[1] network contexts run them batch at a time, workers[2] threads
+ * turn the outputs into boxes and run NMS, and the results are written in
+ * list order. */
+void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *outfile, int batch, int *workers)
 {
     int j;
     list *options = read_data_cfg(datacfg);
@@ -384,11 +475,7 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
     int *map = 0;
     if (mapf) map = read_map(mapf);
 
-    network net = parse_network_cfg(cfgfile);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
-    set_batch_network(&net, 1);
+    network net = load_network_inference_custom(cfgfile, weightfile, batch);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net.learning_rate, net.momentum, net.decay);
     srand(time(0));
 
@@ -425,72 +512,43 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
         }
     }
 
-
-    box *boxes = calloc(l.w*l.h*l.n, sizeof(box));
-    float **probs = calloc(l.w*l.h*l.n, sizeof(float *));
-    for(j = 0; j < l.w*l.h*l.n; ++j) probs[j] = calloc(classes+1, sizeof(float *));
-
     int m = plist->size;
-    int i=0;
-    int t;
-
-    float thresh = .005;
-    float nms = .45;
-
-    int nthreads = 4;
-    image *val = calloc(nthreads, sizeof(image));
-    image *val_resized = calloc(nthreads, sizeof(image));
-    image *buf = calloc(nthreads, sizeof(image));
-    image *buf_resized = calloc(nthreads, sizeof(image));
-    pthread_t *thr = calloc(nthreads, sizeof(pthread_t));
-
-    load_args args = {0};
-    args.w = net.w;
-    args.h = net.h;
-    //args.type = IMAGE_DATA;
-    args.type = LETTERBOX_DATA;
+    int i;
+    int forwards = workers[1];
+    if(net.gpu_index >= 0) forwards = 1;
+
+    valid_ctx v = {0};
+    v.nets = calloc(forwards, sizeof(network));
+    v.inputs = calloc(forwards, sizeof(float *));
+    v.nets[0] = net;
+    for(i = 1; i < forwards; ++i) v.nets[i] = clone_network_context(&net);
+    for(i = 0; i < forwards; ++i) v.inputs[i] = calloc(net.inputs*batch, sizeof(float));
+    v.map = map;
+    v.classes = classes;
+    v.thresh = .005;
+    v.nms = .45;
+    v.coco = coco;
+    v.imagenet = imagenet;
+    v.fp = fp;
+    v.fps = fps;
+
+    set_image_cache_size(option_find_int_quiet(options, "image_cache", 0));
+    pipeline *p = make_pipeline(2*batch*forwards);
+    add_pipeline_stage(p, valid_load, &v, workers[0], 1);
+    add_pipeline_stage(p, valid_forward, &v, forwards, batch);
+    add_pipeline_stage(p, valid_decode, &v, workers[2], 1);
+    add_pipeline_sink(p, valid_write, &v);
 
-    for(t = 0; t < nthreads; ++t){
-        args.path = paths[i+t];
-        args.im = &buf[t];
-        args.resized = &buf_resized[t];
-        thr[t] = load_data_in_thread(args);
-    }
     time_t start = time(0);
-    for(i = nthreads; i < m+nthreads; i += nthreads){
-        fprintf(stderr, "%d\n", i);
-        for(t = 0; t < nthreads && i+t-nthreads < m; ++t){
-            pthread_join(thr[t], 0);
-            val[t] = buf[t];
-            val_resized[t] = buf_resized[t];
-        }
-        for(t = 0; t < nthreads && i+t < m; ++t){
-            args.path = paths[i+t];
-            args.im = &buf[t];
-            args.resized = &buf_resized[t];
-            thr[t] = load_data_in_thread(args);
-        }
-        for(t = 0; t < nthreads && i+t-nthreads < m; ++t){
-            char *path = paths[i+t-nthreads];
-            char *id = basecfg(path);
-            float *X = val_resized[t].data;
-            network_predict(net, X);
-            int w = val[t].w;
-            int h = val[t].h;
-            get_region_boxes(l, w, h, net.w, net.h, thresh, probs, boxes, 0, map, .5, 0);
-            if (nms) do_nms_sort(boxes, probs, l.w*l.h*l.n, classes, nms);
-            if (coco){
-                print_cocos(fp, path, boxes, probs, l.w*l.h*l.n, classes, w, h);
-            } else if (imagenet){
-                print_imagenet_detections(fp, i+t-nthreads+1, boxes, probs, l.w*l.h*l.n, classes, w, h);
-            } else {
-                print_detector_detections(fps, id, boxes, probs, l.w*l.h*l.n, classes, w, h);
-            }
-            free(id);
-            free_image(val[t]);
-            free_image(val_resized[t]);
-        }
+    for(i = 0; i < m; ++i){
+        valid_item *it = calloc(1, sizeof(valid_item));
+        it->index = i;
+        it->path = paths[i];
+        pipeline_push(p, it);
     }
+    finish_pipeline(p);
+    free_pipeline(p);
+
     for(j = 0; j < classes; ++j){
         if(fps) fclose(fps[j]);
     }
@@ -499,16 +557,16 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
         fprintf(fp, "\n]\n");
         fclose(fp);
     }
+    for(i = 1; i < forwards; ++i) free_network(v.nets[i]);
+    for(i = 0; i < forwards; ++i) free(v.inputs[i]);
+    free(v.nets);
+    free(v.inputs);
     fprintf(stderr, "Total Detection Time: %f Seconds\n", (double)(time(0) - start));
 }
 
 void validate_detector_recall(char *cfgfile, char *weightfile)
 {
-    network net = parse_network_cfg(cfgfile);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
-    set_batch_network(&net, 1);
+    network net = load_network_inference(cfgfile, weightfile);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net.learning_rate, net.momentum, net.decay);
     srand(time(0));
 
@@ -516,12 +574,9 @@ void validate_detector_recall(char *cfgfile, char *weightfile)
     char **paths = (char **)list_to_array(plist);
 
     layer l = net.layers[net.n-1];
-    int classes = l.classes;
 
     int j, k;
-    box *boxes = calloc(l.w*l.h*l.n, sizeof(box));
-    float **probs = calloc(l.w*l.h*l.n, sizeof(float *));
-    for(j = 0; j < l.w*l.h*l.n; ++j) probs[j] = calloc(classes+1, sizeof(float *));
+    detection_list dets = {0};
 
     int m = plist->size;
     int i=0;
@@ -541,8 +596,8 @@ void validate_detector_recall(char *cfgfile, char *weightfile)
         image sized = resize_image(orig, net.w, net.h);
         char *id = basecfg(path);
         network_predict(net, sized.data);
-        get_region_boxes(l, sized.w, sized.h, net.w, net.h, thresh, probs, boxes, 1, 0, .5, 1);
-        if (nms) do_nms(boxes, probs, l.w*l.h*l.n, 1, nms);
+        get_region_detections(l, sized.w, sized.h, net.w, net.h, thresh, 1, 0, .5, 1, &dets);
+        if (nms) do_nms(dets.dets, dets.n, nms);
 
         char labelpath[4096];
         find_replace(path, "images", "labels", labelpath);
@@ -552,8 +607,8 @@ void validate_detector_recall(char *cfgfile, char *weightfile)
 
         int num_labels = 0;
         box_label *truth = read_boxes(labelpath, &num_labels);
-        for(k = 0; k < l.w*l.h*l.n; ++k){
-            if(probs[k][0] > thresh){
+        for(k = 0; k < dets.n; ++k){
+            if(detection_prob(dets.dets[k], 0) > thresh){
                 ++proposals;
             }
         }
@@ -561,9 +616,9 @@ void validate_detector_recall(char *cfgfile, char *weightfile)
             ++total;
             box t = {truth[j].x, truth[j].y, truth[j].w, truth[j].h};
             float best_iou = 0;
-            for(k = 0; k < l.w*l.h*l.n; ++k){
-                float iou = box_iou(boxes[k], t);
-                if(probs[k][0] > thresh && iou > best_iou){
+            for(k = 0; k < dets.n; ++k){
+                float iou = box_iou(dets.dets[k].bbox, t);
+                if(detection_prob(dets.dets[k], 0) > thresh && iou > best_iou){
                     best_iou = iou;
                 }
             }
@@ -578,6 +633,7 @@ void validate_detector_recall(char *cfgfile, char *weightfile)
         free_image(orig);
         free_image(sized);
     }
+    free_detections(&dets);
 }
 
 void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, char *outfile, int fullscreen)
@@ -587,17 +643,13 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
     char **names = get_labels(name_list);
 
     image **alphabet = load_alphabet();
-    network net = parse_network_cfg(cfgfile);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
-    set_batch_network(&net, 1);
+    network net = load_network_inference(cfgfile, weightfile);
     srand(2222222);
     clock_t time;
     char buff[256];
     char *input = buff;
-    int j;
     float nms=.4;
+    detection_list dets = {0};
     while(1){
         if(filename){
             strncpy(input, filename, 256);
@@ -616,18 +668,15 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
         //resize_network(&net, sized.w, sized.h);
         layer l = net.layers[net.n-1];
 
-        box *boxes = calloc(l.w*l.h*l.n, sizeof(box));
-        float **probs = calloc(l.w*l.h*l.n, sizeof(float *));
-        for(j = 0; j < l.w*l.h*l.n; ++j) probs[j] = calloc(l.classes + 1, sizeof(float *));
 
         float *X = sized.data;
         time=clock();
         network_predict(net, X);
         printf("%s: Predicted in %f seconds.\n", input, sec(clock()-time));
-        get_region_boxes(l, im.w, im.h, net.w, net.h, thresh, probs, boxes, 0, 0, hier_thresh, 1);
-        if (nms) do_nms_obj(boxes, probs, l.w*l.h*l.n, l.classes, nms);
-        //else if (nms) do_nms_sort(boxes, probs, l.w*l.h*l.n, l.classes, nms);
-        draw_detections(im, l.w*l.h*l.n, thresh, boxes, probs, names, alphabet, l.classes);
+        get_region_detections(l, im.w, im.h, net.w, net.h, thresh, 0, 0, hier_thresh, 1, &dets);
+        if (nms) do_nms_obj(dets.dets, dets.n, nms);
+        //else if (nms) do_nms_sort(dets.dets, dets.n, l.classes, nms);
+        draw_detections(im, dets.dets, dets.n, thresh, names, alphabet, l.classes);
         if(outfile){
             save_image(im, outfile);
         }
@@ -646,10 +695,9 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
 
         free_image(im);
         free_image(sized);
-        free(boxes);
-        free_ptrs((void **)probs, l.w*l.h*l.n);
         if (filename) break;
     }
+    free_detections(&dets);
 }
 
 void run_detector(int argc, char **argv)
@@ -660,12 +708,16 @@ void run_detector(int argc, char **argv)
     int cam_index = find_int_arg(argc, argv, "-c", 0);
     int frame_skip = find_int_arg(argc, argv, "-s", 0);
     int avg = find_int_arg(argc, argv, "-avg", 3);
+    int batch = find_int_arg(argc, argv, "-batch", 1);
     if(argc < 4){
         fprintf(stderr, "usage: %s %s [train/test/valid] [cfg] [weights (optional)]\n", argv[0], argv[1]);
         return;
     }
     char *gpu_list = find_char_arg(argc, argv, "-gpus", 0);
     char *outfile = find_char_arg(argc, argv, "-out", 0);
+    int nworkers = 0;
+    int *workers = read_intlist(find_char_arg(argc, argv, "-workers", "4,1,2"), &nworkers, 0);
+    if(nworkers != 3) error("-workers takes load,forward,decode thread counts");
     int *gpus = 0;
     int gpu = 0;
     int ngpus = 0;
@@ -700,7 +752,7 @@ void run_detector(int argc, char **argv)
     char *filename = (argc > 6) ? argv[6]: 0;
     if(0==strcmp(argv[2], "test")) test_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, outfile, fullscreen);
     else if(0==strcmp(argv[2], "train")) train_detector(datacfg, cfg, weights, gpus, ngpus, clear);
-    else if(0==strcmp(argv[2], "valid")) validate_detector(datacfg, cfg, weights, outfile);
+    else if(0==strcmp(argv[2], "valid")) validate_detector(datacfg, cfg, weights, outfile, batch, workers);
     else if(0==strcmp(argv[2], "valid2")) validate_detector_flip(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "recall")) validate_detector_recall(cfg, weights);
     else if(0==strcmp(argv[2], "demo")) {
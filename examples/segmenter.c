@@ -43,6 +43,7 @@ void train_segmenter(char *datacfg, char *cfgfile, char *weightfile, int *gpus,
     int N = plist->size;
     clock_t time;
 
+    set_image_cache_size(option_find_int_quiet(options, "image_cache", 0));
     load_args args = {0};
     args.w = net.w;
     args.h = net.h;
@@ -77,22 +77,24 @@ void train_yolo(char *cfgfile, char *weightfile)
     save_weights(net, buff);
 }
 
-void print_yolo_detections(FILE **fps, char *id, box *boxes, float **probs, int total, int classes, int w, int h)
+void print_yolo_detections(FILE **fps, char *id, detection *dets, int total, int w, int h)
 {
     int i, j;
     for(i = 0; i < total; ++i){
-        float xmin = boxes[i].x - boxes[i].w/2.;
-        float xmax = boxes[i].x + boxes[i].w/2.;
-        float ymin = boxes[i].y - boxes[i].h/2.;
-        float ymax = boxes[i].y + boxes[i].h/2.;
+        box b = dets[i].bbox;
+        float xmin = b.x - b.w/2.;
+        float xmax = b.x + b.w/2.;
+        float ymin = b.y - b.h/2.;
+        float ymax = b.y + b.h/2.;
 
         if (xmin < 0) xmin = 0;
         if (ymin < 0) ymin = 0;
         if (xmax > w) xmax = w;
         if (ymax > h) ymax = h;
 
-        for(j = 0; j < classes; ++j){
-            if (probs[i][j]) fprintf(fps[j], "%s %f %f %f %f %f\n", id, probs[i][j],
+        for(j = 0; j < dets[i].nscores; ++j){
+            detection_score s = dets[i].scores[j];
+            if (s.prob) fprintf(fps[s.id], "%s %f %f %f %f %f\n", id, s.prob,
                     xmin, ymin, xmax, ymax);
         }
     }
@@ -100,11 +102,7 @@ void print_yolo_detections(FILE **fps, char *id, box *boxes, float **probs, int
 
 void validate_yolo(char *cfgfile, char *weightfile)
 {
-    network net = parse_network_cfg(cfgfile);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
-    set_batch_network(&net, 1);
+    network net = load_network_inference(cfgfile, weightfile);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net.learning_rate, net.momentum, net.decay);
     srand(time(0));
 
@@ -124,9 +122,7 @@ void validate_yolo(char *cfgfile, char *weightfile)
         snprintf(buff, 1024, "%s%s.txt", base, voc_names[j]);
         fps[j] = fopen(buff, "w");
     }
-    box *boxes = calloc(l.side*l.side*l.n, sizeof(box));
-    float **probs = calloc(l.side*l.side*l.n, sizeof(float *));
-    for(j = 0; j < l.side*l.side*l.n; ++j) probs[j] = calloc(classes, sizeof(float *));
+    detection_list dets = {0};
 
     int m = plist->size;
     int i=0;
@@ -175,24 +171,21 @@ void validate_yolo(char *cfgfile, char *weightfile)
             network_predict(net, X);
             int w = val[t].w;
             int h = val[t].h;
-            get_detection_boxes(l, w, h, thresh, probs, boxes, 0);
-            if (nms) do_nms_sort(boxes, probs, l.side*l.side*l.n, classes, iou_thresh);
-            print_yolo_detections(fps, id, boxes, probs, l.side*l.side*l.n, classes, w, h);
+            get_detection_detections(l, w, h, thresh, 0, &dets);
+            if (nms) do_nms_sort(dets.dets, dets.n, classes, iou_thresh);
+            print_yolo_detections(fps, id, dets.dets, dets.n, w, h);
             free(id);
             free_image(val[t]);
             free_image(val_resized[t]);
         }
     }
+    free_detections(&dets);
     fprintf(stderr, "Total Detection Time: %f Seconds\n", (double)(time(0) - start));
 }
 
 void validate_yolo_recall(char *cfgfile, char *weightfile)
 {
-    network net = parse_network_cfg(cfgfile);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
-    set_batch_network(&net, 1);
+    network net = load_network_inference(cfgfile, weightfile);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net.learning_rate, net.momentum, net.decay);
     srand(time(0));
 
@@ -202,7 +195,6 @@ void validate_yolo_recall(char *cfgfile, char *weightfile)
 
     layer l = net.layers[net.n-1];
     int classes = l.classes;
-    int side = l.side;
 
     int j, k;
     FILE **fps = calloc(classes, sizeof(FILE *));
@@ -211,9 +203,7 @@ void validate_yolo_recall(char *cfgfile, char *weightfile)
         snprintf(buff, 1024, "%s%s.txt", base, voc_names[j]);
         fps[j] = fopen(buff, "w");
     }
-    box *boxes = calloc(side*side*l.n, sizeof(box));
-    float **probs = calloc(side*side*l.n, sizeof(float *));
-    for(j = 0; j < side*side*l.n; ++j) probs[j] = calloc(classes, sizeof(float *));
+    detection_list dets = {0};
 
     int m = plist->size;
     int i=0;
@@ -233,8 +223,8 @@ void validate_yolo_recall(char *cfgfile, char *weightfile)
         image sized = resize_image(orig, net.w, net.h);
         char *id = basecfg(path);
         network_predict(net, sized.data);
-        get_detection_boxes(l, orig.w, orig.h, thresh, probs, boxes, 1);
-        if (nms) do_nms(boxes, probs, side*side*l.n, 1, nms);
+        get_detection_detections(l, orig.w, orig.h, thresh, 1, &dets);
+        if (nms) do_nms(dets.dets, dets.n, nms);
 
         char labelpath[4096];
         find_replace(path, "images", "labels", labelpath);
@@ -244,8 +234,8 @@ void validate_yolo_recall(char *cfgfile, char *weightfile)
 
         int num_labels = 0;
         box_label *truth = read_boxes(labelpath, &num_labels);
-        for(k = 0; k < side*side*l.n; ++k){
-            if(probs[k][0] > thresh){
+        for(k = 0; k < dets.n; ++k){
+            if(detection_prob(dets.dets[k], 0) > thresh){
                 ++proposals;
             }
         }
@@ -253,9 +243,9 @@ void validate_yolo_recall(char *cfgfile, char *weightfile)
             ++total;
             box t = {truth[j].x, truth[j].y, truth[j].w, truth[j].h};
             float best_iou = 0;
-            for(k = 0; k < side*side*l.n; ++k){
-                float iou = box_iou(boxes[k], t);
-                if(probs[k][0] > thresh && iou > best_iou){
+            for(k = 0; k < dets.n; ++k){
+                float iou = box_iou(dets.dets[k].bbox, t);
+                if(detection_prob(dets.dets[k], 0) > thresh && iou > best_iou){
                     best_iou = iou;
                 }
             }
@@ -270,26 +260,20 @@ void validate_yolo_recall(char *cfgfile, char *weightfile)
         free_image(orig);
         free_image(sized);
     }
+    free_detections(&dets);
 }
 
 void test_yolo(char *cfgfile, char *weightfile, char *filename, float thresh)
 {
     image **alphabet = load_alphabet();
-    network net = parse_network_cfg(cfgfile);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
+    network net = load_network_inference(cfgfile, weightfile);
     detection_layer l = net.layers[net.n-1];
-    set_batch_network(&net, 1);
     srand(2222222);
     clock_t time;
     char buff[256];
     char *input = buff;
-    int j;
     float nms=.4;
-    box *boxes = calloc(l.side*l.side*l.n, sizeof(box));
-    float **probs = calloc(l.side*l.side*l.n, sizeof(float *));
-    for(j = 0; j < l.side*l.side*l.n; ++j) probs[j] = calloc(l.classes, sizeof(float *));
+    detection_list dets = {0};
     while(1){
         if(filename){
             strncpy(input, filename, 256);
@@ -306,10 +290,9 @@ void test_yolo(char *cfgfile, char *weightfile, char *filename, float thresh)
         time=clock();
         network_predict(net, X);
         printf("%s: Predicted in %f seconds.\n", input, sec(clock()-time));
-        get_detection_boxes(l, 1, 1, thresh, probs, boxes, 0);
-        if (nms) do_nms_sort(boxes, probs, l.side*l.side*l.n, l.classes, nms);
-        //draw_detections(im, l.side*l.side*l.n, thresh, boxes, probs, voc_names, alphabet, 20);
-        draw_detections(im, l.side*l.side*l.n, thresh, boxes, probs, voc_names, alphabet, 20);
+        get_detection_detections(l, 1, 1, thresh, 0, &dets);
+        if (nms) do_nms_sort(dets.dets, dets.n, l.classes, nms);
+        draw_detections(im, dets.dets, dets.n, thresh, voc_names, alphabet, 20);
         save_image(im, "predictions");
         show_image(im, "predictions");
 
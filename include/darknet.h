@@ -120,6 +120,7 @@ struct layer{
     int index;
     int binary;
     int xnor;
+    int winograd;
     int steps;
     int hidden;
     int truth;
@@ -199,6 +200,7 @@ struct layer{
 
     float * weights;
     float * weight_updates;
+    struct winograd_weights *winograd_weights;
 
     float * delta;
     float * output;
@@ -214,6 +216,7 @@ struct layer{
 
     float * rolling_mean;
     float * rolling_variance;
+    float * bn_affine;
 
     float * x;
     float * x_norm;
@@ -380,6 +383,11 @@ typedef struct network{
     float *truth;
     float *delta;
     float *workspace;
+    float *arena;
+    size_t arena_size;
+    unsigned char *weights_map;
+    size_t weights_map_size;
+    int shared;
     int train;
     int index;
     float *cost;
@@ -410,10 +418,43 @@ typedef struct {
     float *data;
 } image;
 
+/* 8-bit image with interleaved channels (HWC), as decoded. */
+typedef struct {
+    int w;
+    int h;
+    int c;
+    unsigned char *data;
+} image_u8;
+
 typedef struct{
     float x, y, w, h;
 } box;
 
+typedef struct{
+    int id;
+    float prob;
+} detection_score;
+
+/* A predicted box and only its class scores above threshold, in class order. */
+typedef struct{
+    box bbox;
+    float objectness;
+    int nscores;
+    detection_score *scores;
+} detection;
+
+/* Detections of one frame, reused from frame to frame. */
+typedef struct{
+    int n;
+    int size;
+    detection *dets;
+    int nscores;
+    int scores_size;
+    detection_score *scores;
+    int keep_size;
+    int *keep;
+} detection_list;
+
 typedef struct matrix{
     int rows, cols;
     float **vals;
@@ -473,6 +514,8 @@ typedef struct{
 
 
 network load_network(char *cfg, char *weights, int clear);
+network load_network_inference(char *cfg, char *weights);
+network load_network_inference_custom(char *cfg, char *weights, int batch);
 load_args get_base_args(network net);
 
 void free_data(data d);
@@ -490,6 +533,12 @@ typedef struct list{
 } list;
 
 pthread_t load_data(load_args args);
+typedef struct data_loader data_loader;
+data_loader *make_data_loader(load_args args, int prefetch);
+data data_loader_next(data_loader *l);
+void data_loader_release(data_loader *l, data d);
+void data_loader_reset(data_loader *l, load_args args);
+void free_data_loader(data_loader *l);
 list *read_data_cfg(char *filename);
 list *read_cfg(char *filename);
 
@@ -517,6 +566,8 @@ list *read_cfg(char *filename);
 #include "gru_layer.h"
 #include "im2col.h"
 #include "image.h"
+#include "image_cache.h"
+#include "image_u8.h"
 #include "layer.h"
 #include "list.h"
 #include "local_layer.h"
@@ -525,7 +576,9 @@ list *read_cfg(char *filename);
 #include "network.h"
 #include "normalization_layer.h"
 #include "option_list.h"
+#include "pack.h"
 #include "parser.h"
+#include "pipeline.h"
 #include "region_layer.h"
 #include "reorg_layer.h"
 #include "rnn_layer.h"
@@ -534,6 +587,9 @@ list *read_cfg(char *filename);
 #include "softmax_layer.h"
 #include "stb_image.h"
 #include "stb_image_write.h"
+#include "threadpool.h"
 #include "tree.h"
 #include "utils.h"
+#include "weights_container.h"
+#include "winograd.h"
 #endif
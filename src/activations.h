@@ -6,6 +6,12 @@
 
 ACTIVATION get_activation(char *s);
 
+typedef void (*activate_kernel)(float *x, int n);
+typedef void (*gradient_kernel)(const float *x, int n, float *delta);
+activate_kernel get_activate_kernel(ACTIVATION a);
+gradient_kernel get_gradient_kernel(ACTIVATION a);
+void test_activations();
+
 char *get_activation_string(ACTIVATION a);
 float activate(float x, ACTIVATION a);
 float gradient(float x, ACTIVATION a);
@@ -3,7 +3,7 @@
 #include "blas.h"
 #include <stdio.h>
 
-layer make_batchnorm_layer(int batch, int w, int h, int c)
+layer make_batchnorm_layer(int batch, int w, int h, int c, int train)
 {
     fprintf(stderr, "Batch Normalization Layer: %d x %d x %d image\n", w,h,c);
     layer l = {0};
@@ -13,21 +13,23 @@ layer make_batchnorm_layer(int batch, int w, int h, int c)
     l.w = l.out_w = w;
     l.c = l.out_c = c;
     l.output = calloc(h * w * c * batch, sizeof(float));
-    l.delta  = calloc(h * w * c * batch, sizeof(float));
     l.inputs = w*h*c;
     l.outputs = l.inputs;
 
     l.scales = calloc(c, sizeof(float));
-    l.scale_updates = calloc(c, sizeof(float));
     l.biases = calloc(c, sizeof(float));
-    l.bias_updates = calloc(c, sizeof(float));
     int i;
     for(i = 0; i < c; ++i){
         l.scales[i] = 1;
     }
 
-    l.mean = calloc(c, sizeof(float));
-    l.variance = calloc(c, sizeof(float));
+    if(train){
+        l.delta  = calloc(h * w * c * batch, sizeof(float));
+        l.scale_updates = calloc(c, sizeof(float));
+        l.bias_updates = calloc(c, sizeof(float));
+        l.mean = calloc(c, sizeof(float));
+        l.variance = calloc(c, sizeof(float));
+    }
 
     l.rolling_mean = calloc(c, sizeof(float));
     l.rolling_variance = calloc(c, sizeof(float));
@@ -154,6 +156,23 @@ void forward_batchnorm_layer(layer l, network net)
     add_bias(l.output, l.biases, l.batch, l.out_c, l.out_h*l.out_w);
 }
 
+/*
+ * Refreshes l.bn_affine, the per-channel scale and bias that inference-time
+ * batchnorm, scales and biases amount to. Call it wherever the statistics,
+ * scales or biases change so inference forwards can use it as is.
+ */
+void update_batchnorm_affine(layer l)
+{
+    if(!l.bn_affine) return;
+    float *scale = l.bn_affine;
+    float *bias = l.bn_affine + l.out_c;
+    int i;
+    for(i = 0; i < l.out_c; ++i){
+        scale[i] = l.scales[i]/(sqrt(l.rolling_variance[i]) + .000001f);
+        bias[i] = l.biases[i] - l.rolling_mean[i]*scale[i];
+    }
+}
+
 void backward_batchnorm_layer(layer l, network net)
 {
     if(!net.train){
@@ -5,9 +5,10 @@
 #include "layer.h"
 #include "network.h"
 
-layer make_batchnorm_layer(int batch, int w, int h, int c);
+layer make_batchnorm_layer(int batch, int w, int h, int c, int train);
 void forward_batchnorm_layer(layer l, network net);
 void backward_batchnorm_layer(layer l, network net);
+void update_batchnorm_affine(layer l);
 
 #ifdef GPU
 void forward_batchnorm_layer_gpu(layer l, network net);
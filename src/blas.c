@@ -1,4 +1,5 @@
 #include "blas.h"
+#include "threadpool.h"
 
 #include <math.h>
 #include <assert.h>
@@ -113,19 +114,33 @@ void variance_cpu(float *x, float *mean, int batch, int filters, int spatial, fl
     }
 }
 
-void normalize_cpu(float *x, float *mean, float *variance, int batch, int filters, int spatial)
+typedef struct{
+    float *x;
+    float *mean;
+    float *variance;
+    int filters;
+    int spatial;
+} normalize_job;
+
+static void normalize_part(void *ptr, int start, int end)
 {
-    int b, f, i;
-    for(b = 0; b < batch; ++b){
-        for(f = 0; f < filters; ++f){
-            for(i = 0; i < spatial; ++i){
-                int index = b*filters*spatial + f*spatial + i;
-                x[index] = (x[index] - mean[f])/(sqrt(variance[f]) + .000001f);
-            }
+    normalize_job job = *(normalize_job *)ptr;
+    int p, i;
+    for(p = start; p < end; ++p){
+        int f = p%job.filters;
+        float *x = job.x + p*job.spatial;
+        for(i = 0; i < job.spatial; ++i){
+            x[i] = (x[i] - job.mean[f])/(sqrt(job.variance[f]) + .000001f);
         }
     }
 }
 
+void normalize_cpu(float *x, float *mean, float *variance, int batch, int filters, int spatial)
+{
+    normalize_job job = {x, mean, variance, filters, spatial};
+    parallel_for(batch*filters, (1<<14)/spatial + 1, normalize_part, &job);
+}
+
 void const_cpu(int N, float ALPHA, float *X, int INCX)
 {
     int i;
@@ -10,9 +10,18 @@ box float_to_box(float *f, int stride);
 float box_iou(box a, box b);
 float box_rmse(box a, box b);
 dbox diou(box a, box b);
-void do_nms(box *boxes, float **probs, int total, int classes, float thresh);
-void do_nms_sort(box *boxes, float **probs, int total, int classes, float thresh);
-void do_nms_obj(box *boxes, float **probs, int total, int classes, float thresh);
+void reset_detections(detection_list *d);
+void add_detection(detection_list *d, box b, float objectness);
+void add_detection_score(detection_list *d, int id, float prob);
+void drop_empty_detection(detection_list *d);
+void finish_detections(detection_list *d);
+int *detection_keep_buffer(detection_list *d, int n);
+void free_detections(detection_list *d);
+float detection_prob(detection det, int id);
+void do_nms(detection *dets, int total, float thresh);
+void do_nms_sort(detection *dets, int total, int classes, float thresh);
+void do_nms_obj(detection *dets, int total, float thresh);
+void test_nms();
 box decode_box(box b, box anchor);
 box encode_box(box b, box anchor);
 
@@ -10,7 +10,8 @@
 #include <stdlib.h>
 #include <string.h>
 
-connected_layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activation, int batch_normalize)
+/* A layer made with train = 0 gets no gradient or batchnorm training state and can only run forward. */
+connected_layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activation, int batch_normalize, int train)
 {
     int i;
     connected_layer l = {0};
@@ -28,10 +29,12 @@ connected_layer make_connected_layer(int batch, int inputs, int outputs, ACTIVAT
     l.out_c = outputs;
 
     l.output = calloc(batch*outputs, sizeof(float));
-    l.delta = calloc(batch*outputs, sizeof(float));
+    if(train){
+        l.delta = calloc(batch*outputs, sizeof(float));
 
-    l.weight_updates = calloc(inputs*outputs, sizeof(float));
-    l.bias_updates = calloc(outputs, sizeof(float));
+        l.weight_updates = calloc(inputs*outputs, sizeof(float));
+        l.bias_updates = calloc(outputs, sizeof(float));
+    }
 
     l.weights = calloc(outputs*inputs, sizeof(float));
     l.biases = calloc(outputs, sizeof(float));
@@ -42,8 +45,11 @@ connected_layer make_connected_layer(int batch, int inputs, int outputs, ACTIVAT
 
     //float scale = 1./sqrt(inputs);
     float scale = sqrt(2./inputs);
-    for(i = 0; i < outputs*inputs; ++i){
-        l.weights[i] = scale*rand_uniform(-1, 1);
+    /* A forward-only layer is always loaded, so it is not worth initializing. */
+    if(train){
+        for(i = 0; i < outputs*inputs; ++i){
+            l.weights[i] = scale*rand_uniform(-1, 1);
+        }
     }
 
     for(i = 0; i < outputs; ++i){
@@ -52,19 +58,23 @@ connected_layer make_connected_layer(int batch, int inputs, int outputs, ACTIVAT
 
     if(batch_normalize){
         l.scales = calloc(outputs, sizeof(float));
-        l.scale_updates = calloc(outputs, sizeof(float));
         for(i = 0; i < outputs; ++i){
             l.scales[i] = 1;
         }
 
+        l.rolling_mean = calloc(outputs, sizeof(float));
+        l.rolling_variance = calloc(outputs, sizeof(float));
+        l.bn_affine = calloc(2*outputs, sizeof(float));
+        update_batchnorm_affine(l);
+    }
+    if(batch_normalize && train){
+        l.scale_updates = calloc(outputs, sizeof(float));
+
         l.mean = calloc(outputs, sizeof(float));
         l.mean_delta = calloc(outputs, sizeof(float));
         l.variance = calloc(outputs, sizeof(float));
         l.variance_delta = calloc(outputs, sizeof(float));
 
-        l.rolling_mean = calloc(outputs, sizeof(float));
-        l.rolling_variance = calloc(outputs, sizeof(float));
-
         l.x = calloc(batch*outputs, sizeof(float));
         l.x_norm = calloc(batch*outputs, sizeof(float));
     }
@@ -119,6 +129,7 @@ void update_connected_layer(connected_layer l, int batch, float learning_rate, f
         axpy_cpu(l.outputs, learning_rate/batch, l.scale_updates, 1, l.scales, 1);
         scal_cpu(l.outputs, momentum, l.scale_updates, 1);
     }
+    update_batchnorm_affine(l);
 
     axpy_cpu(l.inputs*l.outputs, -decay*batch, l.weights, 1, l.weight_updates, 1);
     axpy_cpu(l.inputs*l.outputs, learning_rate/batch, l.weight_updates, 1, l.weights, 1);
@@ -135,25 +146,30 @@ void forward_connected_layer(connected_layer l, network net)
     float *a = net.input;
     float *b = l.weights;
     float *c = l.output;
-    gemm(0,1,m,n,k,1,a,k,b,k,1,c,n);
-    if(l.batch_normalize){
-        if(net.train){
-            mean_cpu(l.output, l.batch, l.outputs, 1, l.mean);
-            variance_cpu(l.output, l.mean, l.batch, l.outputs, 1, l.variance);
-
-            scal_cpu(l.outputs, .95, l.rolling_mean, 1);
-            axpy_cpu(l.outputs, .05, l.mean, 1, l.rolling_mean, 1);
-            scal_cpu(l.outputs, .95, l.rolling_variance, 1);
-            axpy_cpu(l.outputs, .05, l.variance, 1, l.rolling_variance, 1);
-
-            copy_cpu(l.outputs*l.batch, l.output, 1, l.x, 1);
-            normalize_cpu(l.output, l.mean, l.variance, l.batch, l.outputs, 1);   
-            copy_cpu(l.outputs*l.batch, l.output, 1, l.x_norm, 1);
-        } else {
-            normalize_cpu(l.output, l.rolling_mean, l.rolling_variance, l.batch, l.outputs, 1);
+    if(!l.batch_normalize || !net.train){
+        /* Bias, inference batchnorm and activation ride along in the gemm. */
+        gemm_epilogue e = {l.biases, 0, 1, l.activation};
+        if(l.batch_normalize){
+            e.scale = l.bn_affine;
+            e.bias = l.bn_affine + l.outputs;
         }
-        scale_bias(l.output, l.scales, l.batch, l.outputs, 1);
+        gemm_epilogue_cpu(0,1,m,n,k,1,a,k,b,k,1,c,n,&e);
+        return;
     }
+    gemm(0,1,m,n,k,1,a,k,b,k,1,c,n);
+    mean_cpu(l.output, l.batch, l.outputs, 1, l.mean);
+    variance_cpu(l.output, l.mean, l.batch, l.outputs, 1, l.variance);
+
+    scal_cpu(l.outputs, .95, l.rolling_mean, 1);
+    axpy_cpu(l.outputs, .05, l.mean, 1, l.rolling_mean, 1);
+    scal_cpu(l.outputs, .95, l.rolling_variance, 1);
+    axpy_cpu(l.outputs, .05, l.variance, 1, l.rolling_variance, 1);
+    update_batchnorm_affine(l);
+
+    copy_cpu(l.outputs*l.batch, l.output, 1, l.x, 1);
+    normalize_cpu(l.output, l.mean, l.variance, l.batch, l.outputs, 1);   
+    copy_cpu(l.outputs*l.batch, l.output, 1, l.x_norm, 1);
+    scale_bias(l.output, l.scales, l.batch, l.outputs, 1);
     for(i = 0; i < l.batch; ++i){
         axpy_cpu(l.outputs, 1, l.biases, 1, l.output + i*l.outputs, 1);
     }
@@ -212,6 +228,32 @@ void denormalize_connected_layer(layer l)
     }
 }
 
+/* Same as fuse_convolutional_batchnorm, for the inference-time normalize of forward_connected_layer. */
+void fuse_connected_batchnorm(connected_layer *l)
+{
+    if(!l->batch_normalize) return;
+    int i, j;
+    for(i = 0; i < l->outputs; ++i){
+        float scale = l->scales[i]/(sqrt(l->rolling_variance[i]) + .000001f);
+        for(j = 0; j < l->inputs; ++j){
+            l->weights[i*l->inputs + j] *= scale;
+        }
+        l->biases[i] -= l->rolling_mean[i] * scale;
+        l->scales[i] = 1;
+        l->rolling_mean[i] = 0;
+        l->rolling_variance[i] = 1;
+    }
+    l->batch_normalize = 0;
+    free(l->x);
+    free(l->x_norm);
+    l->x = l->x_norm = 0;
+#ifdef GPU
+    if(gpu_index >= 0){
+        push_connected_layer(*l);
+    }
+#endif
+}
+
 
 void statistics_connected_layer(layer l)
 {
@@ -244,6 +286,7 @@ void pull_connected_layer(connected_layer l)
         cuda_pull_array(l.rolling_mean_gpu, l.rolling_mean, l.outputs);
         cuda_pull_array(l.rolling_variance_gpu, l.rolling_variance, l.outputs);
     }
+    update_batchnorm_affine(l);
 }
 
 void push_connected_layer(connected_layer l)
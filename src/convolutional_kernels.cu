@@ -107,10 +107,14 @@ void forward_convolutional_layer_gpu(convolutional_layer l, network net)
     int k = l.size*l.size*l.c;
     int n = l.out_w*l.out_h;
     for(i = 0; i < l.batch; ++i){
-        im2col_ongpu(net.input_gpu + i*l.c*l.h*l.w, l.c,  l.h,  l.w,  l.size,  l.stride, l.pad, net.workspace);
         float * a = l.weights_gpu;
         float * b = net.workspace;
         float * c = l.output_gpu;
+        if(convolutional_is_pointwise(l)){
+            b = net.input_gpu + i*l.c*l.h*l.w;
+        } else {
+            im2col_ongpu(net.input_gpu + i*l.c*l.h*l.w, l.c,  l.h,  l.w,  l.size,  l.stride, l.pad, b);
+        }
         gemm_ongpu(0,0,m,n,k,1.,a,k,b,n,1.,c+i*m*n,n);
     }
 #endif
@@ -231,7 +235,11 @@ void backward_convolutional_layer_gpu(convolutional_layer l, network net)
         float * b = net.workspace;
         float * c = l.weight_updates_gpu;
 
-        im2col_ongpu(net.input_gpu + i*l.c*l.h*l.w, l.c,  l.h,  l.w,  l.size,  l.stride, l.pad, net.workspace);
+        if(convolutional_is_pointwise(l)){
+            b = net.input_gpu + i*l.c*l.h*l.w;
+        } else {
+            im2col_ongpu(net.input_gpu + i*l.c*l.h*l.w, l.c,  l.h,  l.w,  l.size,  l.stride, l.pad, b);
+        }
         gemm_ongpu(0,1,m,n,k,1,a + i*m*k,k,b,k,1,c,n);
 
         if(net.delta_gpu){
@@ -240,9 +248,13 @@ void backward_convolutional_layer_gpu(convolutional_layer l, network net)
             float * b = l.delta_gpu;
             float * c = net.workspace;
 
-            gemm_ongpu(1,0,n,k,m,1,a,n,b + i*k*m,k,0,c,k);
+            if(convolutional_is_pointwise(l)){
+                gemm_ongpu(1,0,n,k,m,1,a,n,b + i*k*m,k,1,net.delta_gpu + i*l.c*l.h*l.w,k);
+            } else {
+                gemm_ongpu(1,0,n,k,m,1,a,n,b + i*k*m,k,0,c,k);
 
-            col2im_ongpu(net.workspace, l.c,  l.h,  l.w,  l.size,  l.stride, l.pad, net.delta_gpu + i*l.c*l.h*l.w);
+                col2im_ongpu(net.workspace, l.c,  l.h,  l.w,  l.size,  l.stride, l.pad, net.delta_gpu + i*l.c*l.h*l.w);
+            }
             if(l.binary || l.xnor) {
                 swap_binary(&l);
             }
@@ -263,6 +275,7 @@ void pull_convolutional_layer(convolutional_layer layer)
         cuda_pull_array(layer.rolling_mean_gpu, layer.rolling_mean, layer.n);
         cuda_pull_array(layer.rolling_variance_gpu, layer.rolling_variance, layer.n);
     }
+    update_batchnorm_affine(layer);
     if (layer.adam){
         cuda_pull_array(layer.m_gpu, layer.m, layer.c*layer.n*layer.size*layer.size);
         cuda_pull_array(layer.v_gpu, layer.v, layer.c*layer.n*layer.size*layer.size);
@@ -5,6 +5,8 @@
 #include "col2im.h"
 #include "blas.h"
 #include "gemm.h"
+#include "threadpool.h"
+#include "winograd.h"
 #include <stdio.h>
 #include <time.h>
 
@@ -83,6 +85,12 @@ image get_convolutional_delta(convolutional_layer l)
     return float_to_image(l.out_w,l.out_h,l.out_c,l.delta);
 }
 
+/* A 1x1, stride 1, unpadded convolution's im2col is its input, so it needs no column buffer. */
+int convolutional_is_pointwise(convolutional_layer l)
+{
+    return l.size == 1 && l.stride == 1 && l.pad == 0;
+}
+
 static size_t get_workspace_size(layer l){
 #ifdef CUDNN
     if(gpu_index >= 0){
@@ -115,7 +123,14 @@ static size_t get_workspace_size(layer l){
         return most;
     }
 #endif
-    return (size_t)l.out_h*l.out_w*l.size*l.size*l.c*sizeof(float);
+    /* The forward pass works straight from the image; only backward, in
+     * layers that have a delta to propagate, builds the column matrix. */
+    size_t size = winograd_workspace_size(l);
+    if(l.delta && !convolutional_is_pointwise(l)){
+        size_t col = (size_t)l.out_h*l.out_w*l.size*l.size*l.c*sizeof(float);
+        if(col > size) size = col;
+    }
+    return size;
 }
 
 #ifdef GPU
@@ -159,7 +174,8 @@ void cudnn_convolutional_setup(layer *l)
 #endif
 #endif
 
-convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int n, int size, int stride, int padding, ACTIVATION activation, int batch_normalize, int binary, int xnor, int adam)
+/* A layer made with train = 0 gets no gradient, batchnorm training or optimizer state and can only run forward. */
+convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int n, int size, int stride, int padding, ACTIVATION activation, int batch_normalize, int binary, int xnor, int adam, int train)
 {
     int i;
     convolutional_layer l = {0};
@@ -178,10 +194,11 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     l.batch_normalize = batch_normalize;
 
     l.weights = calloc(c*n*size*size, sizeof(float));
-    l.weight_updates = calloc(c*n*size*size, sizeof(float));
-
     l.biases = calloc(n, sizeof(float));
-    l.bias_updates = calloc(n, sizeof(float));
+    if(train){
+        l.weight_updates = calloc(c*n*size*size, sizeof(float));
+        l.bias_updates = calloc(n, sizeof(float));
+    }
 
     l.nweights = c*n*size*size;
     l.nbiases = n;
@@ -190,7 +207,10 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     float scale = sqrt(2./(size*size*c));
     //scale = .02;
     //for(i = 0; i < c*n*size*size; ++i) l.weights[i] = scale*rand_uniform(-1, 1);
-    for(i = 0; i < c*n*size*size; ++i) l.weights[i] = scale*rand_normal();
+    /* A forward-only layer is always loaded, so it is not worth initializing. */
+    if(train){
+        for(i = 0; i < c*n*size*size; ++i) l.weights[i] = scale*rand_normal();
+    }
     int out_w = convolutional_out_width(l);
     int out_h = convolutional_out_height(l);
     l.out_h = out_h;
@@ -199,8 +219,13 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     l.outputs = l.out_h * l.out_w * l.out_c;
     l.inputs = l.w * l.h * l.c;
 
+    if(gpu_index < 0) l.winograd = winograd_tile_size(l);
+    if(l.winograd){
+        l.winograd_weights = make_winograd_weights(l);
+    }
+
     l.output = calloc(l.batch*l.outputs, sizeof(float));
-    l.delta  = calloc(l.batch*l.outputs, sizeof(float));
+    if(train) l.delta  = calloc(l.batch*l.outputs, sizeof(float));
 
     l.forward = forward_convolutional_layer;
     l.backward = backward_convolutional_layer;
@@ -217,23 +242,28 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
 
     if(batch_normalize){
         l.scales = calloc(n, sizeof(float));
-        l.scale_updates = calloc(n, sizeof(float));
         for(i = 0; i < n; ++i){
             l.scales[i] = 1;
         }
 
+        l.rolling_mean = calloc(n, sizeof(float));
+        l.rolling_variance = calloc(n, sizeof(float));
+        l.bn_affine = calloc(2*n, sizeof(float));
+        update_batchnorm_affine(l);
+    }
+    if(batch_normalize && train){
+        l.scale_updates = calloc(n, sizeof(float));
+
         l.mean = calloc(n, sizeof(float));
         l.variance = calloc(n, sizeof(float));
 
         l.mean_delta = calloc(n, sizeof(float));
         l.variance_delta = calloc(n, sizeof(float));
 
-        l.rolling_mean = calloc(n, sizeof(float));
-        l.rolling_variance = calloc(n, sizeof(float));
         l.x = calloc(l.batch*l.outputs, sizeof(float));
         l.x_norm = calloc(l.batch*l.outputs, sizeof(float));
     }
-    if(adam){
+    if(adam && train){
         l.adam = 1;
         l.m = calloc(c*n*size*size, sizeof(float));
         l.v = calloc(c*n*size*size, sizeof(float));
@@ -325,6 +355,40 @@ void denormalize_convolutional_layer(convolutional_layer l)
         l.rolling_mean[i] = 0;
         l.rolling_variance[i] = 1;
     }
+    invalidate_winograd_weights(l);
+}
+
+/*
+ * Folds the rolling statistics into weights and biases the same way
+ * forward_batchnorm_layer applies them at inference, then drops the
+ * batchnorm pass. The statistics are left as the identity so the layer
+ * still saves in its batch_normalize format.
+ */
+void fuse_convolutional_batchnorm(convolutional_layer *l)
+{
+    if(!l->batch_normalize || l->binary || l->xnor) return;
+    int i, j;
+    int size = l->c*l->size*l->size;
+    for(i = 0; i < l->n; ++i){
+        float scale = l->scales[i]/(sqrt(l->rolling_variance[i]) + .000001f);
+        for(j = 0; j < size; ++j){
+            l->weights[i*size + j] *= scale;
+        }
+        l->biases[i] -= l->rolling_mean[i] * scale;
+        l->scales[i] = 1;
+        l->rolling_mean[i] = 0;
+        l->rolling_variance[i] = 1;
+    }
+    l->batch_normalize = 0;
+    free(l->x);
+    free(l->x_norm);
+    l->x = l->x_norm = 0;
+    invalidate_winograd_weights(*l);
+#ifdef GPU
+    if(gpu_index >= 0){
+        push_convolutional_layer(*l);
+    }
+#endif
 }
 
 /*
@@ -365,9 +429,11 @@ void resize_convolutional_layer(convolutional_layer *l, int w, int h)
     l->outputs = l->out_h * l->out_w * l->out_c;
     l->inputs = l->w * l->h * l->c;
 
+    if(l->winograd) l->winograd = winograd_tile_size(*l);
+
     l->output = realloc(l->output, l->batch*l->outputs*sizeof(float));
-    l->delta  = realloc(l->delta,  l->batch*l->outputs*sizeof(float));
-    if(l->batch_normalize){
+    if(l->delta) l->delta  = realloc(l->delta,  l->batch*l->outputs*sizeof(float));
+    if(l->x){
         l->x = realloc(l->x, l->batch*l->outputs*sizeof(float));
         l->x_norm  = realloc(l->x_norm, l->batch*l->outputs*sizeof(float));
     }
@@ -393,30 +459,51 @@ void resize_convolutional_layer(convolutional_layer *l, int w, int h)
     l->workspace_size = get_workspace_size(*l);
 }
 
-void add_bias(float *output, float *biases, int batch, int n, int size)
+typedef struct{
+    float *output;
+    float *values;
+    int n;
+    int size;
+} bias_job;
+
+static void add_bias_part(void *ptr, int start, int end)
 {
-    int i,j,b;
-    for(b = 0; b < batch; ++b){
-        for(i = 0; i < n; ++i){
-            for(j = 0; j < size; ++j){
-                output[(b*n + i)*size + j] += biases[i];
-            }
+    bias_job job = *(bias_job *)ptr;
+    int i,j;
+    for(i = start; i < end; ++i){
+        float bias = job.values[i%job.n];
+        float *out = job.output + i*job.size;
+        for(j = 0; j < job.size; ++j){
+            out[j] += bias;
         }
     }
 }
 
-void scale_bias(float *output, float *scales, int batch, int n, int size)
+static void scale_bias_part(void *ptr, int start, int end)
 {
-    int i,j,b;
-    for(b = 0; b < batch; ++b){
-        for(i = 0; i < n; ++i){
-            for(j = 0; j < size; ++j){
-                output[(b*n + i)*size + j] *= scales[i];
-            }
+    bias_job job = *(bias_job *)ptr;
+    int i,j;
+    for(i = start; i < end; ++i){
+        float scale = job.values[i%job.n];
+        float *out = job.output + i*job.size;
+        for(j = 0; j < job.size; ++j){
+            out[j] *= scale;
         }
     }
 }
 
+void add_bias(float *output, float *biases, int batch, int n, int size)
+{
+    bias_job job = {output, biases, n, size};
+    parallel_for(batch*n, (1<<14)/size + 1, add_bias_part, &job);
+}
+
+void scale_bias(float *output, float *scales, int batch, int n, int size)
+{
+    bias_job job = {output, scales, n, size};
+    parallel_for(batch*n, (1<<14)/size + 1, scale_bias_part, &job);
+}
+
 void backward_bias(float *bias_updates, float *delta, int batch, int n, int size)
 {
     int i,b;
@@ -448,24 +535,39 @@ void forward_convolutional_layer(convolutional_layer l, network net)
 
 
     float *a = l.weights;
-    float *b = net.workspace;
     float *c = l.output;
 
-    for(i = 0; i < l.batch; ++i){
-        im2col_cpu(net.input, l.c, l.h, l.w, 
-                l.size, l.stride, l.pad, b);
-        gemm(0,0,m,n,k,1,a,k,b,n,1,c,n);
-        c += n*m;
-        net.input += l.c*l.h*l.w;
+    /* Bias, inference batchnorm and activation are applied by the gemm as it
+     * finishes each tile. Training batchnorm needs the whole raw output first. */
+    gemm_epilogue e = {l.biases, 0, 0, l.activation};
+    gemm_epilogue *epi = 0;
+    if(!l.batch_normalize || !net.train){
+        if(l.batch_normalize){
+            e.scale = l.bn_affine;
+            e.bias = l.bn_affine + l.n;
+        }
+        epi = &e;
     }
 
-    if(l.batch_normalize){
-        forward_batchnorm_layer(l, net);
+    if(l.winograd && !net.train){
+        forward_winograd_cpu(l, net.input, net.workspace, epi);
     } else {
-        add_bias(l.output, l.biases, l.batch, l.n, out_h*out_w);
+        for(i = 0; i < l.batch; ++i){
+            if(convolutional_is_pointwise(l)){
+                gemm_epilogue_cpu(0,0,m,n,k,1,a,k,net.input,n,1,c,n,epi);
+            } else {
+                gemm_conv_cpu(m,1,a,k,net.input,l.c,l.h,l.w,l.size,l.stride,l.pad,1,c,n,epi);
+            }
+            c += n*m;
+            net.input += l.c*l.h*l.w;
+        }
     }
 
-    activate_array(l.output, m*n*l.batch, l.activation);
+    if(!epi){
+        forward_batchnorm_layer(l, net);
+        update_batchnorm_affine(l);
+        activate_array(l.output, m*n*l.batch, l.activation);
+    }
     if(l.binary || l.xnor) swap_binary(&l);
 }
 
@@ -491,18 +593,27 @@ void backward_convolutional_layer(convolutional_layer l, network net)
 
         float *im = net.input+i*l.c*l.h*l.w;
 
-        im2col_cpu(im, l.c, l.h, l.w, 
-                l.size, l.stride, l.pad, b);
+        if(convolutional_is_pointwise(l)){
+            b = im;
+        } else {
+            im2col_cpu(im, l.c, l.h, l.w, 
+                    l.size, l.stride, l.pad, b);
+        }
         gemm(0,1,m,n,k,1,a,k,b,k,1,c,n);
 
         if(net.delta){
             a = l.weights;
             b = l.delta + i*m*k;
-            c = net.workspace;
 
-            gemm(1,0,n,k,m,1,a,n,b,k,0,c,k);
+            if(convolutional_is_pointwise(l)){
+                gemm(1,0,n,k,m,1,a,n,b,k,1,net.delta+i*l.c*l.h*l.w,k);
+            } else {
+                c = net.workspace;
+
+                gemm(1,0,n,k,m,1,a,n,b,k,0,c,k);
 
-            col2im_cpu(net.workspace, l.c,  l.h,  l.w,  l.size,  l.stride, l.pad, net.delta+i*l.c*l.h*l.w);
+                col2im_cpu(net.workspace, l.c,  l.h,  l.w,  l.size,  l.stride, l.pad, net.delta+i*l.c*l.h*l.w);
+            }
         }
     }
 }
@@ -521,6 +632,8 @@ void update_convolutional_layer(convolutional_layer l, int batch, float learning
     axpy_cpu(size, -decay*batch, l.weights, 1, l.weight_updates, 1);
     axpy_cpu(size, learning_rate/batch, l.weight_updates, 1, l.weights, 1);
     scal_cpu(size, momentum, l.weight_updates, 1);
+    update_batchnorm_affine(l);
+    invalidate_winograd_weights(l);
 }
 
 
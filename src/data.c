@@ -2,6 +2,7 @@
 #include "utils.h"
 #include "image.h"
 #include "cuda.h"
+#include "pack.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,6 +12,7 @@ pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 list *get_paths(char *filename)
 {
+    if(is_packed_dataset(filename)) return open_packed_dataset(filename);
     char *path;
     FILE *file = fopen(filename, "r");
     if(!file) file_error(filename);
@@ -53,6 +55,43 @@ char **get_random_paths(char **paths, int n, int m)
     return random_paths;
 }
 
+static image load_sample_image(char *path)
+{
+    image im;
+    if(load_packed_image(path, &im)) return im;
+    return load_image_color(path, 0, 0);
+}
+
+static image_u8 load_sample_image_u8(char *path)
+{
+    image_u8 im;
+    if(load_packed_image_u8(path, &im)) return im;
+    return load_image_u8(path, 3);
+}
+
+/* Per-thread output buffer for warp_affine_u8, reused across samples. */
+static __thread unsigned char *warp_buffer = 0;
+static __thread size_t warp_buffer_size = 0;
+
+static image_u8 warp_output(int w, int h, int c)
+{
+    size_t size = (size_t)w*h*c;
+    if(size > warp_buffer_size){
+        free(warp_buffer);
+        warp_buffer = malloc(size);
+        warp_buffer_size = size;
+    }
+    image_u8 out = {w, h, c, warp_buffer};
+    return out;
+}
+
+static box_label *read_sample_boxes(char *path, char *labelpath, int *n)
+{
+    box_label *boxes = read_packed_boxes(path, labelpath, n);
+    if(boxes) return boxes;
+    return read_boxes(labelpath, n);
+}
+
 char **find_replace_paths(char **paths, int n, char *find, char *replace)
 {
     char **replace_paths = calloc(n, sizeof(char*));
@@ -102,35 +141,40 @@ matrix load_image_paths(char **paths, int n, int w, int h)
     return X;
 }
 
-matrix load_image_augment_paths(char **paths, int n, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center)
+void fill_image_augment_rows(matrix X, char **paths, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center)
 {
     int i;
-    matrix X;
-    X.rows = n;
-    X.vals = calloc(X.rows, sizeof(float*));
-    X.cols = 0;
-
-    for(i = 0; i < n; ++i){
-        image im = load_image_color(paths[i], 0, 0);
-        image crop;
+    for(i = 0; i < X.rows; ++i){
+        image_u8 im = load_sample_image_u8(paths[i]);
+        float m[6];
         if(center){
-            crop = center_crop_image(im, size, size);
+            int side = (im.w < im.h) ? im.w : im.h;
+            float s = (float)side / size;
+            m[0] = s; m[1] = 0; m[2] = .5f*s - .5f + (im.w - side)/2;
+            m[3] = 0; m[4] = s; m[5] = .5f*s - .5f + (im.h - side)/2;
         } else {
-            crop = random_augment_image(im, angle, aspect, min, max, size, size);
+            augment_args a = random_augment_args(make_empty_image(im.w, im.h, im.c), angle, aspect, min, max, size, size);
+            rotate_crop_affine(im.w, im.h, a, m);
         }
         int flip = rand()%2;
-        if (flip) flip_image(crop);
-        random_distort_image(crop, hue, saturation, exposure);
-
-        /*
-        show_image(im, "orig");
-        show_image(crop, "crop");
-        cvWaitKey(0);
-        */
-        free_image(im);
-        X.vals[i] = crop.data;
-        X.cols = crop.h*crop.w*crop.c;
+        if(flip){
+            m[2] += m[0]*(size - 1);
+            m[5] += m[3]*(size - 1);
+            m[0] = -m[0];
+            m[3] = -m[3];
+        }
+        image_u8 crop = warp_output(size, size, im.c);
+        warp_affine_u8(im, crop, m, -1);
+        random_distort_image_u8(crop, hue, saturation, exposure);
+        image_u8_to_float(crop, X.vals[i]);
+        free_image_u8(im);
     }
+}
+
+matrix load_image_augment_paths(char **paths, int n, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center)
+{
+    matrix X = make_matrix(n, size*size*3);
+    fill_image_augment_rows(X, paths, min, max, size, angle, aspect, hue, saturation, exposure, center);
     return X;
 }
 
@@ -209,6 +253,46 @@ void correct_boxes(box_label *boxes, int n, float dx, float dy, float sx, float
     }
 }
 
+/* Like correct_boxes for any augmentation given as the 2x3 map m from normalized
+ * source coordinates to normalized output coordinates. */
+void correct_boxes_affine(box_label *boxes, int n, const float *m)
+{
+    int i, j;
+    for(i = 0; i < n; ++i){
+        if(boxes[i].x == 0 && boxes[i].y == 0) {
+            boxes[i].x = 999999;
+            boxes[i].y = 999999;
+            boxes[i].w = 999999;
+            boxes[i].h = 999999;
+            continue;
+        }
+        float left = 1, right = 0, top = 1, bottom = 0;
+        for(j = 0; j < 4; ++j){
+            float x = (j&1) ? boxes[i].right : boxes[i].left;
+            float y = (j&2) ? boxes[i].bottom : boxes[i].top;
+            float tx = m[0]*x + m[1]*y + m[2];
+            float ty = m[3]*x + m[4]*y + m[5];
+            if(!j || tx < left) left = tx;
+            if(!j || tx > right) right = tx;
+            if(!j || ty < top) top = ty;
+            if(!j || ty > bottom) bottom = ty;
+        }
+
+        boxes[i].left =  constrain(0, 1, left);
+        boxes[i].right = constrain(0, 1, right);
+        boxes[i].top =   constrain(0, 1, top);
+        boxes[i].bottom =   constrain(0, 1, bottom);
+
+        boxes[i].x = (boxes[i].left+boxes[i].right)/2;
+        boxes[i].y = (boxes[i].top+boxes[i].bottom)/2;
+        boxes[i].w = (boxes[i].right - boxes[i].left);
+        boxes[i].h = (boxes[i].bottom - boxes[i].top);
+
+        boxes[i].w = constrain(0, 1, boxes[i].w);
+        boxes[i].h = constrain(0, 1, boxes[i].h);
+    }
+}
+
 void fill_truth_swag(char *path, float *truth, int classes, int flip, float dx, float dy, float sx, float sy)
 {
     char labelpath[4096];
@@ -219,7 +303,7 @@ void fill_truth_swag(char *path, float *truth, int classes, int flip, float dx,
     find_replace(labelpath, ".JPEG", ".txt", labelpath);
 
     int count = 0;
-    box_label *boxes = read_boxes(labelpath, &count);
+    box_label *boxes = read_sample_boxes(path, labelpath, &count);
     randomize_boxes(boxes, count);
     correct_boxes(boxes, count, dx, dy, sx, sy, flip);
     float x,y,w,h;
@@ -247,7 +331,7 @@ void fill_truth_swag(char *path, float *truth, int classes, int flip, float dx,
     free(boxes);
 }
 
-void fill_truth_region(char *path, float *truth, int classes, int num_boxes, int flip, float dx, float dy, float sx, float sy)
+void fill_truth_region(char *path, float *truth, int classes, int num_boxes, const float *m)
 {
     char labelpath[4096];
     find_replace(path, "images", "labels", labelpath);
@@ -258,9 +342,9 @@ void fill_truth_region(char *path, float *truth, int classes, int num_boxes, int
     find_replace(labelpath, ".JPG", ".txt", labelpath);
     find_replace(labelpath, ".JPEG", ".txt", labelpath);
     int count = 0;
-    box_label *boxes = read_boxes(labelpath, &count);
+    box_label *boxes = read_sample_boxes(path, labelpath, &count);
     randomize_boxes(boxes, count);
-    correct_boxes(boxes, count, dx, dy, sx, sy, flip);
+    correct_boxes_affine(boxes, count, m);
     float x,y,w,h;
     int id;
     int i;
@@ -295,9 +379,8 @@ void fill_truth_region(char *path, float *truth, int classes, int num_boxes, int
     free(boxes);
 }
 
-void fill_truth_detection(char *path, int num_boxes, float *truth, int classes, int flip, float dx, float dy, float sx, float sy)
+void detection_label_path(char *path, char *labelpath)
 {
-    char labelpath[4096];
     find_replace(path, "images", "labels", labelpath);
     find_replace(labelpath, "JPEGImages", "labels", labelpath);
 
@@ -306,10 +389,16 @@ void fill_truth_detection(char *path, int num_boxes, float *truth, int classes,
     find_replace(labelpath, ".png", ".txt", labelpath);
     find_replace(labelpath, ".JPG", ".txt", labelpath);
     find_replace(labelpath, ".JPEG", ".txt", labelpath);
+}
+
+void fill_truth_detection(char *path, int num_boxes, float *truth, int classes, const float *m)
+{
+    char labelpath[4096];
+    detection_label_path(path, labelpath);
     int count = 0;
-    box_label *boxes = read_boxes(labelpath, &count);
+    box_label *boxes = read_sample_boxes(path, labelpath, &count);
     randomize_boxes(boxes, count);
-    correct_boxes(boxes, count, dx, dy, sx, sy, flip);
+    correct_boxes_affine(boxes, count, m);
     if(count > num_boxes) count = num_boxes;
     float x,y,w,h;
     int id;
@@ -451,16 +540,23 @@ matrix load_regression_labels_paths(char **paths, int n)
     return y;
 }
 
-matrix load_labels_paths(char **paths, int n, char **labels, int k, tree *hierarchy)
+void fill_labels_rows(matrix y, char **paths, char **labels, int k, tree *hierarchy)
 {
-    matrix y = make_matrix(n, k);
     int i;
-    for(i = 0; i < n && labels; ++i){
+    for(i = 0; i < y.rows; ++i){
+        memset(y.vals[i], 0, k*sizeof(float));
+        if(!labels) continue;
         fill_truth(paths[i], labels, k, y.vals[i]);
         if(hierarchy){
             fill_hierarchy(y.vals[i], k, hierarchy);
         }
     }
+}
+
+matrix load_labels_paths(char **paths, int n, char **labels, int k, tree *hierarchy)
+{
+    matrix y = make_matrix(n, k);
+    fill_labels_rows(y, paths, labels, k, hierarchy);
     return y;
 }
 
@@ -593,7 +689,7 @@ data load_data_seg(int n, char **paths, int m, int w, int h, int classes, int mi
     d.y.vals = calloc(d.X.rows, sizeof(float*));
 
     for(i = 0; i < n; ++i){
-        image orig = load_image_color(random_paths[i], 0, 0);
+        image orig = load_sample_image(random_paths[i]);
         augment_args a = random_augment_args(orig, angle, aspect, min, max, w, h);
         image sized = rotate_crop_image(orig, a.rad, a.scale, a.w, a.h, a.dx, a.dy, a.aspect);
 
@@ -624,22 +720,13 @@ data load_data_seg(int n, char **paths, int m, int w, int h, int classes, int mi
     return d;
 }
 
-data load_data_region(int n, char **paths, int m, int w, int h, int size, int classes, float jitter, float hue, float saturation, float exposure)
+void fill_data_region(data d, char **paths, int m, int w, int h, int size, int classes, float jitter, float hue, float saturation, float exposure)
 {
+    int n = d.X.rows;
     char **random_paths = get_random_paths(paths, n, m);
     int i;
-    data d = {0};
-    d.shallow = 0;
-
-    d.X.rows = n;
-    d.X.vals = calloc(d.X.rows, sizeof(float*));
-    d.X.cols = h*w*3;
-
-
-    int k = size*size*(5+classes);
-    d.y = make_matrix(n, k);
     for(i = 0; i < n; ++i){
-        image orig = load_image_color(random_paths[i], 0, 0);
+        image_u8 orig = load_sample_image_u8(random_paths[i]);
 
         int oh = orig.h;
         int ow = orig.w;
@@ -655,26 +742,35 @@ data load_data_region(int n, char **paths, int m, int w, int h, int size, int cl
         int swidth =  ow - pleft - pright;
         int sheight = oh - ptop - pbot;
 
-        float sx = (float)swidth  / ow;
-        float sy = (float)sheight / oh;
-
         int flip = rand()%2;
-        image cropped = crop_image(orig, pleft, ptop, swidth, sheight);
-
-        float dx = ((float)pleft/ow)/sx;
-        float dy = ((float)ptop /oh)/sy;
+        float fwd[6] = {(float)ow/swidth, 0, -(float)pleft/swidth, 0, (float)oh/sheight, -(float)ptop/sheight};
+        if(flip){
+            fwd[0] = -fwd[0];
+            fwd[2] = 1 - fwd[2];
+        }
 
-        image sized = resize_image(cropped, w, h);
-        if(flip) flip_image(sized);
-        random_distort_image(sized, hue, saturation, exposure);
-        d.X.vals[i] = sized.data;
+        float m[6];
+        affine_pixel_map(fwd, ow, oh, w, h, m);
+        image_u8 sized = warp_output(w, h, orig.c);
+        warp_affine_u8(orig, sized, m, -1);
+        random_distort_image_u8(sized, hue, saturation, exposure);
+        image_u8_to_float(sized, d.X.vals[i]);
 
-        fill_truth_region(random_paths[i], d.y.vals[i], classes, size, flip, dx, dy, 1./sx, 1./sy);
+        memset(d.y.vals[i], 0, d.y.cols*sizeof(float));
+        fill_truth_region(random_paths[i], d.y.vals[i], classes, size, fwd);
 
-        free_image(orig);
-        free_image(cropped);
+        free_image_u8(orig);
     }
     free(random_paths);
+}
+
+data load_data_region(int n, char **paths, int m, int w, int h, int size, int classes, float jitter, float hue, float saturation, float exposure)
+{
+    data d = {0};
+    d.shallow = 0;
+    d.X = make_matrix(n, h*w*3);
+    d.y = make_matrix(n, size*size*(5+classes));
+    fill_data_region(d, paths, m, w, h, size, classes, jitter, hue, saturation, exposure);
     return d;
 }
 
@@ -747,7 +843,7 @@ data load_data_swag(char **paths, int n, int classes, float jitter)
     int index = rand()%n;
     char *random_path = paths[index];
 
-    image orig = load_image_color(random_path, 0, 0);
+    image orig = load_sample_image(random_path);
     int h = orig.h;
     int w = orig.w;
 
@@ -795,22 +891,13 @@ data load_data_swag(char **paths, int n, int classes, float jitter)
     return d;
 }
 
-data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure)
+void fill_data_detection(data d, char **paths, int m, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure)
 {
+    int n = d.X.rows;
     char **random_paths = get_random_paths(paths, n, m);
     int i;
-    data d = {0};
-    d.shallow = 0;
-
-    d.X.rows = n;
-    d.X.vals = calloc(d.X.rows, sizeof(float*));
-    d.X.cols = h*w*3;
-
-    d.y = make_matrix(n, 5*boxes);
     for(i = 0; i < n; ++i){
-        image orig = load_image_color(random_paths[i], 0, 0);
-        image sized = make_image(w, h, orig.c);
-        fill_image(sized, .5);
+        image_u8 orig = load_sample_image_u8(random_paths[i]);
 
         float dw = jitter * orig.w;
         float dh = jitter * orig.h;
@@ -831,26 +918,44 @@ data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, in
         float dx = rand_uniform(0, w - nw);
         float dy = rand_uniform(0, h - nh);
 
-        place_image(orig, nw, nh, dx, dy, sized);
-
-        random_distort_image(sized, hue, saturation, exposure);
+        float dhue = rand_uniform(-hue, hue);
+        float dsat = rand_scale(saturation);
+        float dexp = rand_scale(exposure);
         int flip = rand()%2;
-        if(flip) flip_image(sized);
-        d.X.vals[i] = sized.data;
+        float fwd[6] = {nw/w, 0, dx/w, 0, nh/h, dy/h};
+        if(flip){
+            fwd[0] = -fwd[0];
+            fwd[2] = 1 - fwd[2];
+        }
 
+        float m[6];
+        affine_pixel_map(fwd, orig.w, orig.h, w, h, m);
+        image_u8 sized = warp_output(w, h, orig.c);
+        warp_affine_u8(orig, sized, m, 128);
+        distort_image_u8(sized, dhue, dsat, dexp);
+        image_u8_to_float(sized, d.X.vals[i]);
 
-        fill_truth_detection(random_paths[i], boxes, d.y.vals[i], classes, flip, -dx/w, -dy/h, nw/w, nh/h);
+        memset(d.y.vals[i], 0, d.y.cols*sizeof(float));
+        fill_truth_detection(random_paths[i], boxes, d.y.vals[i], classes, fwd);
 
-        free_image(orig);
+        free_image_u8(orig);
     }
     free(random_paths);
+}
+
+data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure)
+{
+    data d = {0};
+    d.shallow = 0;
+    d.X = make_matrix(n, h*w*3);
+    d.y = make_matrix(n, 5*boxes);
+    fill_data_detection(d, paths, m, w, h, boxes, classes, jitter, hue, saturation, exposure);
     return d;
 }
 
-void *load_thread(void *ptr)
+static void load_args_run(load_args a)
 {
     //printf("Loading data: %d\n", rand());
-    load_args a = *(struct load_args*)ptr;
     if(a.exposure == 0) a.exposure = 1;
     if(a.saturation == 0) a.saturation = 1;
     if(a.aspect == 0) a.aspect = 1;
@@ -884,7 +989,13 @@ void *load_thread(void *ptr)
     } else if (a.type == TAG_DATA){
         *a.d = load_data_tag(a.paths, a.n, a.m, a.classes, a.min, a.max, a.size, a.angle, a.aspect, a.hue, a.saturation, a.exposure);
     }
+}
+
+void *load_thread(void *ptr)
+{
+    load_args a = *(struct load_args*)ptr;
     free(ptr);
+    load_args_run(a);
     return 0;
 }
 
@@ -897,6 +1008,29 @@ pthread_t load_data_in_thread(load_args args)
     return thread;
 }
 
+/* Moves the rows of a partial batch into dst starting at row offset. Only
+ * the row pointers move, the row arrays of src are released. */
+static void place_data_rows(data *dst, data src, int offset)
+{
+    if(src.X.rows) memcpy(dst->X.vals + offset, src.X.vals, src.X.rows*sizeof(float *));
+    if(src.y.rows) memcpy(dst->y.vals + offset, src.y.vals, src.y.rows*sizeof(float *));
+    if(src.X.cols) dst->X.cols = src.X.cols;
+    if(src.y.cols) dst->y.cols = src.y.cols;
+    if(src.w) dst->w = src.w;
+    if(src.h) dst->h = src.h;
+    free(src.X.vals);
+    free(src.y.vals);
+}
+
+static data make_batch_rows(int n)
+{
+    data d = {0};
+    d.X.rows = d.y.rows = n;
+    d.X.vals = calloc(n, sizeof(float *));
+    d.y.vals = calloc(n, sizeof(float *));
+    return d;
+}
+
 void *load_threads(void *ptr)
 {
     int i;
@@ -915,11 +1049,9 @@ void *load_threads(void *ptr)
     for(i = 0; i < args.threads; ++i){
         pthread_join(threads[i], 0);
     }
-    *out = concat_datas(buffers, args.threads);
-    out->shallow = 0;
+    *out = make_batch_rows(total);
     for(i = 0; i < args.threads; ++i){
-        buffers[i].shallow = 1;
-        free_data(buffers[i]);
+        place_data_rows(out, buffers[i], i * total/args.threads);
     }
     free(buffers);
     free(threads);
@@ -942,6 +1074,241 @@ pthread_t load_data(load_args args)
     return thread;
 }
 
+
+/* Long-lived loader pool. Each batch is split into one chunk per worker,
+ * workers take chunks in order and write their rows straight into one of
+ * the batch slots, and data_loader_next hands batches out in the order
+ * they were issued. For the data types batch_data_shape knows about the
+ * slots are a ring of buffers that are filled in place and handed back
+ * with data_loader_release, so nothing is allocated in steady state. */
+struct data_loader{
+    load_args args;
+    int threads;
+    int prefetch;
+    int recycle;
+    int nslots;
+    data *slots;
+    int *remaining;
+    int *held;
+    int issued;
+    int consumed;
+    int active;
+    int paused;
+    int done;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t ready;
+};
+
+static int batch_data_shape(load_args a, int *xcols, int *ycols)
+{
+    if(a.type == CLASSIFICATION_DATA){
+        *xcols = a.size*a.size*3;
+        *ycols = a.classes;
+    } else if(a.type == DETECTION_DATA){
+        *xcols = a.w*a.h*3;
+        *ycols = 5*a.num_boxes;
+    } else if(a.type == REGION_DATA){
+        *xcols = a.w*a.h*3;
+        *ycols = a.num_boxes*a.num_boxes*(5+a.classes);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static void load_args_fill(load_args a, data d)
+{
+    if(a.exposure == 0) a.exposure = 1;
+    if(a.saturation == 0) a.saturation = 1;
+    if(a.aspect == 0) a.aspect = 1;
+
+    if(a.type == CLASSIFICATION_DATA){
+        fill_data_augment(d, a.paths, a.m, a.labels, a.classes, a.hierarchy, a.min, a.max, a.size, a.angle, a.aspect, a.hue, a.saturation, a.exposure, a.center);
+    } else if(a.type == DETECTION_DATA){
+        fill_data_detection(d, a.paths, a.m, a.w, a.h, a.num_boxes, a.classes, a.jitter, a.hue, a.saturation, a.exposure);
+    } else if(a.type == REGION_DATA){
+        fill_data_region(d, a.paths, a.m, a.w, a.h, a.num_boxes, a.classes, a.jitter, a.hue, a.saturation, a.exposure);
+    }
+}
+
+static data data_rows_view(data d, int offset, int n)
+{
+    data v = d;
+    v.shallow = 1;
+    v.X.rows = v.y.rows = n;
+    v.X.vals = d.X.vals + offset;
+    v.y.vals = d.y.vals + offset;
+    return v;
+}
+
+static void prepare_batch_slot(data_loader *l, int slot)
+{
+    int n = l->args.n;
+    if(!l->recycle){
+        l->slots[slot] = make_batch_rows(n);
+        return;
+    }
+    int xcols = 0, ycols = 0;
+    batch_data_shape(l->args, &xcols, &ycols);
+    data *d = l->slots + slot;
+    if(d->X.rows != n || d->X.cols != xcols || d->y.cols != ycols){
+        free_data(*d);
+        *d = (data){0};
+        d->X = make_matrix(n, xcols);
+        d->y = make_matrix(n, ycols);
+    }
+}
+
+static int loader_batches_started(data_loader *l)
+{
+    return (l->issued + l->threads - 1) / l->threads;
+}
+
+static void *data_loader_worker(void *ptr)
+{
+    data_loader *l = ptr;
+    pthread_mutex_lock(&l->lock);
+    while(1){
+        while(!l->done && (l->paused || l->issued / l->threads >= l->consumed + l->prefetch
+                    || l->held[(l->issued / l->threads) % l->nslots])){
+            pthread_cond_wait(&l->work, &l->lock);
+        }
+        if(l->done) break;
+        int batch = l->issued / l->threads;
+        int chunk = l->issued % l->threads;
+        int slot = batch % l->nslots;
+        ++l->issued;
+        ++l->active;
+        int total = l->args.n;
+        if(chunk == 0){
+            prepare_batch_slot(l, slot);
+            l->remaining[slot] = l->threads;
+        }
+        load_args a = l->args;
+        data d = l->slots[slot];
+        pthread_mutex_unlock(&l->lock);
+
+        data part = {0};
+        int offset = chunk * total/l->threads;
+        a.n = (chunk+1) * total/l->threads - offset;
+        if(l->recycle){
+            load_args_fill(a, data_rows_view(d, offset, a.n));
+        } else {
+            a.d = &part;
+            load_args_run(a);
+        }
+
+        pthread_mutex_lock(&l->lock);
+        if(!l->recycle) place_data_rows(l->slots + slot, part, offset);
+        --l->active;
+        if(--l->remaining[slot] == 0 || l->active == 0) pthread_cond_broadcast(&l->ready);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return 0;
+}
+
+static void drop_pending_batches(data_loader *l)
+{
+    int b;
+    int started = loader_batches_started(l);
+    for(b = l->consumed; b < started && !l->recycle; ++b){
+        free_data(l->slots[b % l->nslots]);
+    }
+    l->issued = l->consumed * l->threads;
+}
+
+data_loader *make_data_loader(load_args args, int prefetch)
+{
+    int i, xcols, ycols;
+    data_loader *l = calloc(1, sizeof(data_loader));
+    l->args = args;
+    l->threads = args.threads;
+    if(l->threads < 1) l->threads = 1;
+    if(l->threads > args.n) l->threads = args.n;
+    l->prefetch = prefetch < 1 ? 1 : prefetch;
+    l->recycle = batch_data_shape(args, &xcols, &ycols);
+    l->nslots = l->prefetch + 1;
+    l->slots = calloc(l->nslots, sizeof(data));
+    l->remaining = calloc(l->nslots, sizeof(int));
+    l->held = calloc(l->nslots, sizeof(int));
+    pthread_mutex_init(&l->lock, 0);
+    pthread_cond_init(&l->work, 0);
+    pthread_cond_init(&l->ready, 0);
+    l->workers = calloc(l->threads, sizeof(pthread_t));
+    for(i = 0; i < l->threads; ++i){
+        if(pthread_create(l->workers + i, 0, data_loader_worker, l)) error("Thread creation failed");
+    }
+    return l;
+}
+
+data data_loader_next(data_loader *l)
+{
+    pthread_mutex_lock(&l->lock);
+    int slot = l->consumed % l->nslots;
+    while(loader_batches_started(l) <= l->consumed || l->remaining[slot]){
+        pthread_cond_wait(&l->ready, &l->lock);
+    }
+    data d = l->slots[slot];
+    if(l->recycle) l->held[slot] = 1;
+    ++l->consumed;
+    pthread_cond_broadcast(&l->work);
+    pthread_mutex_unlock(&l->lock);
+    return d;
+}
+
+void data_loader_release(data_loader *l, data d)
+{
+    int i;
+    if(!l->recycle){
+        free_data(d);
+        return;
+    }
+    pthread_mutex_lock(&l->lock);
+    for(i = 0; i < l->nslots; ++i){
+        if(l->slots[i].X.vals == d.X.vals) l->held[i] = 0;
+    }
+    pthread_cond_broadcast(&l->work);
+    pthread_mutex_unlock(&l->lock);
+}
+
+void data_loader_reset(data_loader *l, load_args args)
+{
+    pthread_mutex_lock(&l->lock);
+    l->paused = 1;
+    while(l->active) pthread_cond_wait(&l->ready, &l->lock);
+    drop_pending_batches(l);
+    l->args = args;
+    l->paused = 0;
+    pthread_cond_broadcast(&l->work);
+    pthread_mutex_unlock(&l->lock);
+}
+
+void free_data_loader(data_loader *l)
+{
+    int i;
+    pthread_mutex_lock(&l->lock);
+    l->done = 1;
+    pthread_cond_broadcast(&l->work);
+    pthread_mutex_unlock(&l->lock);
+    for(i = 0; i < l->threads; ++i){
+        pthread_join(l->workers[i], 0);
+    }
+    drop_pending_batches(l);
+    for(i = 0; i < l->nslots && l->recycle; ++i){
+        free_data(l->slots[i]);
+    }
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->work);
+    pthread_cond_destroy(&l->ready);
+    free(l->workers);
+    free(l->slots);
+    free(l->remaining);
+    free(l->held);
+    free(l);
+}
+
 data load_data_writing(char **paths, int n, int m, int w, int h, int out_w, int out_h)
 {
     if(m) paths = get_random_paths(paths, n, m);
@@ -1023,14 +1390,22 @@ data load_data_regression(char **paths, int n, int m, int min, int max, int size
     return d;
 }
 
-data load_data_augment(char **paths, int n, int m, char **labels, int k, tree *hierarchy, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center)
+void fill_data_augment(data d, char **paths, int m, char **labels, int k, tree *hierarchy, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center)
 {
+    int n = d.X.rows;
     if(m) paths = get_random_paths(paths, n, m);
+    fill_image_augment_rows(d.X, paths, min, max, size, angle, aspect, hue, saturation, exposure, center);
+    fill_labels_rows(d.y, paths, labels, k, hierarchy);
+    if(m) free(paths);
+}
+
+data load_data_augment(char **paths, int n, int m, char **labels, int k, tree *hierarchy, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center)
+{
     data d = {0};
     d.shallow = 0;
-    d.X = load_image_augment_paths(paths, n, min, max, size, angle, aspect, hue, saturation, exposure, center);
-    d.y = load_labels_paths(paths, n, labels, k, hierarchy);
-    if(m) free(paths);
+    d.X = make_matrix(n, size*size*3);
+    d.y = make_matrix(n, k);
+    fill_data_augment(d, paths, m, labels, k, hierarchy, min, max, size, angle, aspect, hue, saturation, exposure, center);
     return d;
 }
 
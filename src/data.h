@@ -28,6 +28,11 @@ data load_data_captcha_encode(char **paths, int n, int m, int w, int h);
 data load_data_old(char **paths, int n, int m, char **labels, int k, int w, int h);
 data load_data_detection(int n, char **paths, int m, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure);
 data load_data_tag(char **paths, int n, int m, int k, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure);
+void fill_image_augment_rows(matrix X, char **paths, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center);
+void fill_labels_rows(matrix y, char **paths, char **labels, int k, tree *hierarchy);
+void fill_data_augment(data d, char **paths, int m, char **labels, int k, tree *hierarchy, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center);
+void fill_data_detection(data d, char **paths, int m, int w, int h, int boxes, int classes, float jitter, float hue, float saturation, float exposure);
+void fill_data_region(data d, char **paths, int m, int w, int h, int size, int classes, float jitter, float hue, float saturation, float exposure);
 matrix load_image_augment_paths(char **paths, int n, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center);
 data load_data_super(char **paths, int n, int m, int w, int h, int scale);
 data load_data_augment(char **paths, int n, int m, char **labels, int k, tree *hierarchy, int min, int max, int size, float angle, float aspect, float hue, float saturation, float exposure, int center);
@@ -35,6 +40,7 @@ data load_data_regression(char **paths, int n, int m, int min, int max, int size
 data load_go(char *filename);
 
 box_label *read_boxes(char *filename, int *n);
+void detection_label_path(char *path, char *labelpath);
 data load_cifar10_data(char *filename);
 data load_all_cifar10();
 
@@ -17,8 +17,7 @@ static char **demo_names;
 static image **demo_alphabet;
 static int demo_classes;
 
-static float **probs;
-static box *boxes;
+static detection_list dets;
 static network net;
 static image buff [3];
 static image buff_letter[3];
@@ -32,7 +31,6 @@ static int running = 0;
 
 static int demo_delay = 0;
 static int demo_frame = 3;
-static int demo_detections = 0;
 static float **predictions;
 static int demo_index = 0;
 static int demo_done = 0;
@@ -64,20 +62,20 @@ void *detect_in_thread(void *ptr)
     l.output = last_avg2;
     if(demo_delay == 0) l.output = avg;
     if(l.type == DETECTION){
-        get_detection_boxes(l, 1, 1, demo_thresh, probs, boxes, 0);
+        get_detection_detections(l, 1, 1, demo_thresh, 0, &dets);
     } else if (l.type == REGION){
-        get_region_boxes(l, buff[0].w, buff[0].h, net.w, net.h, demo_thresh, probs, boxes, 0, 0, demo_hier, 1);
+        get_region_detections(l, buff[0].w, buff[0].h, net.w, net.h, demo_thresh, 0, 0, demo_hier, 1, &dets);
     } else {
         error("Last layer must produce detections\n");
     }
-    if (nms > 0) do_nms_obj(boxes, probs, l.w*l.h*l.n, l.classes, nms);
+    if (nms > 0) do_nms_obj(dets.dets, dets.n, nms);
 
     printf("\033[2J");
     printf("\033[1;1H");
     printf("\nFPS:%.1f\n",fps);
     printf("Objects:\n\n");
     image display = buff[(buff_index+2) % 3];
-    draw_detections(display, demo_detections, demo_thresh, boxes, probs, demo_names, demo_alphabet, demo_classes);
+    draw_detections(display, dets.dets, dets.n, demo_thresh, demo_names, demo_alphabet, demo_classes);
 
     demo_index = (demo_index + 1)%demo_frame;
     running = 0;
@@ -145,11 +143,7 @@ void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const ch
     demo_thresh = thresh;
     demo_hier = hier;
     printf("Demo\n");
-    net = parse_network_cfg(cfgfile);
-    if(weightfile){
-        load_weights(&net, weightfile);
-    }
-    set_batch_network(&net, 1);
+    net = load_network_inference(cfgfile, weightfile);
     pthread_t detect_thread;
     pthread_t fetch_thread;
 
@@ -175,7 +169,6 @@ void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const ch
     if(!cap) error("Couldn't connect to webcam.\n");
 
     layer l = net.layers[net.n-1];
-    demo_detections = l.n*l.w*l.h;
     int j;
 
     avg = (float *) calloc(l.outputs, sizeof(float));
@@ -183,10 +176,6 @@ void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const ch
     last_avg2 = (float *) calloc(l.outputs, sizeof(float));
     for(j = 0; j < demo_frame; ++j) predictions[j] = (float *) calloc(l.outputs, sizeof(float));
 
-    boxes = (box *)calloc(l.w*l.h*l.n, sizeof(box));
-    probs = (float **)calloc(l.w*l.h*l.n, sizeof(float *));
-    for(j = 0; j < l.w*l.h*l.n; ++j) probs[j] = (float *)calloc(l.classes+1, sizeof(float));
-
     buff[0] = get_image_from_stream(cap);
     buff[1] = copy_image(buff[0]);
     buff[2] = copy_image(buff[0]);
@@ -222,33 +222,42 @@ void backward_detection_layer(const detection_layer l, network net)
     axpy_cpu(l.batch*l.inputs, 1, l.delta, 1, net.delta, 1);
 }
 
-void get_detection_boxes(layer l, int w, int h, float thresh, float **probs, box *boxes, int only_objectness)
+/* Reads the boxes of the first image of l.output into dets, as
+ * get_region_detections does. */
+void get_detection_detections(layer l, int w, int h, float thresh, int only_objectness, detection_list *dets)
 {
     int i,j,n;
     float *predictions = l.output;
     //int per_cell = 5*num+classes;
+    reset_detections(dets);
     for (i = 0; i < l.side*l.side; ++i){
         int row = i / l.side;
         int col = i % l.side;
         for(n = 0; n < l.n; ++n){
-            int index = i*l.n + n;
             int p_index = l.side*l.side*l.classes + i*l.n + n;
             float scale = predictions[p_index];
             int box_index = l.side*l.side*(l.classes + l.n) + (i*l.n + n)*4;
-            boxes[index].x = (predictions[box_index + 0] + col) / l.side * w;
-            boxes[index].y = (predictions[box_index + 1] + row) / l.side * h;
-            boxes[index].w = pow(predictions[box_index + 2], (l.sqrt?2:1)) * w;
-            boxes[index].h = pow(predictions[box_index + 3], (l.sqrt?2:1)) * h;
+            box b;
+            b.x = (predictions[box_index + 0] + col) / l.side * w;
+            b.y = (predictions[box_index + 1] + row) / l.side * h;
+            b.w = pow(predictions[box_index + 2], (l.sqrt?2:1)) * w;
+            b.h = pow(predictions[box_index + 3], (l.sqrt?2:1)) * h;
+            add_detection(dets, b, 0);
+            float max = 0;
             for(j = 0; j < l.classes; ++j){
                 int class_index = i*l.classes;
                 float prob = scale*predictions[class_index+j];
-                probs[index][j] = (prob > thresh) ? prob : 0;
+                if(prob > thresh && !only_objectness) add_detection_score(dets, j, prob);
+                if(prob > max) max = prob;
             }
-            if(only_objectness){
-                probs[index][0] = scale;
+            dets->dets[dets->n-1].objectness = max;
+            if(only_objectness && scale != 0){
+                add_detection_score(dets, 0, scale);
             }
+            drop_empty_detection(dets);
         }
     }
+    finish_detections(dets);
 }
 
 #ifdef GPU
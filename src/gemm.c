@@ -1,10 +1,419 @@
 #include "gemm.h"
 #include "utils.h"
 #include "cuda.h"
+#include "threadpool.h"
+#include "im2col.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMM_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Blocked CPU gemm.
+ *
+ * C is computed in NC x KC x MC blocks: a KC x NC slab of B and an MC x KC
+ * slab of A are packed into contiguous panels NR columns / MR rows wide, then
+ * a register-tiled MR x NR micro-kernel sweeps over the packed panels. The
+ * micro-kernel is picked once at runtime from what the CPU supports.
+ */
+
+#define GEMM_KC 256
+#define GEMM_MC 96
+#define GEMM_NC 4080
+
+/* Smallest share of a gemm worth handing to another thread. */
+#define GEMM_MIN_FLOPS 200000
+
+typedef void (*gemm_kernel_fn)(int kc, const float *a, const float *b, float *c, int ldc);
+
+typedef struct{
+    char *name;
+    int mr;
+    int nr;
+    gemm_kernel_fn kernel;
+    int (*supported)();
+} gemm_kernel;
+
+static int cpu_has_nothing_special()
+{
+    return 1;
+}
+
+#define SCALAR_MR 4
+#define SCALAR_NR 8
+
+static void gemm_kernel_scalar(int kc, const float *a, const float *b, float *c, int ldc)
+{
+    float acc[SCALAR_MR][SCALAR_NR] = {{0}};
+    int i, j, k;
+    for(k = 0; k < kc; ++k){
+        for(i = 0; i < SCALAR_MR; ++i){
+            float a_part = a[i];
+            for(j = 0; j < SCALAR_NR; ++j){
+                acc[i][j] += a_part*b[j];
+            }
+        }
+        a += SCALAR_MR;
+        b += SCALAR_NR;
+    }
+    for(i = 0; i < SCALAR_MR; ++i){
+        for(j = 0; j < SCALAR_NR; ++j){
+            c[i*ldc + j] += acc[i][j];
+        }
+    }
+}
+
+#ifdef GEMM_X86
+
+static int cpu_has_avx2()
+{
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+static int cpu_has_avx512()
+{
+    return __builtin_cpu_supports("avx512f");
+}
+
+__attribute__((target("avx2,fma")))
+static void gemm_kernel_avx2(int kc, const float *a, const float *b, float *c, int ldc)
+{
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    int k;
+    for(k = 0; k < kc; ++k){
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+        __m256 ai;
+        ai = _mm256_broadcast_ss(a + 0); c00 = _mm256_fmadd_ps(ai, b0, c00); c01 = _mm256_fmadd_ps(ai, b1, c01);
+        ai = _mm256_broadcast_ss(a + 1); c10 = _mm256_fmadd_ps(ai, b0, c10); c11 = _mm256_fmadd_ps(ai, b1, c11);
+        ai = _mm256_broadcast_ss(a + 2); c20 = _mm256_fmadd_ps(ai, b0, c20); c21 = _mm256_fmadd_ps(ai, b1, c21);
+        ai = _mm256_broadcast_ss(a + 3); c30 = _mm256_fmadd_ps(ai, b0, c30); c31 = _mm256_fmadd_ps(ai, b1, c31);
+        ai = _mm256_broadcast_ss(a + 4); c40 = _mm256_fmadd_ps(ai, b0, c40); c41 = _mm256_fmadd_ps(ai, b1, c41);
+        ai = _mm256_broadcast_ss(a + 5); c50 = _mm256_fmadd_ps(ai, b0, c50); c51 = _mm256_fmadd_ps(ai, b1, c51);
+        a += 6;
+        b += 16;
+    }
+#define GEMM_AVX2_STORE(row, lo, hi) \
+    _mm256_storeu_ps(c + row*ldc,     _mm256_add_ps(_mm256_loadu_ps(c + row*ldc),     lo)); \
+    _mm256_storeu_ps(c + row*ldc + 8, _mm256_add_ps(_mm256_loadu_ps(c + row*ldc + 8), hi));
+    GEMM_AVX2_STORE(0, c00, c01);
+    GEMM_AVX2_STORE(1, c10, c11);
+    GEMM_AVX2_STORE(2, c20, c21);
+    GEMM_AVX2_STORE(3, c30, c31);
+    GEMM_AVX2_STORE(4, c40, c41);
+    GEMM_AVX2_STORE(5, c50, c51);
+#undef GEMM_AVX2_STORE
+}
+
+__attribute__((target("avx512f")))
+static void gemm_kernel_avx512(int kc, const float *a, const float *b, float *c, int ldc)
+{
+    __m512 c00 = _mm512_setzero_ps(), c01 = _mm512_setzero_ps();
+    __m512 c10 = _mm512_setzero_ps(), c11 = _mm512_setzero_ps();
+    __m512 c20 = _mm512_setzero_ps(), c21 = _mm512_setzero_ps();
+    __m512 c30 = _mm512_setzero_ps(), c31 = _mm512_setzero_ps();
+    __m512 c40 = _mm512_setzero_ps(), c41 = _mm512_setzero_ps();
+    __m512 c50 = _mm512_setzero_ps(), c51 = _mm512_setzero_ps();
+    __m512 c60 = _mm512_setzero_ps(), c61 = _mm512_setzero_ps();
+    __m512 c70 = _mm512_setzero_ps(), c71 = _mm512_setzero_ps();
+    int k;
+    for(k = 0; k < kc; ++k){
+        __m512 b0 = _mm512_load_ps(b);
+        __m512 b1 = _mm512_load_ps(b + 16);
+        __m512 ai;
+        ai = _mm512_set1_ps(a[0]); c00 = _mm512_fmadd_ps(ai, b0, c00); c01 = _mm512_fmadd_ps(ai, b1, c01);
+        ai = _mm512_set1_ps(a[1]); c10 = _mm512_fmadd_ps(ai, b0, c10); c11 = _mm512_fmadd_ps(ai, b1, c11);
+        ai = _mm512_set1_ps(a[2]); c20 = _mm512_fmadd_ps(ai, b0, c20); c21 = _mm512_fmadd_ps(ai, b1, c21);
+        ai = _mm512_set1_ps(a[3]); c30 = _mm512_fmadd_ps(ai, b0, c30); c31 = _mm512_fmadd_ps(ai, b1, c31);
+        ai = _mm512_set1_ps(a[4]); c40 = _mm512_fmadd_ps(ai, b0, c40); c41 = _mm512_fmadd_ps(ai, b1, c41);
+        ai = _mm512_set1_ps(a[5]); c50 = _mm512_fmadd_ps(ai, b0, c50); c51 = _mm512_fmadd_ps(ai, b1, c51);
+        ai = _mm512_set1_ps(a[6]); c60 = _mm512_fmadd_ps(ai, b0, c60); c61 = _mm512_fmadd_ps(ai, b1, c61);
+        ai = _mm512_set1_ps(a[7]); c70 = _mm512_fmadd_ps(ai, b0, c70); c71 = _mm512_fmadd_ps(ai, b1, c71);
+        a += 8;
+        b += 32;
+    }
+#define GEMM_AVX512_STORE(row, lo, hi) \
+    _mm512_storeu_ps(c + row*ldc,      _mm512_add_ps(_mm512_loadu_ps(c + row*ldc),      lo)); \
+    _mm512_storeu_ps(c + row*ldc + 16, _mm512_add_ps(_mm512_loadu_ps(c + row*ldc + 16), hi));
+    GEMM_AVX512_STORE(0, c00, c01);
+    GEMM_AVX512_STORE(1, c10, c11);
+    GEMM_AVX512_STORE(2, c20, c21);
+    GEMM_AVX512_STORE(3, c30, c31);
+    GEMM_AVX512_STORE(4, c40, c41);
+    GEMM_AVX512_STORE(5, c50, c51);
+    GEMM_AVX512_STORE(6, c60, c61);
+    GEMM_AVX512_STORE(7, c70, c71);
+#undef GEMM_AVX512_STORE
+}
+
+#endif
+
+/* Ordered from most to least preferred. */
+static gemm_kernel gemm_kernels[] = {
+#ifdef GEMM_X86
+    {"avx512", 8, 32, gemm_kernel_avx512, cpu_has_avx512},
+    {"avx2",   6, 16, gemm_kernel_avx2,   cpu_has_avx2},
+#endif
+    {"scalar", SCALAR_MR, SCALAR_NR, gemm_kernel_scalar, cpu_has_nothing_special},
+};
+
+static const int gemm_nkernels = sizeof(gemm_kernels)/sizeof(gemm_kernels[0]);
+static gemm_kernel *gemm_current_kernel = 0;
+
+static gemm_kernel *get_gemm_kernel()
+{
+    if(!gemm_current_kernel){
+        int i;
+        for(i = 0; i < gemm_nkernels; ++i){
+            if(gemm_kernels[i].supported()){
+                gemm_current_kernel = gemm_kernels + i;
+                break;
+            }
+        }
+    }
+    return gemm_current_kernel;
+}
+
+/* Packing buffers are per thread and only ever grow. */
+static __thread float *gemm_pack_a = 0;
+static __thread float *gemm_pack_b = 0;
+static __thread size_t gemm_pack_a_size = 0;
+static __thread size_t gemm_pack_b_size = 0;
+
+static float *gemm_buffer(float **buf, size_t *size, size_t n)
+{
+    if(n > *size){
+        free(*buf);
+        void *p = 0;
+        if(posix_memalign(&p, 64, n*sizeof(float))) malloc_error();
+        *buf = p;
+        *size = n;
+    }
+    return *buf;
+}
+
+/* Packs an mc x kc block of op(A) into MR-row panels, k-major inside each panel. */
+static void pack_a(int TA, int mc, int kc, float ALPHA, float *A, int lda, int mr, float *pack)
+{
+    int i, k, p;
+    for(p = 0; p < mc; p += mr){
+        int rows = (mc - p < mr) ? mc - p : mr;
+        for(k = 0; k < kc; ++k){
+            for(i = 0; i < rows; ++i){
+                float v = TA ? A[k*lda + p + i] : A[(p + i)*lda + k];
+                pack[i] = ALPHA*v;
+            }
+            for(; i < mr; ++i) pack[i] = 0;
+            pack += mr;
+        }
+    }
+}
+
+/*
+ * The B operand is either a plain, optionally transposed, matrix, the
+ * im2col expansion of an image or a matrix packed ahead of time. The im2col
+ * expansion is gathered straight from the image while packing, so the column
+ * matrix is never built.
+ */
+typedef struct{
+    float *B;
+    int TB;
+    int ldb;
+
+    float *packed;
+
+    float *im;
+    int channels, height, width;
+    int ksize, stride, pad;
+    int out_w;
+} gemm_b_source;
+
+static void pack_b_matrix(const gemm_b_source *src, int k0, int kc, int j0, int nc, int nr, float *pack)
+{
+    int TB = src->TB;
+    int ldb = src->ldb;
+    float *B = TB ? src->B + j0*ldb + k0 : src->B + k0*ldb + j0;
+    int j, k, p;
+    for(p = 0; p < nc; p += nr){
+        int cols = (nc - p < nr) ? nc - p : nr;
+        for(k = 0; k < kc; ++k){
+            if(!TB && cols == nr){
+                memcpy(pack, B + k*ldb + p, nr*sizeof(float));
+            } else {
+                for(j = 0; j < cols; ++j){
+                    pack[j] = TB ? B[(p + j)*ldb + k] : B[k*ldb + p + j];
+                }
+                for(; j < nr; ++j) pack[j] = 0;
+            }
+            pack += nr;
+        }
+    }
+}
+
+static void pack_b_im2col(const gemm_b_source *src, int k0, int kc, int j0, int nc, int nr, float *pack)
+{
+    int ksize = src->ksize;
+    int stride = src->stride;
+    int pad = src->pad;
+    int height = src->height;
+    int width = src->width;
+    int out_w = src->out_w;
+    int j, k, p;
+    for(p = 0; p < nc; p += nr){
+        int cols = (nc - p < nr) ? nc - p : nr;
+        for(k = k0; k < k0 + kc; ++k){
+            int w_offset = k % ksize;
+            int h_offset = (k / ksize) % ksize;
+            float *plane = src->im + (k / ksize / ksize)*height*width;
+            int col = j0 + p;
+            int oh = col / out_w;
+            int ow = col % out_w;
+            j = 0;
+            while(j < cols){
+                int run = out_w - ow;
+                if(run > cols - j) run = cols - j;
+                int row = oh*stride - pad + h_offset;
+                if(row < 0 || row >= height){
+                    memset(pack + j, 0, run*sizeof(float));
+                } else {
+                    float *in = plane + row*width;
+                    int x, c = ow*stride - pad + w_offset;
+                    if(stride == 1 && c >= 0 && c + run <= width){
+                        memcpy(pack + j, in + c, run*sizeof(float));
+                    } else {
+                        for(x = 0; x < run; ++x, c += stride){
+                            pack[j + x] = (c >= 0 && c < width) ? in[c] : 0;
+                        }
+                    }
+                }
+                j += run;
+                ow = 0;
+                ++oh;
+            }
+            for(; j < nr; ++j) pack[j] = 0;
+            pack += nr;
+        }
+    }
+}
+
+/* Packs a kc x nc block of B, starting at row k0 and column j0, into NR-column panels, k-major inside each panel. */
+static void pack_b(const gemm_b_source *src, int k0, int kc, int j0, int nc, int nr, float *pack)
+{
+    if(src->im) pack_b_im2col(src, k0, kc, j0, nc, nr, pack);
+    else pack_b_matrix(src, k0, kc, j0, nc, nr, pack);
+}
+
+/* Applies e to the rows x cols block of C whose top left element is (row0, col0) of the whole output. */
+void gemm_epilogue_apply(const gemm_epilogue *e, int row0, int col0, int rows, int cols, float *C, int ldc)
+{
+    activate_kernel activate = get_activate_kernel(e->activation);
+    int i, j;
+    for(i = 0; i < rows; ++i){
+        float *c = C + i*ldc;
+        if(e->per_column){
+            if(e->scale){
+                float *scale = e->scale + col0;
+                for(j = 0; j < cols; ++j) c[j] *= scale[j];
+            }
+            if(e->bias){
+                float *bias = e->bias + col0;
+                for(j = 0; j < cols; ++j) c[j] += bias[j];
+            }
+        } else if(e->scale){
+            float scale = e->scale[row0 + i];
+            float bias = e->bias ? e->bias[row0 + i] : 0;
+            for(j = 0; j < cols; ++j) c[j] = c[j]*scale + bias;
+        } else if(e->bias){
+            float bias = e->bias[row0 + i];
+            for(j = 0; j < cols; ++j) c[j] += bias;
+        }
+        activate(c, cols);
+    }
+}
+
+/*
+ * Panels of bpack are ldp*NR floats apart: kc when packed per block, K when packed ahead of time.
+ * e is only passed on the last K block, when each micro-tile of C is final once the kernel is done with it.
+ */
+static void gemm_macro_kernel(gemm_kernel *gk, int mc, int nc, int kc,
+        float *apack, float *bpack, int ldp, float *C, int ldc,
+        const gemm_epilogue *e, int row0, int col0)
+{
+    int mr = gk->mr;
+    int nr = gk->nr;
+    float edge[32*32];
+    int i, j, ir, jr;
+    for(jr = 0; jr < nc; jr += nr){
+        int cols = (nc - jr < nr) ? nc - jr : nr;
+        for(ir = 0; ir < mc; ir += mr){
+            int rows = (mc - ir < mr) ? mc - ir : mr;
+            float *a = apack + ir*kc;
+            float *b = bpack + jr*ldp;
+            float *c = C + ir*ldc + jr;
+            if(rows == mr && cols == nr){
+                gk->kernel(kc, a, b, c, ldc);
+            } else {
+                memset(edge, 0, mr*nr*sizeof(float));
+                gk->kernel(kc, a, b, edge, nr);
+                for(i = 0; i < rows; ++i){
+                    for(j = 0; j < cols; ++j){
+                        c[i*ldc + j] += edge[i*nr + j];
+                    }
+                }
+            }
+            if(e) gemm_epilogue_apply(e, row0 + ir, col0 + jr, rows, cols, c, ldc);
+        }
+    }
+}
+
+/* C += ALPHA * op(A) * B[:, j0:j0+N], then e on rows i0.. and columns j0.. of the whole output. */
+static void gemm_blocked(gemm_kernel *gk, int TA, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        const gemm_b_source *src, int i0, int j0,
+        float *C, int ldc, const gemm_epilogue *e)
+{
+    int mr = gk->mr;
+    int nr = gk->nr;
+    int mcb = (GEMM_MC/mr)*mr;
+    int ncb = (GEMM_NC/nr)*nr;
+    int kcb = GEMM_KC;
+    float *apack = gemm_buffer(&gemm_pack_a, &gemm_pack_a_size, (size_t)mcb*kcb);
+    float *bpack = gemm_buffer(&gemm_pack_b, &gemm_pack_b_size, (size_t)ncb*kcb);
+    int ic, jc, pc;
+    for(jc = 0; jc < N; jc += ncb){
+        int nc = (N - jc < ncb) ? N - jc : ncb;
+        for(pc = 0; pc < K; pc += kcb){
+            int kc = (K - pc < kcb) ? K - pc : kcb;
+            float *b = bpack;
+            int ldp = kc;
+            if(src->packed){
+                b = src->packed + (size_t)(j0 + jc)*K + pc*nr;
+                ldp = K;
+            } else {
+                pack_b(src, pc, kc, j0 + jc, nc, nr, bpack);
+            }
+            const gemm_epilogue *last = (pc + kc >= K) ? e : 0;
+            for(ic = 0; ic < M; ic += mcb){
+                int mc = (M - ic < mcb) ? M - ic : mcb;
+                float *a = TA ? A + pc*lda + ic : A + ic*lda + pc;
+                pack_a(TA, mc, kc, ALPHA, a, lda, mr, apack);
+                gemm_macro_kernel(gk, mc, nc, kc, apack, b, ldp, C + ic*ldc + jc, ldc,
+                        last, i0 + ic, j0 + jc);
+            }
+        }
+    }
+}
+
 void gemm_bin(int M, int N, int K, float ALPHA, 
         char  *A, int lda, 
         float *B, int ldb,
@@ -50,18 +459,19 @@ void time_random_matrix(int TA, int TB, int m, int k, int n)
 
     float *c = random_matrix(m,n);
     int i;
-    clock_t start = clock(), end;
-    for(i = 0; i<10; ++i){
+    int iter = 10;
+    double start = what_time_is_it_now();
+    for(i = 0; i<iter; ++i){
         gemm_cpu(TA,TB,m,n,k,1,a,lda,b,ldb,1,c,n);
     }
-    end = clock();
-    printf("Matrix Multiplication %dx%d * %dx%d, TA=%d, TB=%d: %lf ms\n",m,k,k,n, TA, TB, (float)(end-start)/CLOCKS_PER_SEC);
+    double seconds = what_time_is_it_now() - start;
+    double gflop = 2.*m*n*k*iter/1e9;
+    printf("Matrix Multiplication %dx%d * %dx%d, TA=%d, TB=%d: %lf s, %lf GFLOPS\n",m,k,k,n, TA, TB, seconds, gflop/seconds);
     free(a);
     free(b);
     free(c);
 }
 
-
 void gemm(int TA, int TB, int M, int N, int K, float ALPHA, 
         float *A, int lda, 
         float *B, int ldb,
@@ -138,19 +548,29 @@ void gemm_tt(int M, int N, int K, float ALPHA,
 }
 
 
-void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA, 
-        float *A, int lda, 
-        float *B, int ldb,
-        float BETA,
-        float *C, int ldc)
+static void gemm_scale_c(int M, int N, float BETA, float *C, int ldc)
 {
-    //printf("cpu: %d %d %d %d %d %f %d %d %f %d\n",TA, TB, M, N, K, ALPHA, lda, ldb, BETA, ldc);
     int i, j;
+    if(BETA == 1) return;
     for(i = 0; i < M; ++i){
-        for(j = 0; j < N; ++j){
-            C[i*ldc + j] *= BETA;
+        if(BETA == 0){
+            memset(C + i*ldc, 0, N*sizeof(float));
+        } else {
+            for(j = 0; j < N; ++j){
+                C[i*ldc + j] *= BETA;
+            }
         }
     }
+}
+
+/* The original triple loops, kept as the reference the blocked path is checked against. */
+void gemm_cpu_ref(int TA, int TB, int M, int N, int K, float ALPHA, 
+        float *A, int lda, 
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc)
+{
+    gemm_scale_c(M, N, BETA, C, ldc);
     if(!TA && !TB)
         gemm_nn(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
     else if(TA && !TB)
@@ -161,6 +581,313 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
         gemm_tt(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
 }
 
+typedef struct{
+    gemm_kernel *gk;
+    int TA, M, N, K;
+    float ALPHA;
+    float *A;
+    int lda;
+    gemm_b_source b;
+    float BETA;
+    float *C;
+    int ldc;
+    const gemm_epilogue *e;
+    int rows;
+    int step;
+} gemm_job;
+
+/* Runs the rows or columns [start*step, end*step) of C. */
+static void gemm_part(void *ptr, int start, int end)
+{
+    gemm_job g = *(gemm_job *)ptr;
+    int lo = start*g.step;
+    int hi = end*g.step;
+    int i0 = 0;
+    int j0 = 0;
+    if(g.rows){
+        i0 = lo;
+        if(hi > g.M) hi = g.M;
+        g.A += g.TA ? lo : lo*g.lda;
+        g.C += lo*g.ldc;
+        g.M = hi - lo;
+    } else {
+        if(hi > g.N) hi = g.N;
+        j0 = lo;
+        g.C += lo;
+        g.N = hi - lo;
+    }
+    if(!g.gk){
+        float *B = g.b.TB ? g.b.B + j0*g.b.ldb : g.b.B + j0;
+        gemm_cpu_ref(g.TA, g.b.TB, g.M, g.N, g.K, g.ALPHA, g.A, g.lda, B, g.b.ldb, g.BETA, g.C, g.ldc);
+        if(g.e) gemm_epilogue_apply(g.e, i0, j0, g.M, g.N, g.C, g.ldc);
+        return;
+    }
+    gemm_scale_c(g.M, g.N, g.BETA, g.C, g.ldc);
+    if(g.K <= 0){
+        if(g.e) gemm_epilogue_apply(g.e, i0, j0, g.M, g.N, g.C, g.ldc);
+        return;
+    }
+    gemm_blocked(g.gk, g.TA, g.M, g.N, g.K, g.ALPHA, g.A, g.lda, &g.b, i0, j0, g.C, g.ldc, g.e);
+}
+
+static void gemm_run(gemm_job g)
+{
+    if(g.M <= 0 || g.N <= 0) return;
+    /* Work is split on whole micro-tiles of C, so every element is computed
+     * the same way no matter how many threads take part. */
+    int threads = get_cpu_threads();
+    int mr = g.gk ? g.gk->mr : 1;
+    int nr = g.gk ? g.gk->nr : 16;
+    int units_m = (g.M + mr - 1)/mr;
+    int units_n = (g.N + nr - 1)/nr;
+    g.rows = units_n < threads && units_m > units_n;
+    g.step = g.rows ? mr : nr;
+    double flops_per_unit = 2.*g.K*g.step*(g.rows ? g.N : g.M);
+    int grain = (int)(GEMM_MIN_FLOPS/(flops_per_unit + 1)) + 1;
+    parallel_for(g.rows ? units_m : units_n, grain, gemm_part, &g);
+}
+
+void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA, 
+        float *A, int lda, 
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc)
+{
+    //printf("cpu: %d %d %d %d %d %f %d %d %f %d\n",TA, TB, M, N, K, ALPHA, lda, ldb, BETA, ldc);
+    gemm_epilogue_cpu(TA, TB, M, N, K, ALPHA, A, lda, B, ldb, BETA, C, ldc, 0);
+}
+
+/* gemm_cpu followed by e on every element of C, done tile by tile inside the gemm. */
+void gemm_epilogue_cpu(int TA, int TB, int M, int N, int K, float ALPHA, 
+        float *A, int lda, 
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc,
+        const gemm_epilogue *e)
+{
+    gemm_job g = {get_gemm_kernel(), TA, M, N, K, ALPHA, A, lda, {0}, BETA, C, ldc, e};
+    g.b.B = B;
+    g.b.TB = TB;
+    g.b.ldb = ldb;
+    /* Matrix-vector shaped: packing B would cost more than it saves. */
+    if(M <= 2) g.gk = 0;
+    gemm_run(g);
+}
+
+/*
+ * C = ALPHA * A * im2col(im) + BETA * C, without building the column matrix,
+ * then e if it is given. A is M x (channels*ksize*ksize), C is M x (out_h*out_w).
+ */
+void gemm_conv_cpu(int M, float ALPHA,
+        float *A, int lda,
+        float *im, int channels, int height, int width,
+        int ksize, int stride, int pad,
+        float BETA,
+        float *C, int ldc,
+        const gemm_epilogue *e)
+{
+    int out_h = (height + 2*pad - ksize) / stride + 1;
+    int out_w = (width + 2*pad - ksize) / stride + 1;
+    gemm_job g = {get_gemm_kernel(), 0, M, out_h*out_w, channels*ksize*ksize, ALPHA, A, lda, {0}, BETA, C, ldc, e};
+    g.b.im = im;
+    g.b.channels = channels;
+    g.b.height = height;
+    g.b.width = width;
+    g.b.ksize = ksize;
+    g.b.stride = stride;
+    g.b.pad = pad;
+    g.b.out_w = out_w;
+    gemm_run(g);
+}
+
+/*
+ * A pre-packed B holds the NR-column panels gemm_blocked would otherwise pack
+ * on every call, each running the full K rows, so a constant operand is
+ * packed once. The layout depends on the gemm kernel picked for this cpu.
+ */
+size_t gemm_packed_size(int K, int N)
+{
+    int nr = get_gemm_kernel()->nr;
+    return (size_t)K*((N + nr - 1)/nr)*nr;
+}
+
+void gemm_prepack_b(int K, int N, float *B, int ldb, float *packed)
+{
+    gemm_b_source src = {0};
+    src.B = B;
+    src.ldb = ldb;
+    pack_b_matrix(&src, 0, K, 0, N, get_gemm_kernel()->nr, packed);
+}
+
+/* C = ALPHA * A * B + BETA * C, B packed by gemm_prepack_b. */
+void gemm_packed_cpu(int TA, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *packed,
+        float BETA,
+        float *C, int ldc)
+{
+    gemm_job g = {get_gemm_kernel(), TA, M, N, K, ALPHA, A, lda, {0}, BETA, C, ldc};
+    g.b.packed = packed;
+    gemm_run(g);
+}
+
+void test_cpu_accuracy(int TA, int TB, int m, int k, int n)
+{
+    srand(0);
+    float *a;
+    if(!TA) a = random_matrix(m,k);
+    else a = random_matrix(k,m);
+    int lda = (!TA)?k:m;
+    float *b;
+    if(!TB) b = random_matrix(k,n);
+    else b = random_matrix(n,k);
+    int ldb = (!TB)?n:k;
+
+    float *c = random_matrix(m,n);
+    float *c_ref = calloc(m*n, sizeof(float));
+    memcpy(c_ref, c, m*n*sizeof(float));
+    int i;
+    gemm_cpu(TA,TB,m,n,k,.5,a,lda,b,ldb,2,c,n);
+    gemm_cpu_ref(TA,TB,m,n,k,.5,a,lda,b,ldb,2,c_ref,n);
+    double max_err = 0;
+    for(i = 0; i < m*n; ++i) {
+        double err = fabs(c[i]-c_ref[i])/(fabs(c_ref[i]) + 1);
+        if(err > max_err) max_err = err;
+    }
+    printf("Matrix Multiplication %dx%d * %dx%d, TA=%d, TB=%d: %g max rel err %s\n",m,k,k,n, TA, TB, max_err, (max_err < 1e-4) ? "" : "FAILED");
+    free(a);
+    free(b);
+    free(c);
+    free(c_ref);
+}
+
+void test_packed_accuracy(int TA, int m, int k, int n)
+{
+    srand(0);
+    float *a = TA ? random_matrix(k,m) : random_matrix(m,k);
+    int lda = TA ? m : k;
+    float *b = random_matrix(k,n);
+    float *c = random_matrix(m,n);
+    float *c_ref = calloc(m*n, sizeof(float));
+    memcpy(c_ref, c, m*n*sizeof(float));
+    void *packed = 0;
+    if(posix_memalign(&packed, 64, gemm_packed_size(k,n)*sizeof(float))) malloc_error();
+    gemm_prepack_b(k,n,b,n,packed);
+    gemm_packed_cpu(TA,m,n,k,.5,a,lda,packed,2,c,n);
+    gemm_cpu_ref(TA,0,m,n,k,.5,a,lda,b,n,2,c_ref,n);
+    double max_err = 0;
+    int i;
+    for(i = 0; i < m*n; ++i) {
+        double err = fabs(c[i]-c_ref[i])/(fabs(c_ref[i]) + 1);
+        if(err > max_err) max_err = err;
+    }
+    printf("Pre-packed Multiplication %dx%d * %dx%d, TA=%d: %g max rel err %s\n",m,k,k,n, TA, max_err, (max_err < 1e-4) ? "" : "FAILED");
+    free(a);
+    free(b);
+    free(c);
+    free(c_ref);
+    free(packed);
+}
+
+void test_conv_accuracy(int c, int h, int w, int size, int stride, int pad, int n)
+{
+    srand(0);
+    int out_h = (h + 2*pad - size)/stride + 1;
+    int out_w = (w + 2*pad - size)/stride + 1;
+    int k = c*size*size;
+    int outputs = out_h*out_w;
+    float *weights = random_matrix(n, k);
+    float *im = random_matrix(c, h*w);
+    float *col = calloc(k*outputs, sizeof(float));
+    float *out = calloc(n*outputs, sizeof(float));
+    float *out_ref = calloc(n*outputs, sizeof(float));
+    int i;
+    im2col_cpu(im, c, h, w, size, stride, pad, col);
+    gemm_cpu_ref(0,0,n,outputs,k,1,weights,k,col,outputs,1,out_ref,outputs);
+    gemm_conv_cpu(n,1,weights,k,im,c,h,w,size,stride,pad,1,out,outputs,0);
+    double max_err = 0;
+    for(i = 0; i < n*outputs; ++i) {
+        double err = fabs(out[i]-out_ref[i])/(fabs(out_ref[i]) + 1);
+        if(err > max_err) max_err = err;
+    }
+    printf("Implicit convolution %dx%dx%d, %d filters %dx%d/%d pad %d: %g max rel err %s\n", w, h, c, n, size, size, stride, pad, max_err, (max_err < 1e-4) ? "" : "FAILED");
+    free(weights);
+    free(im);
+    free(col);
+    free(out);
+    free(out_ref);
+}
+
+void test_epilogue_accuracy(int per_column, ACTIVATION a, int m, int k, int n)
+{
+    srand(0);
+    float *A = random_matrix(m, k);
+    float *B = random_matrix(k, n);
+    float *c = calloc(m*n, sizeof(float));
+    float *c_ref = calloc(m*n, sizeof(float));
+    int len = per_column ? n : m;
+    float *bias = random_matrix(1, len);
+    float *scale = random_matrix(1, len);
+    gemm_epilogue e = {bias, scale, per_column, a};
+    int i;
+    gemm_cpu_ref(0,0,m,n,k,1,A,k,B,n,0,c_ref,n);
+    for(i = 0; i < m*n; ++i){
+        int j = per_column ? i%n : i/n;
+        c_ref[i] = activate(c_ref[i]*scale[j] + bias[j], a);
+    }
+    gemm_epilogue_cpu(0,0,m,n,k,1,A,k,B,n,0,c,n,&e);
+    double max_err = 0;
+    for(i = 0; i < m*n; ++i) {
+        double err = fabs(c[i]-c_ref[i])/(fabs(c_ref[i]) + 1);
+        if(err > max_err) max_err = err;
+    }
+    printf("Epilogue %s per %s %dx%d * %dx%d: %g max rel err %s\n", get_activation_string(a), per_column ? "column" : "row", m, k, k, n, max_err, (max_err < 1e-4) ? "" : "FAILED");
+    free(A);
+    free(B);
+    free(c);
+    free(c_ref);
+    free(bias);
+    free(scale);
+}
+
+void test_blas()
+{
+    int i, t;
+    int sizes[][3] = {{1,1,1}, {7,13,5}, {17,10,10}, {33,75,129}, {100,1000,10}, {255,1024,169}, {64,300,4100}};
+    for(i = 0; i < gemm_nkernels; ++i){
+        if(!gemm_kernels[i].supported()) continue;
+        gemm_current_kernel = gemm_kernels + i;
+        printf("gemm kernel: %s (%dx%d)\n", gemm_current_kernel->name, gemm_current_kernel->mr, gemm_current_kernel->nr);
+        for(t = 0; t < sizeof(sizes)/sizeof(sizes[0]); ++t){
+            test_cpu_accuracy(0,0,sizes[t][0],sizes[t][1],sizes[t][2]);
+            test_cpu_accuracy(1,0,sizes[t][0],sizes[t][1],sizes[t][2]);
+            test_cpu_accuracy(0,1,sizes[t][0],sizes[t][1],sizes[t][2]);
+            test_cpu_accuracy(1,1,sizes[t][0],sizes[t][1],sizes[t][2]);
+        }
+        test_packed_accuracy(0, 1, 7, 3);
+        test_packed_accuracy(0, 49, 300, 1000);
+        test_packed_accuracy(1, 37, 513, 70);
+        test_conv_accuracy(3, 13, 17, 3, 1, 1, 5);
+        test_conv_accuracy(16, 31, 29, 3, 2, 1, 33);
+        test_conv_accuracy(8, 20, 20, 5, 1, 2, 17);
+        test_conv_accuracy(32, 19, 19, 1, 1, 0, 64);
+        test_conv_accuracy(7, 12, 12, 2, 2, 0, 9);
+        test_conv_accuracy(64, 8, 40, 3, 1, 1, 100);
+        test_epilogue_accuracy(0, LEAKY, 37, 100, 300);
+        test_epilogue_accuracy(0, LOGISTIC, 100, 300, 5000);
+        test_epilogue_accuracy(1, RELU, 1, 300, 77);
+        test_epilogue_accuracy(1, LINEAR, 33, 64, 129);
+        test_epilogue_accuracy(0, ELU, 19, 20, 21);
+        time_random_matrix(0,0,64,75,12544); 
+        time_random_matrix(0,0,64,576,12544); 
+        time_random_matrix(0,0,256,2304,784); 
+        time_random_matrix(0,1,1,4096,1000); 
+        time_random_matrix(0,0,512,4608,196); 
+        time_random_matrix(1,1,4608,512,196); 
+    }
+    gemm_current_kernel = 0;
+}
+
 #ifdef GPU
 
 #include <math.h>
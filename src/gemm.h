@@ -1,5 +1,21 @@
 #ifndef GEMM_H
 #define GEMM_H
+#include <stddef.h>
+#include "activations.h"
+
+/*
+ * Work folded into the gemm as each tile of C is finished, while it is still
+ * in cache: C = activation(scale*C + bias). bias and scale are indexed by
+ * row, or by column when per_column is set; either may be 0.
+ */
+typedef struct gemm_epilogue{
+    float *bias;
+    float *scale;
+    int per_column;
+    ACTIVATION activation;
+} gemm_epilogue;
+
+void gemm_epilogue_apply(const gemm_epilogue *e, int row0, int col0, int rows, int cols, float *C, int ldc);
 
 void gemm_bin(int M, int N, int K, float ALPHA, 
         char  *A, int lda, 
@@ -18,6 +34,35 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
         float BETA,
         float *C, int ldc);
 
+void gemm_epilogue_cpu(int TA, int TB, int M, int N, int K, float ALPHA, 
+        float *A, int lda, 
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc,
+        const gemm_epilogue *e);
+
+void gemm_conv_cpu(int M, float ALPHA,
+        float *A, int lda,
+        float *im, int channels, int height, int width,
+        int ksize, int stride, int pad,
+        float BETA,
+        float *C, int ldc,
+        const gemm_epilogue *e);
+
+void gemm_cpu_ref(int TA, int TB, int M, int N, int K, float ALPHA, 
+        float *A, int lda, 
+        float *B, int ldb,
+        float BETA,
+        float *C, int ldc);
+
+size_t gemm_packed_size(int K, int N);
+void gemm_prepack_b(int K, int N, float *B, int ldb, float *packed);
+void gemm_packed_cpu(int TA, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *packed,
+        float BETA,
+        float *C, int ldc);
+
 #ifdef GPU
 void gemm_ongpu(int TA, int TB, int M, int N, int K, float ALPHA, 
         float *A_gpu, int lda, 
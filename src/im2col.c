@@ -1,4 +1,5 @@
 #include "im2col.h"
+#include "threadpool.h"
 #include <stdio.h>
 float im2col_get_pixel(float *im, int height, int width, int channels,
                         int row, int col, int channel, int pad)
@@ -11,30 +12,46 @@ float im2col_get_pixel(float *im, int height, int width, int channels,
     return im[col + width*(row + height*channel)];
 }
 
-//From Berkeley Vision's Caffe!
-//https://github.com/BVLC/caffe/blob/master/LICENSE
-void im2col_cpu(float* data_im,
-     int channels,  int height,  int width,
-     int ksize,  int stride, int pad, float* data_col) 
+typedef struct{
+    float *data_im;
+    int channels, height, width;
+    int ksize, stride, pad;
+    float *data_col;
+} im2col_job;
+
+static void im2col_part(void *ptr, int start, int end)
 {
+    im2col_job j = *(im2col_job *)ptr;
     int c,h,w;
-    int height_col = (height + 2*pad - ksize) / stride + 1;
-    int width_col = (width + 2*pad - ksize) / stride + 1;
+    int ksize = j.ksize;
+    int height_col = (j.height + 2*j.pad - ksize) / j.stride + 1;
+    int width_col = (j.width + 2*j.pad - ksize) / j.stride + 1;
 
-    int channels_col = channels * ksize * ksize;
-    for (c = 0; c < channels_col; ++c) {
+    for (c = start; c < end; ++c) {
         int w_offset = c % ksize;
         int h_offset = (c / ksize) % ksize;
         int c_im = c / ksize / ksize;
         for (h = 0; h < height_col; ++h) {
             for (w = 0; w < width_col; ++w) {
-                int im_row = h_offset + h * stride;
-                int im_col = w_offset + w * stride;
+                int im_row = h_offset + h * j.stride;
+                int im_col = w_offset + w * j.stride;
                 int col_index = (c * height_col + h) * width_col + w;
-                data_col[col_index] = im2col_get_pixel(data_im, height, width, channels,
-                        im_row, im_col, c_im, pad);
+                j.data_col[col_index] = im2col_get_pixel(j.data_im, j.height, j.width, j.channels,
+                        im_row, im_col, c_im, j.pad);
             }
         }
     }
 }
 
+//From Berkeley Vision's Caffe!
+//https://github.com/BVLC/caffe/blob/master/LICENSE
+void im2col_cpu(float* data_im,
+     int channels,  int height,  int width,
+     int ksize,  int stride, int pad, float* data_col) 
+{
+    int height_col = (height + 2*pad - ksize) / stride + 1;
+    int width_col = (width + 2*pad - ksize) / stride + 1;
+    int channels_col = channels * ksize * ksize;
+    im2col_job j = {data_im, channels, height, width, ksize, stride, pad, data_col};
+    parallel_for(channels_col, (1<<14)/(height_col*width_col) + 1, im2col_part, &j);
+}
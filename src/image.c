@@ -2,6 +2,8 @@
 #include "utils.h"
 #include "blas.h"
 #include "cuda.h"
+#include "image_cache.h"
+#include "image_u8.h"
 #include <stdio.h>
 #include <math.h>
 
@@ -190,13 +192,19 @@ image **load_alphabet()
     return alphabets;
 }
 
-void draw_detections(image im, int num, float thresh, box *boxes, float **probs, char **names, image **alphabet, int classes)
+void draw_detections(image im, detection *dets, int num, float thresh, char **names, image **alphabet, int classes)
 {
-    int i;
+    int i, j;
 
     for(i = 0; i < num; ++i){
-        int class = max_index(probs[i], classes);
-        float prob = probs[i][class];
+        int class = 0;
+        float prob = 0;
+        for(j = 0; j < dets[i].nscores; ++j){
+            if(dets[i].scores[j].prob > prob){
+                prob = dets[i].scores[j].prob;
+                class = dets[i].scores[j].id;
+            }
+        }
         if(prob > thresh){
 
             int width = im.h * .012;
@@ -219,7 +227,7 @@ void draw_detections(image im, int num, float thresh, box *boxes, float **probs,
             rgb[0] = red;
             rgb[1] = green;
             rgb[2] = blue;
-            box b = boxes[i];
+            box b = dets[i].bbox;
 
             int left  = (b.x-b.w/2.)*im.w;
             int right = (b.x+b.w/2.)*im.w;
@@ -720,6 +728,22 @@ image rotate_crop_image(image im, float rad, float s, int w, int h, float dx, fl
     return rot;
 }
 
+/* The output pixel to source pixel map rotate_crop_image evaluates, as the
+ * 2x3 matrix warp_affine_u8 takes. */
+void rotate_crop_affine(int im_w, int im_h, augment_args a, float *m)
+{
+    float c = cos(a.rad);
+    float s = sin(a.rad);
+    float u = (a.dx - a.w/2.)/a.scale*a.aspect;
+    float v = (a.dy - a.h/2.)/a.scale;
+    m[0] = c*a.aspect/a.scale;
+    m[1] = -s/a.scale;
+    m[2] = c*u - s*v + im_w/2.;
+    m[3] = s*a.aspect/a.scale;
+    m[4] = c/a.scale;
+    m[5] = s*u + c*v + im_h/2.;
+}
+
 image rotate_image(image im, float rad)
 {
     int x, y, c;
@@ -855,9 +879,7 @@ void letterbox_image_into(image im, int w, int h, image boxed)
         new_h = h;
         new_w = (im.w * h)/im.h;
     }
-    image resized = resize_image(im, new_w, new_h);
-    embed_image(resized, boxed, (w-new_w)/2, (h-new_h)/2); 
-    free_image(resized);
+    resize_image_into(im, boxed, (w-new_w)/2, (h-new_h)/2, new_w, new_h);
 }
 
 image letterbox_image(image im, int w, int h)
@@ -871,13 +893,11 @@ image letterbox_image(image im, int w, int h)
         new_h = h;
         new_w = (im.w * h)/im.h;
     }
-    image resized = resize_image(im, new_w, new_h);
     image boxed = make_image(w, h, im.c);
     fill_image(boxed, .5);
     //int i;
     //for(i = 0; i < boxed.w*boxed.h*boxed.c; ++i) boxed.data[i] = 0;
-    embed_image(resized, boxed, (w-new_w)/2, (h-new_h)/2); 
-    free_image(resized);
+    resize_image_into(im, boxed, (w-new_w)/2, (h-new_h)/2, new_w, new_h);
     return boxed;
 }
 
@@ -1215,19 +1235,61 @@ void exposure_image(image im, float sat)
     constrain_image(im);
 }
 
-void distort_image(image im, float hue, float sat, float val)
+/*
+ * Hue shift, saturation and exposure scaling of n pixels given as separate r,
+ * g and b arrays, in place and in one pass with no HSV buffer. Same math as
+ * rgb_to_hsv, the scaling and hsv_to_rgb, but every branch is written as a
+ * select and the sector lookup of hsv_to_rgb as the closed form
+ * v - v*s*clamp(min(k, 4-k), 0, 1), k = (n + 6h) mod 6, so the loop
+ * vectorizes. Results are clamped to [0, 1] like constrain_image.
+ */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define DISTORT_CLONES __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define DISTORT_CLONES
+#endif
+
+static inline float hsv_channel(float n, float h6, float s, float v)
+{
+    float k = n + h6;
+    k = (k >= 6) ? k - 6 : k;
+    float m = (k < 4 - k) ? k : 4 - k;
+    m = (m < 0) ? 0 : ((m > 1) ? 1 : m);
+    float c = v - v*s*m;
+    return (c < 0) ? 0 : ((c > 1) ? 1 : c);
+}
+
+DISTORT_CLONES void distort_rgb(float *r, float *g, float *b, int n, float hue, float sat, float val)
 {
-    rgb_to_hsv(im);
-    scale_image_channel(im, 1, sat);
-    scale_image_channel(im, 2, val);
     int i;
-    for(i = 0; i < im.w*im.h; ++i){
-        im.data[i] = im.data[i] + hue;
-        if (im.data[i] > 1) im.data[i] -= 1;
-        if (im.data[i] < 0) im.data[i] += 1;
+    for(i = 0; i < n; ++i){
+        float R = r[i];
+        float G = g[i];
+        float B = b[i];
+        float max = (R > G) ? ((R > B) ? R : B) : ((G > B) ? G : B);
+        float min = (R < G) ? ((R < B) ? R : B) : ((G < B) ? G : B);
+        float delta = max - min;
+        float inv = (delta > 0) ? 1.f/delta : 0;
+        float h = (R == max) ? (G - B)*inv : ((G == max) ? 2 + (B - R)*inv : 4 + (R - G)*inv);
+        h = (h < 0) ? h + 6 : h;
+        float s = (max > 0) ? delta/max : 0;
+        float v = max*val;
+        s *= sat;
+        h = h*(1.f/6) + hue;
+        h = (h > 1) ? h - 1 : h;
+        h = (h < 0) ? h + 1 : h;
+        float h6 = 6*h;
+        r[i] = hsv_channel(5, h6, s, v);
+        g[i] = hsv_channel(3, h6, s, v);
+        b[i] = hsv_channel(1, h6, s, v);
     }
-    hsv_to_rgb(im);
-    constrain_image(im);
+}
+
+void distort_image(image im, float hue, float sat, float val)
+{
+    assert(im.c == 3);
+    int size = im.w*im.h;
+    distort_rgb(im.data, im.data + size, im.data + 2*size, size, hue, sat, val);
 }
 
 void random_distort_image(image im, float hue, float saturation, float exposure)
@@ -1262,13 +1324,143 @@ float bilinear_interpolate(image im, float x, float y, int c)
     return val;
 }
 
+/*
+ * Separable bilinear resize. The source columns/rows and weights of every
+ * output column/row depend only on the sizes, so they are computed once into
+ * a plan; each thread keeps its last few plans, which covers the loaders and
+ * the demo, where the same size pairs come back every frame. The horizontal
+ * pass makes two source rows at a time, the vertical pass blends them
+ * straight into the destination. Samples the same positions with the same
+ * weights as the old per-pixel code, including the last output row which
+ * only takes (1-dy) of its upper source row. No FMA clone: contracting the
+ * blends would change results in the last bit.
+ */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define RESIZE_CLONES __attribute__((target_clones("avx2","default")))
+#else
+#define RESIZE_CLONES
+#endif
+
+#define RESIZE_PLANS 4
+
+static __thread resize_plan resize_plans[RESIZE_PLANS];
+static __thread int resize_plan_next = 0;
+static __thread float *resize_rows = 0;
+static __thread int resize_rows_size = 0;
+
+static void fill_resize_axis(int src, int dst, int *i0, int *i1, float *w0, float *w1, int last_weighted)
+{
+    int i;
+    float scale = dst > 1 ? (float)(src - 1) / (dst - 1) : 0;
+    for(i = 0; i < dst; ++i){
+        if(src == 1 || (i == dst-1 && !last_weighted)){
+            i0[i] = i1[i] = src - 1;
+            w0[i] = 1;
+            w1[i] = 0;
+            continue;
+        }
+        float s = i*scale;
+        int is = (int)s;
+        float d = s - is;
+        i0[i] = is;
+        i1[i] = (i == dst-1 || is + 1 >= src) ? is : is + 1;
+        w0[i] = 1 - d;
+        w1[i] = (i == dst-1) ? 0 : d;
+    }
+}
+
+const resize_plan *get_resize_plan(int src_w, int src_h, int w, int h)
+{
+    int i;
+    for(i = 0; i < RESIZE_PLANS; ++i){
+        resize_plan *p = resize_plans + i;
+        if(p->src_w == src_w && p->src_h == src_h && p->w == w && p->h == h) return p;
+    }
+    resize_plan *p = resize_plans + resize_plan_next;
+    resize_plan_next = (resize_plan_next + 1) % RESIZE_PLANS;
+    p->src_w = src_w;
+    p->src_h = src_h;
+    p->w = w;
+    p->h = h;
+    p->x0 = realloc(p->x0, 2*w*sizeof(int));
+    p->x1 = p->x0 + w;
+    p->xw0 = realloc(p->xw0, 2*w*sizeof(float));
+    p->xw1 = p->xw0 + w;
+    p->y0 = realloc(p->y0, 2*h*sizeof(int));
+    p->y1 = p->y0 + h;
+    p->yw0 = realloc(p->yw0, 2*h*sizeof(float));
+    p->yw1 = p->yw0 + h;
+    fill_resize_axis(src_w, w, p->x0, p->x1, p->xw0, p->xw1, 0);
+    fill_resize_axis(src_h, h, p->y0, p->y1, p->yw0, p->yw1, 1);
+    return p;
+}
+
+RESIZE_CLONES static void resize_pass_h(const float *src, float *dst, const int *x0, const int *x1, const float *w0, const float *w1, int w)
+{
+    int x;
+    for(x = 0; x < w; ++x){
+        dst[x] = w0[x]*src[x0[x]] + w1[x]*src[x1[x]];
+    }
+}
+
+RESIZE_CLONES static void resize_pass_v(const float *a, const float *b, float wa, float wb, float *dst, int n)
+{
+    int x;
+    for(x = 0; x < n; ++x){
+        dst[x] = wa*a[x] + wb*b[x];
+    }
+}
+
+static float *resize_source_row(image im, int k, int y, const resize_plan *p, float **rows, int *cached, int keep)
+{
+    if(cached[0] == y) return rows[0];
+    if(cached[1] == y) return rows[1];
+    int slot = (cached[0] == keep) ? 1 : 0;
+    resize_pass_h(im.data + (k*im.h + y)*im.w, rows[slot], p->x0, p->x1, p->xw0, p->xw1, p->w);
+    cached[slot] = y;
+    return rows[slot];
+}
+
+void resize_image_into(image im, image dst, int dx, int dy, int w, int h)
+{
+    int k, r;
+    const resize_plan *p = get_resize_plan(im.w, im.h, w, h);
+    int xs = dx < 0 ? -dx : 0;
+    int xe = (dst.w - dx < w) ? dst.w - dx : w;
+    if(xe <= xs) return;
+    if(resize_rows_size < 2*w){
+        resize_rows_size = 2*w;
+        resize_rows = realloc(resize_rows, resize_rows_size*sizeof(float));
+    }
+    float *rows[2] = {resize_rows, resize_rows + w};
+    for(k = 0; k < im.c && k < dst.c; ++k){
+        int cached[2] = {-1, -1};
+        for(r = 0; r < h; ++r){
+            if(r + dy < 0 || r + dy >= dst.h) continue;
+            float *a = resize_source_row(im, k, p->y0[r], p, rows, cached, p->y1[r]);
+            float *b = resize_source_row(im, k, p->y1[r], p, rows, cached, p->y0[r]);
+            float *out = dst.data + (k*dst.h + r + dy)*dst.w + dx;
+            resize_pass_v(a + xs, b + xs, p->yw0[r], p->yw1[r], out + xs, xe - xs);
+        }
+    }
+}
+
 image resize_image(image im, int w, int h)
+{
+    image resized = make_image(w, h, im.c);
+    resize_image_into(im, resized, 0, 0, w, h);
+    return resized;
+}
+
+/* The per-pixel resize the plans replaced, kept to check them against. Only
+ * change: a destination side of 1 gets scale 0 instead of dividing by zero. */
+static image resize_image_reference(image im, int w, int h)
 {
     image resized = make_image(w, h, im.c);   
     image part = make_image(w, im.h, im.c);
     int r, c, k;
-    float w_scale = (float)(im.w - 1) / (w - 1);
-    float h_scale = (float)(im.h - 1) / (h - 1);
+    float w_scale = (w > 1) ? (float)(im.w - 1) / (w - 1) : 0;
+    float h_scale = (h > 1) ? (float)(im.h - 1) / (h - 1) : 0;
     for(k = 0; k < im.c; ++k){
         for(r = 0; r < im.h; ++r){
             for(c = 0; c < w; ++c){
@@ -1306,6 +1498,63 @@ image resize_image(image im, int w, int h)
     return resized;
 }
 
+/* Resizes im to w x h at (dx, dy) in a dst_w x dst_h canvas, through the
+ * plans and through the reference, and counts the pixels that differ. */
+static int test_resize_case(image im, int w, int h, int dst_w, int dst_h, int dx, int dy)
+{
+    int i;
+    image out = make_image(dst_w, dst_h, im.c);
+    image ref = make_image(dst_w, dst_h, im.c);
+    fill_image(out, -1);
+    fill_image(ref, -1);
+    resize_image_into(im, out, dx, dy, w, h);
+    image resized = resize_image_reference(im, w, h);
+    embed_image(resized, ref, dx, dy);
+    int diff = 0;
+    for(i = 0; i < out.w*out.h*out.c; ++i){
+        if(memcmp(out.data + i, ref.data + i, sizeof(float))) ++diff;
+    }
+    if(diff){
+        printf("resize %dx%d -> %dx%d at %d,%d in %dx%d: %d pixels differ FAILED\n",
+                im.w, im.h, w, h, dx, dy, dst_w, dst_h, diff);
+    }
+    free_image(resized);
+    free_image(out);
+    free_image(ref);
+    return diff != 0;
+}
+
+void test_resize_plans()
+{
+    int sizes[] = {1, 2, 3, 4, 5, 7, 13, 16, 33, 100, 416, 500};
+    int n = sizeof(sizes)/sizeof(sizes[0]);
+    int a, b, c, d, i;
+    int cases = 0, failed = 0;
+    srand(0);
+    for(a = 0; a < n; ++a){
+        for(b = 0; b < n; ++b){
+            int src_w = sizes[a];
+            int src_h = sizes[(a + b) % n];
+            image im = make_image(src_w, src_h, 3);
+            for(i = 0; i < im.w*im.h*im.c; ++i) im.data[i] = rand_uniform(0, 1);
+            for(c = 0; c < n; ++c){
+                for(d = 0; d < n; d += 5){
+                    int w = sizes[c];
+                    int h = sizes[(c + d) % n];
+                    failed += test_resize_case(im, w, h, w, h, 0, 0);
+                    /* Letterbox offsets, and placements clipped on every side. */
+                    failed += test_resize_case(im, w, h, w + 3, h + 2, 1, 1);
+                    failed += test_resize_case(im, w, h, w, h, -w/2 - 1, -h/3);
+                    failed += test_resize_case(im, w, h, w/2 + 1, h/2 + 1, w/4, h/4);
+                    cases += 4;
+                }
+            }
+            free_image(im);
+        }
+    }
+    printf("resize: %d cases, %d failed\n", cases, failed);
+}
+
 
 void test_resize(char *filename)
 {
@@ -1357,27 +1606,25 @@ void test_resize(char *filename)
 }
 
 
-image load_image_stb(char *filename, int channels)
+image_u8 load_image_u8(char *filename, int channels)
 {
-    int w, h, c;
-    unsigned char *data = stbi_load(filename, &w, &h, &c, channels);
-    if (!data) {
+    image_u8 im;
+    if(image_cache_lookup(filename, channels, &im)) return im;
+    im.data = stbi_load(filename, &im.w, &im.h, &im.c, channels);
+    if (!im.data) {
         fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n", filename, stbi_failure_reason());
         exit(0);
     }
-    if(channels) c = channels;
-    int i,j,k;
-    image im = make_image(w, h, c);
-    for(k = 0; k < c; ++k){
-        for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-                int dst_index = i + w*j + w*h*k;
-                int src_index = k + c*i + c*w*j;
-                im.data[dst_index] = (float)data[src_index]/255.;
-            }
-        }
-    }
-    free(data);
+    if(channels) im.c = channels;
+    image_cache_insert(filename, channels, im);
+    return im;
+}
+
+image load_image_stb(char *filename, int channels)
+{
+    image_u8 bytes = load_image_u8(filename, channels);
+    image im = image_u8_to_image(bytes);
+    free_image_u8(bytes);
     return im;
 }
 
@@ -20,6 +20,18 @@ void show_image_cv(image p, const char *name, IplImage *disp);
 #endif
 #endif
 
+/* Source indices and weights of a w x h bilinear resize of a src_w x src_h
+ * image; out = w0*in[i0] + w1*in[i1] along each axis. */
+typedef struct{
+    int src_w, src_h, w, h;
+    int *x0, *x1;
+    float *xw0, *xw1;
+    int *y0, *y1;
+    float *yw0, *yw1;
+} resize_plan;
+
+const resize_plan *get_resize_plan(int src_w, int src_h, int w, int h);
+
 image mask_to_rgb(image mask);
 float get_color(int c, int x, int max);
 void flip_image(image a);
@@ -28,11 +40,12 @@ void draw_box_width(image a, int x1, int y1, int x2, int y2, int w, float r, flo
 void draw_bbox(image a, box bbox, int w, float r, float g, float b);
 void draw_label(image a, int r, int c, image label, const float *rgb);
 void write_label(image a, int r, int c, image *characters, char *string, float *rgb);
-void draw_detections(image im, int num, float thresh, box *boxes, float **probs, char **names, image **labels, int classes);
+void draw_detections(image im, detection *dets, int num, float thresh, char **names, image **labels, int classes);
 image image_distance(image a, image b);
 void scale_image(image m, float s);
 image crop_image(image im, int dx, int dy, int w, int h);
 image rotate_crop_image(image im, float rad, float s, int w, int h, float dx, float dy, float aspect);
+void rotate_crop_affine(int im_w, int im_h, augment_args a, float *m);
 image center_crop_image(image im, int w, int h);
 image random_crop_image(image im, int w, int h);
 image random_augment_image(image im, float angle, float aspect, int low, int high, int w, int h);
@@ -41,6 +54,7 @@ void random_distort_image(image im, float hue, float saturation, float exposure)
 image letterbox_image(image im, int w, int h);
 void letterbox_image_into(image im, int w, int h, image boxed);
 image resize_image(image im, int w, int h);
+void resize_image_into(image im, image dst, int dx, int dy, int w, int h);
 image resize_min(image im, int min);
 image resize_max(image im, int max);
 void fill_image(image m, float s);
@@ -54,6 +68,7 @@ void place_image(image im, int w, int h, int dx, int dy, image canvas);
 void saturate_image(image im, float sat);
 void exposure_image(image im, float sat);
 void distort_image(image im, float hue, float sat, float val);
+void distort_rgb(float *r, float *g, float *b, int n, float hue, float sat, float val);
 void saturate_exposure_image(image im, float sat, float exposure);
 void rgb_to_hsv(image im);
 void hsv_to_rgb(image im);
@@ -102,5 +117,6 @@ image get_image_layer(image m, int l);
 
 void free_image(image m);
 void test_resize(char *filename);
+void test_resize_plans();
 #endif
 
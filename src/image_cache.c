@@ -0,0 +1,172 @@
+#include "image_cache.h"
+#include "image_u8.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Bounded LRU cache of decoded images, keyed by path and requested channel
+ * count. Entries keep the 8-bit interleaved pixels stb decoded and a hit hands
+ * back a copy of them, skipping the file read and decode. The cache is split
+ * into shards, each with its own lock and its own share of the budget, so
+ * loader threads rarely wait on each other. Off until a size is set, e.g. by
+ * `image_cache = <MB>` in a .data file.
+ */
+
+#define CACHE_SHARDS 16
+
+typedef struct cache_entry{
+    char *path;
+    int channels;
+    int w, h, c;
+    unsigned char *data;
+    uint32_t hash;
+    struct cache_entry *chain;
+    struct cache_entry *prev, *next;
+} cache_entry;
+
+typedef struct{
+    pthread_mutex_t lock;
+    cache_entry **buckets;
+    int nbuckets;
+    int count;
+    size_t bytes;
+    cache_entry *head, *tail;
+} cache_shard;
+
+static cache_shard shards[CACHE_SHARDS];
+static size_t shard_budget = 0;
+
+void set_image_cache_size(int mb)
+{
+    int i;
+    if(mb <= 0 || shard_budget) return;
+    for(i = 0; i < CACHE_SHARDS; ++i){
+        pthread_mutex_init(&shards[i].lock, 0);
+    }
+    shard_budget = ((size_t)mb << 20) / CACHE_SHARDS;
+    fprintf(stderr, "Image cache: %d MB\n", mb);
+}
+
+static uint32_t cache_hash(const char *s, int channels)
+{
+    uint32_t h = 2166136261u ^ channels;
+    while(*s){
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static cache_shard *shard_for(uint32_t hash)
+{
+    return shards + (hash >> 28) % CACHE_SHARDS;
+}
+
+static cache_entry **find_slot(cache_shard *s, char *path, int channels, uint32_t hash)
+{
+    cache_entry **e = s->buckets + (hash & (s->nbuckets - 1));
+    while(*e && ((*e)->hash != hash || (*e)->channels != channels || strcmp((*e)->path, path))){
+        e = &(*e)->chain;
+    }
+    return e;
+}
+
+static void unlink_lru(cache_shard *s, cache_entry *e)
+{
+    if(e->prev) e->prev->next = e->next;
+    else s->head = e->next;
+    if(e->next) e->next->prev = e->prev;
+    else s->tail = e->prev;
+    e->prev = e->next = 0;
+}
+
+static void push_lru(cache_shard *s, cache_entry *e)
+{
+    e->prev = 0;
+    e->next = s->head;
+    if(s->head) s->head->prev = e;
+    s->head = e;
+    if(!s->tail) s->tail = e;
+}
+
+static void grow_buckets(cache_shard *s)
+{
+    int i;
+    int n = s->nbuckets ? 2*s->nbuckets : 256;
+    cache_entry **buckets = calloc(n, sizeof(cache_entry *));
+    for(i = 0; i < s->nbuckets; ++i){
+        cache_entry *e = s->buckets[i];
+        while(e){
+            cache_entry *next = e->chain;
+            e->chain = buckets[e->hash & (n - 1)];
+            buckets[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    free(s->buckets);
+    s->buckets = buckets;
+    s->nbuckets = n;
+}
+
+static void evict(cache_shard *s, cache_entry *e)
+{
+    unlink_lru(s, e);
+    *find_slot(s, e->path, e->channels, e->hash) = e->chain;
+    s->bytes -= (size_t)e->w*e->h*e->c;
+    --s->count;
+    free(e->path);
+    free(e->data);
+    free(e);
+}
+
+int image_cache_lookup(char *path, int channels, image_u8 *im)
+{
+    if(!shard_budget) return 0;
+    uint32_t hash = cache_hash(path, channels);
+    cache_shard *s = shard_for(hash);
+    pthread_mutex_lock(&s->lock);
+    cache_entry *e = s->nbuckets ? *find_slot(s, path, channels, hash) : 0;
+    if(e){
+        unlink_lru(s, e);
+        push_lru(s, e);
+        image_u8 cached = {e->w, e->h, e->c, e->data};
+        *im = copy_image_u8(cached);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return e != 0;
+}
+
+/* Keeps a copy of im, evicting least recently used entries to make room. */
+void image_cache_insert(char *path, int channels, image_u8 im)
+{
+    size_t bytes = (size_t)im.w*im.h*im.c;
+    if(!shard_budget || bytes > shard_budget) return;
+    uint32_t hash = cache_hash(path, channels);
+    cache_shard *s = shard_for(hash);
+    pthread_mutex_lock(&s->lock);
+    if(s->count >= s->nbuckets) grow_buckets(s);
+    cache_entry **slot = find_slot(s, path, channels, hash);
+    if(*slot){
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    cache_entry *e = calloc(1, sizeof(cache_entry));
+    e->path = copy_string(path);
+    e->channels = channels;
+    e->w = im.w;
+    e->h = im.h;
+    e->c = im.c;
+    e->data = copy_image_u8(im).data;
+    e->hash = hash;
+    *slot = e;
+    push_lru(s, e);
+    s->bytes += bytes;
+    ++s->count;
+    while(s->bytes > shard_budget) evict(s, s->tail);
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,9 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+#include "darknet.h"
+
+void set_image_cache_size(int mb);
+int image_cache_lookup(char *path, int channels, image_u8 *im);
+void image_cache_insert(char *path, int channels, image_u8 im);
+
+#endif
@@ -0,0 +1,292 @@
+#include "image_u8.h"
+#include "image.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+/*
+ * Augmentation on 8-bit interleaved images. Training samples stay as decoded
+ * bytes through crop, resize, flip and color distortion, a quarter of the
+ * memory traffic of float CHW images, and become float once, in
+ * image_u8_to_float, which normalizes and transposes in one pass.
+ */
+
+static inline unsigned char to_u8(float v)
+{
+    v = v*255 + .5f;
+    if(v < 0) v = 0;
+    if(v > 255) v = 255;
+    return (unsigned char)v;
+}
+
+image_u8 make_image_u8(int w, int h, int c)
+{
+    image_u8 im;
+    im.w = w;
+    im.h = h;
+    im.c = c;
+    im.data = calloc((size_t)w*h*c, 1);
+    return im;
+}
+
+image_u8 copy_image_u8(image_u8 im)
+{
+    image_u8 copy = im;
+    size_t size = (size_t)im.w*im.h*im.c;
+    copy.data = malloc(size);
+    memcpy(copy.data, im.data, size);
+    return copy;
+}
+
+void free_image_u8(image_u8 im)
+{
+    free(im.data);
+}
+
+image_u8 crop_image_u8(image_u8 im, int dx, int dy, int w, int h)
+{
+    image_u8 cropped = make_image_u8(w, h, im.c);
+    int i, j;
+    for(j = 0; j < h; ++j){
+        int r = constrain_int(j + dy, 0, im.h-1);
+        unsigned char *src = im.data + (size_t)r*im.w*im.c;
+        unsigned char *dst = cropped.data + (size_t)j*w*im.c;
+        int lo = constrain_int(-dx, 0, w);
+        int hi = constrain_int(im.w - dx, lo, w);
+        for(i = 0; i < lo; ++i) memcpy(dst + i*im.c, src, im.c);
+        memcpy(dst + lo*im.c, src + (lo + dx)*im.c, (hi - lo)*im.c);
+        for(i = hi; i < w; ++i) memcpy(dst + i*im.c, src + (im.w-1)*im.c, im.c);
+    }
+    return cropped;
+}
+
+static void resize_row_u8(image_u8 im, int y, const resize_plan *p, float *row)
+{
+    int x, k;
+    const unsigned char *src = im.data + (size_t)y*im.w*im.c;
+    for(x = 0; x < p->w; ++x){
+        const unsigned char *a = src + p->x0[x]*im.c;
+        const unsigned char *b = src + p->x1[x]*im.c;
+        for(k = 0; k < im.c; ++k){
+            row[x*im.c + k] = (p->xw0[x]*a[k] + p->xw1[x]*b[k]) * (1.f/255);
+        }
+    }
+}
+
+static float *resized_row_u8(image_u8 im, int y, const resize_plan *p, float **rows, int *cached, int keep)
+{
+    if(cached[0] == y) return rows[0];
+    if(cached[1] == y) return rows[1];
+    int slot = (cached[0] == keep) ? 1 : 0;
+    resize_row_u8(im, y, p, rows[slot]);
+    cached[slot] = y;
+    return rows[slot];
+}
+
+/* Bilinear with the same resize_plan as resize_image. Only two horizontally
+ * resized source rows are kept at a time. */
+image_u8 resize_image_u8(image_u8 im, int w, int h)
+{
+    image_u8 resized = make_image_u8(w, h, im.c);
+    const resize_plan *p = get_resize_plan(im.w, im.h, w, h);
+    int x, y;
+    int n = w*im.c;
+    float *rows[2];
+    int cached[2] = {-1, -1};
+    rows[0] = calloc(2*n, sizeof(float));
+    rows[1] = rows[0] + n;
+    for(y = 0; y < h; ++y){
+        float *ra = resized_row_u8(im, p->y0[y], p, rows, cached, p->y1[y]);
+        float *rb = resized_row_u8(im, p->y1[y], p, rows, cached, p->y0[y]);
+        float wa = p->yw0[y];
+        float wb = p->yw1[y];
+        unsigned char *dst = resized.data + (size_t)y*n;
+        for(x = 0; x < n; ++x){
+            dst[x] = to_u8(wa*ra[x] + wb*rb[x]);
+        }
+    }
+    free(rows[0]);
+    return resized;
+}
+
+/* Inverse of the 2x3 affine map m. */
+void invert_affine(const float *m, float *inv)
+{
+    float det = m[0]*m[4] - m[1]*m[3];
+    inv[0] =  m[4]/det;
+    inv[1] = -m[1]/det;
+    inv[3] = -m[3]/det;
+    inv[4] =  m[0]/det;
+    inv[2] = -(inv[0]*m[2] + inv[1]*m[5]);
+    inv[5] = -(inv[3]*m[2] + inv[4]*m[5]);
+}
+
+/* Turns fwd, which takes normalized source coordinates to normalized output
+ * coordinates the way boxes are transformed, into the output pixel to source
+ * pixel map warp_affine_u8 samples with. Pixels are sampled at their centers. */
+void affine_pixel_map(const float *fwd, int src_w, int src_h, int dst_w, int dst_h, float *m)
+{
+    float g[6];
+    invert_affine(fwd, g);
+    m[0] = g[0]*src_w/dst_w;
+    m[1] = g[1]*src_w/dst_h;
+    m[2] = (g[0]*.5f/dst_w + g[1]*.5f/dst_h + g[2])*src_w - .5f;
+    m[3] = g[3]*src_h/dst_w;
+    m[4] = g[4]*src_h/dst_h;
+    m[5] = (g[3]*.5f/dst_w + g[4]*.5f/dst_h + g[5])*src_h - .5f;
+}
+
+static inline const unsigned char *warp_tap(image_u8 im, int x, int y, const unsigned char *fill)
+{
+    if(!fill){
+        x = constrain_int(x, 0, im.w-1);
+        y = constrain_int(y, 0, im.h-1);
+    } else if(x < 0 || y < 0 || x >= im.w || y >= im.h){
+        return fill;
+    }
+    return im.data + ((size_t)y*im.w + x)*im.c;
+}
+
+/* Bilinear resampling of src into dst through m, which takes output pixel
+ * (x, y) to source point (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5]), so
+ * a crop, scale, rotation and flip cost one pass. All channels of a pixel are
+ * blended from the same four taps, with 8-bit fixed point weights. Points
+ * outside src repeat the nearest edge pixel when border < 0 and take the value
+ * border otherwise. */
+void warp_affine_u8(image_u8 src, image_u8 dst, const float *m, int border)
+{
+    assert(src.c == dst.c);
+    int x, y, k;
+    int c = src.c;
+    size_t stride = (size_t)src.w*c;
+    float xmax = src.w + 1;
+    float ymax = src.h + 1;
+    unsigned char fill[16];
+    const unsigned char *pad = 0;
+    if(border >= 0){
+        assert(c <= 16);
+        memset(fill, border, c);
+        pad = fill;
+    }
+    for(y = 0; y < dst.h; ++y){
+        float bx = m[1]*y + m[2];
+        float by = m[4]*y + m[5];
+        unsigned char *out = dst.data + (size_t)y*dst.w*c;
+        for(x = 0; x < dst.w; ++x, out += c){
+            float fx = m[0]*x + bx;
+            float fy = m[3]*x + by;
+            /* Clamped far enough out that every tap still lands outside. */
+            fx = (fx < -2) ? -2 : (fx > xmax) ? xmax : fx;
+            fy = (fy < -2) ? -2 : (fy > ymax) ? ymax : fy;
+            int sx = (int)(fx*65536);
+            int sy = (int)(fy*65536);
+            int ix = sx >> 16;
+            int iy = sy >> 16;
+            int ax = (sx >> 8) & 255;
+            int ay = (sy >> 8) & 255;
+            int w00 = (256-ax)*(256-ay);
+            int w01 = ax*(256-ay);
+            int w10 = (256-ax)*ay;
+            int w11 = ax*ay;
+            const unsigned char *a, *b, *p, *q;
+            if(ix >= 0 && iy >= 0 && ix < src.w-1 && iy < src.h-1){
+                a = src.data + iy*stride + ix*c;
+                b = a + c;
+                p = a + stride;
+                q = p + c;
+            } else {
+                if(pad && (ix < -1 || iy < -1 || ix >= src.w || iy >= src.h)){
+                    memcpy(out, pad, c);
+                    continue;
+                }
+                a = warp_tap(src, ix, iy, pad);
+                b = warp_tap(src, ix+1, iy, pad);
+                p = warp_tap(src, ix, iy+1, pad);
+                q = warp_tap(src, ix+1, iy+1, pad);
+            }
+            if(c == 3){
+                out[0] = (w00*a[0] + w01*b[0] + w10*p[0] + w11*q[0] + 32768) >> 16;
+                out[1] = (w00*a[1] + w01*b[1] + w10*p[1] + w11*q[1] + 32768) >> 16;
+                out[2] = (w00*a[2] + w01*b[2] + w10*p[2] + w11*q[2] + 32768) >> 16;
+            } else {
+                for(k = 0; k < c; ++k){
+                    out[k] = (w00*a[k] + w01*b[k] + w10*p[k] + w11*q[k] + 32768) >> 16;
+                }
+            }
+        }
+    }
+}
+
+void flip_image_u8(image_u8 im)
+{
+    int i, j, k;
+    for(j = 0; j < im.h; ++j){
+        unsigned char *row = im.data + (size_t)j*im.w*im.c;
+        for(i = 0; i < im.w/2; ++i){
+            unsigned char *a = row + i*im.c;
+            unsigned char *b = row + (im.w - i - 1)*im.c;
+            for(k = 0; k < im.c; ++k){
+                unsigned char swap = a[k];
+                a[k] = b[k];
+                b[k] = swap;
+            }
+        }
+    }
+}
+
+/* distort_image on blocks of pixels unpacked to float planes on the stack. */
+void distort_image_u8(image_u8 im, float hue, float sat, float val)
+{
+    assert(im.c == 3);
+    float r[256], g[256], b[256];
+    int i, j;
+    int size = im.w*im.h;
+    for(i = 0; i < size; i += 256){
+        int n = (size - i < 256) ? size - i : 256;
+        unsigned char *p = im.data + 3*i;
+        for(j = 0; j < n; ++j){
+            r[j] = p[3*j+0]*(1.f/255);
+            g[j] = p[3*j+1]*(1.f/255);
+            b[j] = p[3*j+2]*(1.f/255);
+        }
+        distort_rgb(r, g, b, n, hue, sat, val);
+        for(j = 0; j < n; ++j){
+            p[3*j+0] = (unsigned char)(r[j]*255 + .5f);
+            p[3*j+1] = (unsigned char)(g[j]*255 + .5f);
+            p[3*j+2] = (unsigned char)(b[j]*255 + .5f);
+        }
+    }
+}
+
+void random_distort_image_u8(image_u8 im, float hue, float saturation, float exposure)
+{
+    float dhue = rand_uniform(-hue, hue);
+    float dsat = rand_scale(saturation);
+    float dexp = rand_scale(exposure);
+    distort_image_u8(im, dhue, dsat, dexp);
+}
+
+/* Normalizes to [0,1] and transposes HWC to the CHW layout of image. */
+void image_u8_to_float(image_u8 im, float *dst)
+{
+    int i, k;
+    int size = im.w*im.h;
+    for(k = 0; k < im.c; ++k){
+        float *out = dst + k*size;
+        const unsigned char *src = im.data + k;
+        for(i = 0; i < size; ++i){
+            out[i] = (float)src[i*im.c]/255.;
+        }
+    }
+}
+
+image image_u8_to_image(image_u8 im)
+{
+    image out = make_image(im.w, im.h, im.c);
+    image_u8_to_float(im, out.data);
+    return out;
+}
@@ -0,0 +1,22 @@
+#ifndef IMAGE_U8_H
+#define IMAGE_U8_H
+#include "darknet.h"
+
+image_u8 make_image_u8(int w, int h, int c);
+image_u8 copy_image_u8(image_u8 im);
+void free_image_u8(image_u8 im);
+image_u8 load_image_u8(char *filename, int channels);
+
+image_u8 crop_image_u8(image_u8 im, int dx, int dy, int w, int h);
+image_u8 resize_image_u8(image_u8 im, int w, int h);
+void flip_image_u8(image_u8 im);
+void invert_affine(const float *m, float *inv);
+void affine_pixel_map(const float *fwd, int src_w, int src_h, int dst_w, int dst_h, float *m);
+void warp_affine_u8(image_u8 src, image_u8 dst, const float *m, int border);
+void distort_image_u8(image_u8 im, float hue, float sat, float val);
+void random_distort_image_u8(image_u8 im, float hue, float saturation, float exposure);
+
+void image_u8_to_float(image_u8 im, float *dst);
+image image_u8_to_image(image_u8 im);
+
+#endif
@@ -1,5 +1,6 @@
 #include "layer.h"
 #include "cuda.h"
+#include "winograd.h"
 
 #include <stdlib.h>
 
@@ -32,6 +33,7 @@ void free_layer(layer l)
     if(l.scales)             free(l.scales);
     if(l.scale_updates)      free(l.scale_updates);
     if(l.weights)            free(l.weights);
+    if(l.winograd_weights)   free_winograd_weights(l.winograd_weights);
     if(l.weight_updates)     free(l.weight_updates);
     if(l.delta)              free(l.delta);
     if(l.output)             free(l.output);
@@ -44,6 +46,7 @@ void free_layer(layer l)
     if(l.variance_delta)     free(l.variance_delta);
     if(l.rolling_mean)       free(l.rolling_mean);
     if(l.rolling_variance)   free(l.rolling_variance);
+    if(l.bn_affine)          free(l.bn_affine);
     if(l.x)                  free(l.x);
     if(l.x_norm)             free(l.x_norm);
     if(l.m)                  free(l.m);
@@ -1,5 +1,6 @@
 #include "maxpool_layer.h"
 #include "cuda.h"
+#include "threadpool.h"
 #include <stdio.h>
 
 image get_maxpool_image(maxpool_layer l)
@@ -76,43 +77,54 @@ void resize_maxpool_layer(maxpool_layer *l, int w, int h)
     #endif
 }
 
-void forward_maxpool_layer(const maxpool_layer l, network net)
+typedef struct{
+    maxpool_layer l;
+    float *input;
+} maxpool_job;
+
+/* Pools the output planes [start, end), one plane per batch item and channel. */
+static void forward_maxpool_part(void *ptr, int start, int end)
 {
-    int b,i,j,k,m,n;
+    maxpool_layer l = ((maxpool_job *)ptr)->l;
+    float *input = ((maxpool_job *)ptr)->input;
+    int p,i,j,m,n;
     int w_offset = -l.pad;
     int h_offset = -l.pad;
 
     int h = l.out_h;
     int w = l.out_w;
-    int c = l.c;
 
-    for(b = 0; b < l.batch; ++b){
-        for(k = 0; k < c; ++k){
-            for(i = 0; i < h; ++i){
-                for(j = 0; j < w; ++j){
-                    int out_index = j + w*(i + h*(k + c*b));
-                    float max = -FLT_MAX;
-                    int max_i = -1;
-                    for(n = 0; n < l.size; ++n){
-                        for(m = 0; m < l.size; ++m){
-                            int cur_h = h_offset + i*l.stride + n;
-                            int cur_w = w_offset + j*l.stride + m;
-                            int index = cur_w + l.w*(cur_h + l.h*(k + b*l.c));
-                            int valid = (cur_h >= 0 && cur_h < l.h &&
-                                         cur_w >= 0 && cur_w < l.w);
-                            float val = (valid != 0) ? net.input[index] : -FLT_MAX;
-                            max_i = (val > max) ? index : max_i;
-                            max   = (val > max) ? val   : max;
-                        }
+    for(p = start; p < end; ++p){
+        for(i = 0; i < h; ++i){
+            for(j = 0; j < w; ++j){
+                int out_index = j + w*(i + h*p);
+                float max = -FLT_MAX;
+                int max_i = -1;
+                for(n = 0; n < l.size; ++n){
+                    for(m = 0; m < l.size; ++m){
+                        int cur_h = h_offset + i*l.stride + n;
+                        int cur_w = w_offset + j*l.stride + m;
+                        int index = cur_w + l.w*(cur_h + l.h*p);
+                        int valid = (cur_h >= 0 && cur_h < l.h &&
+                                     cur_w >= 0 && cur_w < l.w);
+                        float val = (valid != 0) ? input[index] : -FLT_MAX;
+                        max_i = (val > max) ? index : max_i;
+                        max   = (val > max) ? val   : max;
                     }
-                    l.output[out_index] = max;
-                    l.indexes[out_index] = max_i;
                 }
+                l.output[out_index] = max;
+                l.indexes[out_index] = max_i;
             }
         }
     }
 }
 
+void forward_maxpool_layer(const maxpool_layer l, network net)
+{
+    maxpool_job job = {l, net.input};
+    parallel_for(l.batch*l.c, (1<<12)/(l.out_h*l.out_w) + 1, forward_maxpool_part, &job);
+}
+
 void backward_maxpool_layer(const maxpool_layer l, network net)
 {
     int i;
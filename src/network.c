@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <time.h>
 #include <assert.h>
+#include <sys/mman.h>
 #include "network.h"
 #include "image.h"
 #include "data.h"
@@ -58,6 +59,27 @@ network load_network(char *cfg, char *weights, int clear)
     return net;
 }
 
+/*
+ * A network for prediction only: no gradient or optimizer state, batchnorm
+ * folded into the weights and layer outputs sharing memory. network_predict
+ * then takes batch images back to back and returns batch outputs.
+ */
+network load_network_inference_custom(char *cfg, char *weights, int batch)
+{
+    network net = parse_network_cfg_custom(cfg, batch, 0);
+    if(weights && weights[0] != 0){
+        load_weights_mapped(&net, weights);
+    }
+    fuse_network_for_inference(&net);
+    plan_network_memory(&net);
+    return net;
+}
+
+network load_network_inference(char *cfg, char *weights)
+{
+    return load_network_inference_custom(cfg, weights, 1);
+}
+
 int get_current_batch(network net)
 {
     int batch_num = (*net.seen)/(net.batch*net.subdivisions);
@@ -296,6 +318,273 @@ void set_batch_network(network *net, int b)
     }
 }
 
+/*
+ * Folds batch normalization into the conv and connected layers that carry
+ * it, saving the normalize and scale passes on every forward. The result
+ * is for inference only: the folded layers no longer train.
+ */
+void fuse_network_for_inference(network *net)
+{
+    int i;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->type == CONVOLUTIONAL) fuse_convolutional_batchnorm(l);
+        if(l->type == CONNECTED) fuse_connected_batchnorm(l);
+    }
+}
+
+/*
+ * Inference memory plan. Most layer outputs are dead as soon as the layers
+ * reading them have run, so instead of each layer holding its own buffer
+ * they share a few arenas. A buffer lives from the layer that writes it to
+ * the last layer that reads it: the next layer, a route through
+ * input_layers or a shortcut through index. Buffers are placed largest
+ * first into the first arena holding no buffer alive at the same time.
+ * The network output, layers that compute a cost and recurrent layers
+ * keep their own buffers. Planned layers also lose their delta, so a
+ * planned network can only run forward.
+ */
+typedef struct{
+    size_t size;
+    int first, last;
+    int layer;
+    int arena;
+} planned_buffer;
+
+static int planned_buffer_comparator(const void *a, const void *b)
+{
+    const planned_buffer *pa = a;
+    const planned_buffer *pb = b;
+    if(pa->size != pb->size) return (pa->size < pb->size) ? 1 : -1;
+    return pa->layer - pb->layer;
+}
+
+static int in_arena(network *net, float *p)
+{
+    return net->arena && p >= net->arena && p < net->arena + net->arena_size;
+}
+
+/* Whether p points into the file mapped by load_weights_mapped. */
+static int in_weights_map(network *net, float *p)
+{
+    unsigned char *b = (unsigned char *)p;
+    return net->weights_map && b >= net->weights_map && b < net->weights_map + net->weights_map_size;
+}
+
+static int plannable_layer(layer l)
+{
+    switch(l.type){
+        case RNN:
+        case GRU:
+        case CRNN:
+        case DROPOUT:
+        case COST:
+        case SOFTMAX:
+        case REGION:
+        case DETECTION:
+            return 0;
+        default:
+            return l.output && !l.truth;
+    }
+}
+
+static void alias_dropout_layers(network *net)
+{
+    int i;
+    for(i = 1; i < net->n; ++i){
+        if(net->layers[i].type != DROPOUT) continue;
+        net->layers[i].output = net->layers[i-1].output;
+        net->layers[i].delta = net->layers[i-1].delta;
+    }
+}
+
+static void plan_memory(network *net, int verbose)
+{
+    if(net->arena || net->gpu_index >= 0 || net->n < 2) return;
+    int n = net->n;
+    int i, j, k;
+    int out = n - 1;
+    while(out > 0 && net->layers[out].type == COST) --out;
+
+    /* buf[i] is the layer whose buffer layer i's output lives in: dropout works in place. */
+    int *buf = calloc(n, sizeof(int));
+    int *last = calloc(n, sizeof(int));
+    for(i = 0; i < n; ++i){
+        buf[i] = (net->layers[i].type == DROPOUT && i > 0) ? buf[i-1] : i;
+        last[i] = i;
+    }
+    for(i = 1; i < n; ++i){
+        layer l = net->layers[i];
+        if(last[buf[i-1]] < i) last[buf[i-1]] = i;
+        if(l.type == ROUTE){
+            for(j = 0; j < l.n; ++j){
+                int b = buf[l.input_layers[j]];
+                if(last[b] < i) last[b] = i;
+            }
+        }
+        if(l.type == SHORTCUT){
+            int b = buf[l.index];
+            if(last[b] < i) last[b] = i;
+        }
+    }
+
+    planned_buffer *bufs = calloc(n, sizeof(planned_buffer));
+    int count = 0;
+    size_t before = 0;
+    for(i = 0; i < out; ++i){
+        layer l = net->layers[i];
+        if(buf[i] != i || !plannable_layer(l)) continue;
+        bufs[count].size = (size_t)l.outputs*l.batch;
+        bufs[count].first = i;
+        bufs[count].last = last[i];
+        bufs[count].layer = i;
+        before += bufs[count].size;
+        if(l.delta) before += bufs[count].size;
+        ++count;
+    }
+    free(buf);
+    free(last);
+    if(count < 2){
+        free(bufs);
+        return;
+    }
+    qsort(bufs, count, sizeof(planned_buffer), planned_buffer_comparator);
+
+    /* Sorted largest first, so an arena is as big as the first buffer put in it. */
+    size_t *offsets = calloc(count + 1, sizeof(size_t));
+    int arenas = 0;
+    for(i = 0; i < count; ++i){
+        for(k = 0; k < arenas; ++k){
+            for(j = 0; j < i; ++j){
+                if(bufs[j].arena != k) continue;
+                if(bufs[j].first <= bufs[i].last && bufs[i].first <= bufs[j].last) break;
+            }
+            if(j == i) break;
+        }
+        if(k == arenas){
+            /* Offsets are kept to multiples of 16 floats. */
+            offsets[arenas + 1] = offsets[arenas] + (bufs[i].size + 15)/16*16;
+            ++arenas;
+        }
+        bufs[i].arena = k;
+    }
+
+    net->arena_size = offsets[arenas];
+    net->arena = calloc(net->arena_size, sizeof(float));
+    for(i = 0; i < count; ++i){
+        layer *l = net->layers + bufs[i].layer;
+        free(l->output);
+        free(l->delta);
+        l->output = net->arena + offsets[bufs[i].arena];
+        l->delta = 0;
+    }
+    alias_dropout_layers(net);
+    if(verbose){
+        fprintf(stderr, "Memory plan: %d layer outputs in %d arenas, %.1f MB -> %.1f MB\n",
+                count, arenas, before*sizeof(float)/1e6, net->arena_size*sizeof(float)/1e6);
+    }
+    free(offsets);
+    free(bufs);
+}
+
+void plan_network_memory(network *net)
+{
+    plan_memory(net, 1);
+}
+
+/* Gives planned layers their own output back; they stay without a delta. Returns whether the network was planned. */
+int unplan_network_memory(network *net)
+{
+    int i;
+    if(!net->arena) return 0;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->type == DROPOUT || !in_arena(net, l->output)) continue;
+        l->output = calloc(l->outputs*l->batch, sizeof(float));
+    }
+    alias_dropout_layers(net);
+    free(net->arena);
+    net->arena = 0;
+    net->arena_size = 0;
+    return 1;
+}
+
+/*
+ * Execution contexts: copies of a network that share its parameters and
+ * own everything a forward pass writes - layer outputs, scratch buffers,
+ * input, workspace - so each can run on its own thread while the weights
+ * are loaded once. Contexts run forward only, on the CPU, and must be
+ * freed before the network they were cloned from.
+ */
+static void *context_buffer(void *p, size_t size)
+{
+    return p ? calloc(size, 1) : 0;
+}
+
+network clone_network_context(network *src)
+{
+    int i;
+    network net = *src;
+    if(src->gpu_index >= 0) error("Execution contexts only run on the CPU");
+    net.shared = 1;
+    net.layers = calloc(net.n, sizeof(layer));
+    net.cost = calloc(1, sizeof(float));
+    net.arena = src->arena ? calloc(src->arena_size, sizeof(float)) : 0;
+    size_t workspace_size = 0;
+    for(i = 0; i < net.n; ++i){
+        layer l = src->layers[i];
+        if(l.type == RNN || l.type == GRU || l.type == CRNN) error("Recurrent layers keep state and can't share their weights");
+        size_t outputs = (size_t)l.outputs*l.batch;
+        if(l.type != DROPOUT){
+            /* Planned outputs keep their place in the arena. */
+            if(in_arena(src, l.output)) l.output = net.arena + (l.output - src->arena);
+            else l.output = context_buffer(l.output, outputs*sizeof(float));
+            l.delta = context_buffer(l.delta, outputs*sizeof(float));
+            l.x = context_buffer(l.x, outputs*sizeof(float));
+            l.x_norm = context_buffer(l.x_norm, outputs*sizeof(float));
+            l.indexes = context_buffer(l.indexes, outputs*sizeof(int));
+            l.cost = context_buffer(l.cost, sizeof(float));
+            l.binary_weights = context_buffer(l.binary_weights, l.nweights*sizeof(float));
+            l.binary_input = context_buffer(l.binary_input, (size_t)l.inputs*l.batch*sizeof(float));
+            l.squared = context_buffer(l.squared, (size_t)l.inputs*l.batch*sizeof(float));
+            l.norms = context_buffer(l.norms, (size_t)l.inputs*l.batch*sizeof(float));
+        }
+        if(l.workspace_size > workspace_size) workspace_size = l.workspace_size;
+        net.layers[i] = l;
+    }
+    alias_dropout_layers(&net);
+    net.output = get_network_output_layer(net).output;
+    net.input = calloc(net.inputs*net.batch, sizeof(float));
+    net.truth = calloc(net.truths*net.batch, sizeof(float));
+    net.workspace = workspace_size ? calloc(1, workspace_size) : 0;
+    return net;
+}
+
+static void free_network_context(network net)
+{
+    int i;
+    for(i = 0; i < net.n; ++i){
+        layer l = net.layers[i];
+        if(l.type == DROPOUT) continue;
+        if(!in_arena(&net, l.output)) free(l.output);
+        free(l.delta);
+        free(l.x);
+        free(l.x_norm);
+        free(l.indexes);
+        free(l.cost);
+        free(l.binary_weights);
+        free(l.binary_input);
+        free(l.squared);
+        free(l.norms);
+    }
+    free(net.layers);
+    free(net.arena);
+    free(net.input);
+    free(net.truth);
+    free(net.workspace);
+    free(net.cost);
+}
+
 int resize_network(network *net, int w, int h)
 {
 #ifdef GPU
@@ -303,7 +592,9 @@ int resize_network(network *net, int w, int h)
     cuda_free(net->workspace);
 #endif
     int i;
+    if(net->shared) error("Execution contexts share their weights and can't be resized");
     //if(w == net->w && h == net->h) return 0;
+    int planned = unplan_network_memory(net);
     net->w = w;
     net->h = h;
     int inputs = 0;
@@ -365,6 +656,7 @@ int resize_network(network *net, int w, int h)
     free(net->workspace);
     net->workspace = calloc(1, workspace_size);
 #endif
+    if(planned) plan_memory(net, 0);
     //fprintf(stderr, " Done!\n");
     return 0;
 }
@@ -567,9 +859,23 @@ float network_accuracy_multi(network net, data d, int n)
 void free_network(network net)
 {
     int i;
+    if(net.shared){
+        free_network_context(net);
+        return;
+    }
     for(i = 0; i < net.n; ++i){
-        free_layer(net.layers[i]);
+        layer l = net.layers[i];
+        if(in_arena(&net, l.output)) l.output = 0;
+        if(in_weights_map(&net, l.biases)) l.biases = 0;
+        if(in_weights_map(&net, l.scales)) l.scales = 0;
+        if(in_weights_map(&net, l.rolling_mean)) l.rolling_mean = 0;
+        if(in_weights_map(&net, l.rolling_variance)) l.rolling_variance = 0;
+        if(in_weights_map(&net, l.weights)) l.weights = 0;
+        if(in_weights_map(&net, l.binary_weights)) l.binary_weights = 0;
+        free_layer(l);
     }
+    if(net.arena) free(net.arena);
+    if(net.weights_map) munmap(net.weights_map, net.weights_map_size);
     free(net.layers);
     if(net.input) free(net.input);
     if(net.truth) free(net.truth);
@@ -24,6 +24,7 @@ void harmless_update_network_gpu(network net);
 float get_current_rate(network net);
 int get_current_batch(network net);
 void free_network(network net);
+network clone_network_context(network *net);
 void compare_networks(network n1, network n2, data d);
 char *get_layer_string(LAYER_TYPE a);
 
@@ -50,6 +51,9 @@ void print_network(network net);
 void visualize_network(network net);
 int resize_network(network *net, int w, int h);
 void set_batch_network(network *net, int b);
+void fuse_network_for_inference(network *net);
+void plan_network_memory(network *net);
+int unplan_network_memory(network *net);
 void calc_network_cost(network net);
 
 #endif
@@ -0,0 +1,288 @@
+#include "pack.h"
+#include "data.h"
+#include "image.h"
+#include "image_u8.h"
+#include "list.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Packed training sets. `darknet pack` decodes every image of a list once and
+ * writes a single shard: a header, then per sample its path, the label path
+ * its boxes came from, 8-bit HWC pixels and boxes, then an index of fixed
+ * size entries. get_paths maps a shard
+ * read-only and the training loaders look samples up by path in a hash table,
+ * so an epoch over a packed set opens no per-sample files and decodes nothing.
+ */
+
+#define PACK_VERSION 2
+
+typedef struct{
+    char magic[4];
+    int32_t version;
+    int32_t count;
+    int32_t reserved;
+    uint64_t entries;
+} pack_header;
+
+typedef struct{
+    uint64_t path;
+    uint64_t labels;
+    uint64_t pixels;
+    uint64_t boxes;
+    int32_t w, h, c;
+    int32_t nboxes;
+} pack_entry;
+
+typedef struct{
+    int32_t id;
+    float x, y, w, h;
+} pack_box;
+
+typedef struct packed_dataset{
+    unsigned char *map;
+    size_t size;
+    int count;
+    pack_entry *entries;
+    int *table;
+    int mask;
+    struct packed_dataset *next;
+} packed_dataset;
+
+static const char pack_magic[4] = {'D', 'N', 'P', 'K'};
+static packed_dataset *packs = 0;
+static pthread_mutex_t pack_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_path(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while(*s){
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void pack_write(FILE *fp, const void *buf, size_t size, uint64_t *offset)
+{
+    if(size && fwrite(buf, 1, size, fp) != size) error("Pack write failed");
+    *offset += size;
+}
+
+static void pack_align(FILE *fp, uint64_t *offset, int align)
+{
+    static const char zeros[16] = {0};
+    pack_write(fp, zeros, (align - *offset % align) % align, offset);
+}
+
+static int has_label_file(char *path, char *labelpath)
+{
+    if(!strcmp(path, labelpath)) return 0;
+    FILE *fp = fopen(labelpath, "r");
+    if(!fp) return 0;
+    fclose(fp);
+    return 1;
+}
+
+void pack_dataset(char *listfile, char *outfile, int max_side)
+{
+    list *plist = get_paths(listfile);
+    char **paths = (char **)list_to_array(plist);
+    int n = plist->size;
+    int i, j;
+
+    FILE *fp = fopen(outfile, "wb");
+    if(!fp) file_error(outfile);
+    pack_header header = {{0}};
+    memcpy(header.magic, pack_magic, 4);
+    header.version = PACK_VERSION;
+    header.count = n;
+    uint64_t offset = 0;
+    pack_write(fp, &header, sizeof(header), &offset);
+
+    pack_entry *entries = calloc(n, sizeof(pack_entry));
+    for(i = 0; i < n; ++i){
+        pack_entry *e = entries + i;
+        image_u8 im = load_image_u8(paths[i], 3);
+        if(max_side > 0 && (im.w > max_side || im.h > max_side)){
+            float s = (float)max_side / (im.w > im.h ? im.w : im.h);
+            int w = im.w*s + .5;
+            int h = im.h*s + .5;
+            image_u8 sized = resize_image_u8(im, w > 0 ? w : 1, h > 0 ? h : 1);
+            free_image_u8(im);
+            im = sized;
+        }
+        e->w = im.w;
+        e->h = im.h;
+        e->c = im.c;
+
+        e->path = offset;
+        pack_write(fp, paths[i], strlen(paths[i]) + 1, &offset);
+
+        char labelpath[4096];
+        detection_label_path(paths[i], labelpath);
+        e->labels = offset;
+        pack_write(fp, labelpath, strlen(labelpath) + 1, &offset);
+
+        e->pixels = offset;
+        pack_write(fp, im.data, (size_t)im.w*im.h*im.c, &offset);
+        free_image_u8(im);
+
+        e->nboxes = -1;
+        if(has_label_file(paths[i], labelpath)){
+            int count = 0;
+            box_label *boxes = read_boxes(labelpath, &count);
+            pack_align(fp, &offset, sizeof(pack_box));
+            e->boxes = offset;
+            e->nboxes = count;
+            for(j = 0; j < count; ++j){
+                pack_box b = {boxes[j].id, boxes[j].x, boxes[j].y, boxes[j].w, boxes[j].h};
+                pack_write(fp, &b, sizeof(b), &offset);
+            }
+            free(boxes);
+        }
+        if(i % 1000 == 999) fprintf(stderr, "%d / %d\n", i+1, n);
+    }
+    pack_align(fp, &offset, 8);
+    header.entries = offset;
+    pack_write(fp, entries, n*sizeof(pack_entry), &offset);
+    fseek(fp, 0, SEEK_SET);
+    pack_write(fp, &header, sizeof(header), &offset);
+    fclose(fp);
+    fprintf(stderr, "Packed %d images into %s, %lu MB\n", n, outfile, (unsigned long)(offset >> 20));
+
+    free(entries);
+    free_ptrs((void **)paths, n);
+    free_list(plist);
+}
+
+int is_packed_dataset(char *filename)
+{
+    char magic[4];
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) return 0;
+    int packed = fread(magic, 1, 4, fp) == 4 && !memcmp(magic, pack_magic, 4);
+    fclose(fp);
+    return packed;
+}
+
+list *open_packed_dataset(char *filename)
+{
+    int i;
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) file_error(filename);
+    struct stat st;
+    if(fstat(fd, &st)) file_error(filename);
+    unsigned char *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) file_error(filename);
+
+    pack_header *header = (pack_header *)map;
+    if(st.st_size < sizeof(pack_header) || header->version != PACK_VERSION
+            || header->entries + header->count*sizeof(pack_entry) > st.st_size){
+        fprintf(stderr, "Bad packed dataset: %s\n", filename);
+        exit(0);
+    }
+
+    packed_dataset *p = calloc(1, sizeof(packed_dataset));
+    p->map = map;
+    p->size = st.st_size;
+    p->count = header->count;
+    p->entries = (pack_entry *)(map + header->entries);
+    int size = 1;
+    while(size < 2*p->count) size <<= 1;
+    p->mask = size - 1;
+    p->table = malloc(size*sizeof(int));
+    memset(p->table, -1, size*sizeof(int));
+
+    list *paths = make_list();
+    for(i = 0; i < p->count; ++i){
+        char *path = (char *)map + p->entries[i].path;
+        int slot = hash_path(path) & p->mask;
+        while(p->table[slot] >= 0 && strcmp((char *)map + p->entries[p->table[slot]].path, path)){
+            slot = (slot + 1) & p->mask;
+        }
+        if(p->table[slot] < 0) p->table[slot] = i;
+        list_insert(paths, copy_string(path));
+    }
+
+    pthread_mutex_lock(&pack_mutex);
+    p->next = packs;
+    packs = p;
+    pthread_mutex_unlock(&pack_mutex);
+    fprintf(stderr, "Packed dataset %s: %d images\n", filename, p->count);
+    return paths;
+}
+
+static pack_entry *find_packed(char *path, packed_dataset **owner)
+{
+    packed_dataset *p;
+    if(!packs) return 0;
+    uint32_t hash = hash_path(path);
+    for(p = packs; p; p = p->next){
+        int slot = hash & p->mask;
+        while(p->table[slot] >= 0){
+            pack_entry *e = p->entries + p->table[slot];
+            if(!strcmp((char *)p->map + e->path, path)){
+                *owner = p;
+                return e;
+            }
+            slot = (slot + 1) & p->mask;
+        }
+    }
+    return 0;
+}
+
+int load_packed_image_u8(char *path, image_u8 *im)
+{
+    packed_dataset *p;
+    pack_entry *e = find_packed(path, &p);
+    if(!e) return 0;
+    image_u8 mapped = {e->w, e->h, e->c, p->map + e->pixels};
+    *im = copy_image_u8(mapped);
+    return 1;
+}
+
+int load_packed_image(char *path, image *im)
+{
+    packed_dataset *p;
+    pack_entry *e = find_packed(path, &p);
+    if(!e) return 0;
+    image_u8 mapped = {e->w, e->h, e->c, p->map + e->pixels};
+    *im = image_u8_to_image(mapped);
+    return 1;
+}
+
+/* The packed boxes only stand in for labelpath if that is the file they were read from. */
+box_label *read_packed_boxes(char *path, char *labelpath, int *n)
+{
+    int i;
+    packed_dataset *p;
+    pack_entry *e = find_packed(path, &p);
+    if(!e || e->nboxes < 0 || strcmp((char *)p->map + e->labels, labelpath)) return 0;
+    pack_box *src = (pack_box *)(p->map + e->boxes);
+    box_label *boxes = calloc(e->nboxes + 1, sizeof(box_label));
+    for(i = 0; i < e->nboxes; ++i){
+        pack_box b = src[i];
+        boxes[i].id = b.id;
+        boxes[i].x = b.x;
+        boxes[i].y = b.y;
+        boxes[i].h = b.h;
+        boxes[i].w = b.w;
+        boxes[i].left   = b.x - b.w/2;
+        boxes[i].right  = b.x + b.w/2;
+        boxes[i].top    = b.y - b.h/2;
+        boxes[i].bottom = b.y + b.h/2;
+    }
+    *n = e->nboxes;
+    return boxes;
+}
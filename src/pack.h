@@ -0,0 +1,12 @@
+#ifndef PACK_H
+#define PACK_H
+#include "darknet.h"
+
+void pack_dataset(char *listfile, char *outfile, int max_side);
+int is_packed_dataset(char *filename);
+list *open_packed_dataset(char *filename);
+int load_packed_image(char *path, image *im);
+int load_packed_image_u8(char *path, image_u8 *im);
+box_label *read_packed_boxes(char *path, char *labelpath, int *n);
+
+#endif
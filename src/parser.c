@@ -2,6 +2,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "activation_layer.h"
 #include "activations.h"
@@ -29,7 +33,10 @@
 #include "route_layer.h"
 #include "shortcut_layer.h"
 #include "softmax_layer.h"
+#include "threadpool.h"
 #include "utils.h"
+#include "weights_container.h"
+#include "winograd.h"
 
 typedef struct{
     char *type;
@@ -114,6 +121,7 @@ typedef struct size_params{
     int c;
     int index;
     int time_steps;
+    int train;
     network net;
 } size_params;
 
@@ -186,7 +194,7 @@ convolutional_layer parse_convolutional(list *options, size_params params)
     int binary = option_find_int_quiet(options, "binary", 0);
     int xnor = option_find_int_quiet(options, "xnor", 0);
 
-    convolutional_layer layer = make_convolutional_layer(batch,h,w,c,n,size,stride,padding,activation, batch_normalize, binary, xnor, params.net.adam);
+    convolutional_layer layer = make_convolutional_layer(batch,h,w,c,n,size,stride,padding,activation, batch_normalize, binary, xnor, params.net.adam, params.train);
     layer.flipped = option_find_int_quiet(options, "flipped", 0);
     layer.dot = option_find_float_quiet(options, "dot", 0);
     if(params.net.adam){
@@ -246,7 +254,7 @@ connected_layer parse_connected(list *options, size_params params)
     ACTIVATION activation = get_activation(activation_s);
     int batch_normalize = option_find_int_quiet(options, "batch_normalize", 0);
 
-    connected_layer layer = make_connected_layer(params.batch, params.inputs, output, activation, batch_normalize);
+    connected_layer layer = make_connected_layer(params.batch, params.inputs, output, activation, batch_normalize, params.train);
 
     return layer;
 }
@@ -444,7 +452,7 @@ layer parse_normalization(list *options, size_params params)
 
 layer parse_batchnorm(list *options, size_params params)
 {
-    layer l = make_batchnorm_layer(params.batch, params.w, params.h, params.c);
+    layer l = make_batchnorm_layer(params.batch, params.w, params.h, params.c, params.train);
     return l;
 }
 
@@ -550,6 +558,9 @@ void parse_net_options(list *options, network *net)
     net->batch *= net->time_steps;
     net->subdivisions = subdivs;
 
+    int threads = option_find_int_quiet(options, "threads", 0);
+    if(threads > 0) set_cpu_threads(threads);
+
     net->adam = option_find_int_quiet(options, "adam", 0);
     if(net->adam){
         net->B1 = option_find_float(options, "B1", .9);
@@ -621,6 +632,17 @@ int is_network(section *s)
 }
 
 network parse_network_cfg(char *filename)
+{
+    return parse_network_cfg_custom(filename, 0, 1);
+}
+
+/*
+ * batch, when positive, replaces the batch size the cfg asks for. With
+ * train = 0 the conv, connected and batchnorm layers leave out their
+ * gradient and optimizer state and the network can only run forward.
+ * GPU layers push and pull that state with their weights, so they keep it.
+ */
+network parse_network_cfg_custom(char *filename, int batch, int train)
 {
     list *sections = read_cfg(filename);
     node *n = sections->front;
@@ -633,6 +655,7 @@ network parse_network_cfg(char *filename)
     list *options = s->options;
     if(!is_network(s)) error("First section must be [net] or [network]");
     parse_net_options(options, &net);
+    if(batch > 0) net.batch = batch;
 
     params.h = net.h;
     params.w = net.w;
@@ -640,6 +663,7 @@ network parse_network_cfg(char *filename)
     params.inputs = net.inputs;
     params.batch = net.batch;
     params.time_steps = net.time_steps;
+    params.train = train || gpu_index >= 0;
     params.net = net;
 
     size_t workspace_size = 0;
@@ -966,6 +990,7 @@ void load_connected_weights(layer l, FILE *fp, int transpose)
         //printf("rolling_mean: %f mean %f variance\n", mean_array(l.rolling_mean, l.outputs), variance_array(l.rolling_mean, l.outputs));
         //printf("rolling_variance: %f mean %f variance\n", mean_array(l.rolling_variance, l.outputs), variance_array(l.rolling_variance, l.outputs));
     }
+    update_batchnorm_affine(l);
 #ifdef GPU
     if(gpu_index >= 0){
         push_connected_layer(l);
@@ -1008,6 +1033,7 @@ void load_convolutional_weights_binary(layer l, FILE *fp)
             }
         }
     }
+    update_batchnorm_affine(l);
 #ifdef GPU
     if(gpu_index >= 0){
         push_convolutional_layer(l);
@@ -1052,6 +1078,8 @@ void load_convolutional_weights(layer l, FILE *fp)
     if (l.flipped) {
         transpose_matrix(l.weights, l.c*l.size*l.size, l.n);
     }
+    update_batchnorm_affine(l);
+    invalidate_winograd_weights(l);
     //if (l.binary) binarize_weights(l.weights, l.n, l.c*l.size*l.size, l.weights);
 #ifdef GPU
     if(gpu_index >= 0){
@@ -1068,6 +1096,10 @@ void load_weights_upto(network *net, char *filename, int start, int cutoff)
         cuda_set_device(net->gpu_index);
     }
 #endif
+    if(is_weights_container(filename)){
+        load_weights_container(net, filename, start, cutoff);
+        return;
+    }
     fprintf(stderr, "Loading weights from %s...", filename);
     fflush(stdout);
     FILE *fp = fopen(filename, "rb");
@@ -1134,3 +1166,163 @@ void load_weights(network *net, char *filename)
     load_weights_upto(net, filename, 0, net->n);
 }
 
+/*
+ * Zero-copy load. The weights file is mapped private and the parameter arrays
+ * of each layer are pointed straight into the mapping instead of being read
+ * into their own buffers, so startup reads nothing up front and processes
+ * loading the same file share its pages through the page cache. Arrays that
+ * get changed afterwards, by a transpose, batchnorm fusion or training, get
+ * private copies of just the pages written. A truncated file leaves the
+ * missing tail of the layers as they were, like fread does.
+ */
+typedef struct{
+    unsigned char *map;
+    size_t size;
+    size_t offset;
+} weights_file;
+
+static void map_floats(weights_file *f, float **p, int n)
+{
+    size_t bytes = (size_t)n*sizeof(float);
+    if(f->offset + bytes <= f->size){
+        free(*p);
+        *p = (float *)(f->map + f->offset);
+    } else if(f->offset < f->size){
+        memcpy(*p, f->map + f->offset, f->size - f->offset);
+    }
+    f->offset += bytes;
+}
+
+static void map_convolutional_weights(layer *l, weights_file *f)
+{
+    map_floats(f, &l->biases, l->n);
+    if (l->batch_normalize && (!l->dontloadscales)){
+        map_floats(f, &l->scales, l->n);
+        map_floats(f, &l->rolling_mean, l->n);
+        map_floats(f, &l->rolling_variance, l->n);
+    }
+    map_floats(f, &l->weights, l->n*l->c*l->size*l->size);
+    if (l->flipped) {
+        transpose_matrix(l->weights, l->c*l->size*l->size, l->n);
+    }
+    update_batchnorm_affine(*l);
+    invalidate_winograd_weights(*l);
+#ifdef GPU
+    if(gpu_index >= 0){
+        push_convolutional_layer(*l);
+    }
+#endif
+}
+
+static void map_connected_weights(layer *l, weights_file *f, int transpose)
+{
+    map_floats(f, &l->biases, l->outputs);
+    map_floats(f, &l->weights, l->outputs*l->inputs);
+    if(transpose){
+        transpose_matrix(l->weights, l->inputs, l->outputs);
+    }
+    if (l->batch_normalize && (!l->dontloadscales)){
+        map_floats(f, &l->scales, l->outputs);
+        map_floats(f, &l->rolling_mean, l->outputs);
+        map_floats(f, &l->rolling_variance, l->outputs);
+    }
+    update_batchnorm_affine(*l);
+#ifdef GPU
+    if(gpu_index >= 0){
+        push_connected_layer(*l);
+    }
+#endif
+}
+
+static void map_batchnorm_weights(layer *l, weights_file *f)
+{
+    map_floats(f, &l->scales, l->c);
+    map_floats(f, &l->rolling_mean, l->c);
+    map_floats(f, &l->rolling_variance, l->c);
+#ifdef GPU
+    if(gpu_index >= 0){
+        push_batchnorm_layer(*l);
+    }
+#endif
+}
+
+void load_weights_mapped(network *net, char *filename)
+{
+#ifdef GPU
+    if(net->gpu_index >= 0){
+        cuda_set_device(net->gpu_index);
+    }
+#endif
+    if(net->weights_map){
+        load_weights(net, filename);
+        return;
+    }
+    if(is_weights_container(filename)){
+        map_weights_container(net, filename);
+        return;
+    }
+    fprintf(stderr, "Mapping weights from %s...", filename);
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) file_error(filename);
+    struct stat st;
+    if(fstat(fd, &st)) file_error(filename);
+    weights_file f = {0};
+    f.size = st.st_size;
+    f.map = mmap(0, f.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(f.map == MAP_FAILED || f.size < 4*sizeof(int)) file_error(filename);
+
+    int *header = (int *)f.map;
+    int major = header[0];
+    int minor = header[1];
+    *net->seen = header[3];
+    f.offset = 4*sizeof(int);
+    int transpose = (major > 1000) || (minor > 1000);
+
+    int i;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if (l->dontload) continue;
+        if(l->type == CONVOLUTIONAL || l->type == DECONVOLUTIONAL){
+            map_convolutional_weights(l, &f);
+        }
+        if(l->type == CONNECTED){
+            map_connected_weights(l, &f, transpose);
+        }
+        if(l->type == BATCHNORM){
+            map_batchnorm_weights(l, &f);
+        }
+        if(l->type == CRNN){
+            map_convolutional_weights(l->input_layer, &f);
+            map_convolutional_weights(l->self_layer, &f);
+            map_convolutional_weights(l->output_layer, &f);
+        }
+        if(l->type == RNN){
+            map_connected_weights(l->input_layer, &f, transpose);
+            map_connected_weights(l->self_layer, &f, transpose);
+            map_connected_weights(l->output_layer, &f, transpose);
+        }
+        if(l->type == GRU){
+            map_connected_weights(l->input_z_layer, &f, transpose);
+            map_connected_weights(l->input_r_layer, &f, transpose);
+            map_connected_weights(l->input_h_layer, &f, transpose);
+            map_connected_weights(l->state_z_layer, &f, transpose);
+            map_connected_weights(l->state_r_layer, &f, transpose);
+            map_connected_weights(l->state_h_layer, &f, transpose);
+        }
+        if(l->type == LOCAL){
+            int locations = l->out_w*l->out_h;
+            map_floats(&f, &l->biases, l->outputs);
+            map_floats(&f, &l->weights, l->size*l->size*l->c*l->n*locations);
+#ifdef GPU
+            if(gpu_index >= 0){
+                push_local_layer(*l);
+            }
+#endif
+        }
+    }
+    net->weights_map = f.map;
+    net->weights_map_size = f.size;
+    fprintf(stderr, "Done!\n");
+}
+
@@ -3,11 +3,13 @@
 #include "network.h"
 
 network parse_network_cfg(char *filename);
+network parse_network_cfg_custom(char *filename, int batch, int train);
 void save_network(network net, char *filename);
 void save_weights(network net, char *filename);
 void save_weights_upto(network net, char *filename, int cutoff);
 void save_weights_double(network net, char *filename);
 void load_weights(network *net, char *filename);
 void load_weights_upto(network *net, char *filename, int start, int cutoff);
+void load_weights_mapped(network *net, char *filename);
 
 #endif
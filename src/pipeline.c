@@ -0,0 +1,263 @@
+#include "pipeline.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+ * Staged pipelines for offline jobs over long lists. Items pushed in are
+ * handed from stage to stage through bounded queues; each stage runs its own
+ * workers, which take up to batch items at a time, so a slow stage holds back
+ * the ones feeding it instead of letting work pile up in memory. Stages see
+ * items in whatever order their workers finish them, except the sink, which
+ * runs on one thread and gets them back in the order they were pushed.
+ */
+
+#define PIPELINE_MAX_STAGES 8
+
+typedef struct{
+    void *item;
+    int seq;
+} pipeline_item;
+
+typedef struct{
+    pipeline_item *items;
+    int size;
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+} pipeline_queue;
+
+typedef struct pipeline_stage{
+    pipeline_fn fn;
+    void *ctx;
+    int workers;
+    int batch;
+    int ordered;
+    int running;
+    pipeline_queue in;
+    struct pipeline_stage *next;
+    pthread_t *threads;
+} pipeline_stage;
+
+typedef struct{
+    pipeline_stage *stage;
+    int id;
+} pipeline_worker;
+
+struct pipeline{
+    int capacity;
+    int n;
+    int seq;
+    int started;
+    pipeline_stage *stages[PIPELINE_MAX_STAGES];
+    pipeline_worker *workers;
+};
+
+static void init_queue(pipeline_queue *q, int size)
+{
+    q->items = calloc(size, sizeof(pipeline_item));
+    q->size = size;
+    pthread_mutex_init(&q->lock, 0);
+    pthread_cond_init(&q->filled, 0);
+    pthread_cond_init(&q->drained, 0);
+}
+
+static void free_queue(pipeline_queue *q)
+{
+    free(q->items);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->filled);
+    pthread_cond_destroy(&q->drained);
+}
+
+static void queue_push(pipeline_queue *q, pipeline_item it)
+{
+    pthread_mutex_lock(&q->lock);
+    while(q->count == q->size) pthread_cond_wait(&q->drained, &q->lock);
+    q->items[(q->head + q->count) % q->size] = it;
+    ++q->count;
+    pthread_cond_signal(&q->filled);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Waits for a full batch unless the queue is closed, then takes what is
+ * there. Returns 0 once the queue is closed and empty. */
+static int queue_pop(pipeline_queue *q, pipeline_item *out, int batch)
+{
+    int i;
+    pthread_mutex_lock(&q->lock);
+    while(q->count < batch && !q->closed) pthread_cond_wait(&q->filled, &q->lock);
+    int n = (q->count < batch) ? q->count : batch;
+    for(i = 0; i < n; ++i){
+        out[i] = q->items[q->head];
+        q->head = (q->head + 1) % q->size;
+    }
+    q->count -= n;
+    if(n) pthread_cond_broadcast(&q->drained);
+    /* Pass the wakeup on if another worker can go too. */
+    if(q->count >= batch || (q->closed && q->count)) pthread_cond_signal(&q->filled);
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+static void queue_close(pipeline_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->filled);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void run_batch(pipeline_stage *s, int id, pipeline_item *batch, void **items, int n)
+{
+    int i;
+    for(i = 0; i < n; ++i) items[i] = batch[i].item;
+    s->fn(s->ctx, id, items, n);
+    if(s->next){
+        for(i = 0; i < n; ++i) queue_push(&s->next->in, batch[i]);
+    }
+}
+
+/* The sink holds items that arrive early until the ones before them have been
+ * through. At most capacity items per queue plus those in flight can be held. */
+static void run_ordered(pipeline_stage *s)
+{
+    int i, n;
+    int next = 0;
+    int held = 0;
+    int size = 16;
+    pipeline_item *pending = calloc(size, sizeof(pipeline_item));
+    pipeline_item it;
+    while(queue_pop(&s->in, &it, 1)){
+        if(held == size){
+            size *= 2;
+            pending = realloc(pending, size*sizeof(pipeline_item));
+        }
+        pending[held++] = it;
+        do{
+            for(i = 0, n = 0; i < held; ++i){
+                if(pending[i].seq != next) continue;
+                s->fn(s->ctx, 0, &pending[i].item, 1);
+                pending[i] = pending[--held];
+                ++next;
+                n = 1;
+                break;
+            }
+        } while(n);
+    }
+    if(held) error("Pipeline lost items");
+    free(pending);
+}
+
+static void *pipeline_thread(void *ptr)
+{
+    pipeline_worker *w = ptr;
+    pipeline_stage *s = w->stage;
+    if(s->ordered){
+        run_ordered(s);
+    } else {
+        pipeline_item *batch = calloc(s->batch, sizeof(pipeline_item));
+        void **items = calloc(s->batch, sizeof(void *));
+        int n;
+        while((n = queue_pop(&s->in, batch, s->batch))) run_batch(s, w->id, batch, items, n);
+        free(batch);
+        free(items);
+    }
+    pthread_mutex_lock(&s->in.lock);
+    int last = (--s->running == 0);
+    pthread_mutex_unlock(&s->in.lock);
+    if(last && s->next) queue_close(&s->next->in);
+    return 0;
+}
+
+pipeline *make_pipeline(int capacity)
+{
+    pipeline *p = calloc(1, sizeof(pipeline));
+    p->capacity = capacity > 0 ? capacity : 1;
+    return p;
+}
+
+static void add_stage(pipeline *p, pipeline_fn fn, void *ctx, int workers, int batch, int ordered)
+{
+    if(p->started) error("Pipeline stages must be added before the first push");
+    if(p->n == PIPELINE_MAX_STAGES) error("Too many pipeline stages");
+    if(p->n && p->stages[p->n-1]->ordered) error("Nothing can follow a pipeline sink");
+    pipeline_stage *s = calloc(1, sizeof(pipeline_stage));
+    s->fn = fn;
+    s->ctx = ctx;
+    s->workers = workers > 0 ? workers : 1;
+    s->batch = batch > 0 ? batch : 1;
+    s->ordered = ordered;
+    /* Room for a full batch, or its workers would wait on each other forever. */
+    init_queue(&s->in, p->capacity > s->batch ? p->capacity : s->batch);
+    if(p->n) p->stages[p->n-1]->next = s;
+    p->stages[p->n++] = s;
+}
+
+void add_pipeline_stage(pipeline *p, pipeline_fn fn, void *ctx, int workers, int batch)
+{
+    add_stage(p, fn, ctx, workers, batch, 0);
+}
+
+void add_pipeline_sink(pipeline *p, pipeline_fn fn, void *ctx)
+{
+    add_stage(p, fn, ctx, 1, 1, 1);
+}
+
+static void start_pipeline(pipeline *p)
+{
+    int i, j, k;
+    int total = 0;
+    if(!p->n) error("Pipeline has no stages");
+    for(i = 0; i < p->n; ++i) total += p->stages[i]->workers;
+    p->workers = calloc(total, sizeof(pipeline_worker));
+    for(i = 0, k = 0; i < p->n; ++i){
+        pipeline_stage *s = p->stages[i];
+        s->running = s->workers;
+        s->threads = calloc(s->workers, sizeof(pthread_t));
+        for(j = 0; j < s->workers; ++j, ++k){
+            p->workers[k].stage = s;
+            p->workers[k].id = j;
+            if(pthread_create(s->threads + j, 0, pipeline_thread, p->workers + k)) error("Thread creation failed");
+        }
+    }
+    p->started = 1;
+}
+
+/* Blocks while the first stage's queue is full. Items are numbered in the
+ * order they are pushed, so they should be pushed from one thread. */
+void pipeline_push(pipeline *p, void *item)
+{
+    if(!p->started) start_pipeline(p);
+    pipeline_item it = {item, p->seq++};
+    queue_push(&p->stages[0]->in, it);
+}
+
+/* Closes the input and waits until every item has been through the sink. */
+void finish_pipeline(pipeline *p)
+{
+    int i, j;
+    if(!p->started) start_pipeline(p);
+    queue_close(&p->stages[0]->in);
+    for(i = 0; i < p->n; ++i){
+        pipeline_stage *s = p->stages[i];
+        for(j = 0; j < s->workers; ++j) pthread_join(s->threads[j], 0);
+    }
+}
+
+void free_pipeline(pipeline *p)
+{
+    int i;
+    for(i = 0; i < p->n; ++i){
+        free_queue(&p->stages[i]->in);
+        free(p->stages[i]->threads);
+        free(p->stages[i]);
+    }
+    free(p->workers);
+    free(p);
+}
@@ -0,0 +1,15 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+#include "darknet.h"
+
+typedef struct pipeline pipeline;
+typedef void (*pipeline_fn)(void *ctx, int worker, void **items, int n);
+
+pipeline *make_pipeline(int capacity);
+void add_pipeline_stage(pipeline *p, pipeline_fn fn, void *ctx, int workers, int batch);
+void add_pipeline_sink(pipeline *p, pipeline_fn fn, void *ctx);
+void pipeline_push(pipeline *p, void *item);
+void finish_pipeline(pipeline *p);
+void free_pipeline(pipeline *p);
+
+#endif
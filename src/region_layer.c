@@ -319,7 +319,7 @@ void backward_region_layer(const layer l, network net)
      */
 }
 
-void correct_region_boxes(box *boxes, int n, int w, int h, int netw, int neth, int relative)
+void correct_region_boxes(detection *dets, int n, int w, int h, int netw, int neth, int relative)
 {
     int i;
     int new_w=0;
@@ -332,7 +332,7 @@ void correct_region_boxes(box *boxes, int n, int w, int h, int netw, int neth, i
         new_w = (w * neth)/h;
     }
     for (i = 0; i < n; ++i){
-        box b = boxes[i];
+        box b = dets[i].bbox;
         b.x =  (b.x - (netw - new_w)/2./netw) / ((float)new_w/netw); 
         b.y =  (b.y - (neth - new_h)/2./neth) / ((float)new_h/neth); 
         b.w *= (float)netw/new_w;
@@ -343,13 +343,30 @@ void correct_region_boxes(box *boxes, int n, int w, int h, int netw, int neth, i
             b.y *= h;
             b.h *= h;
         }
-        boxes[i] = b;
+        dets[i].bbox = b;
     }
 }
 
-void get_region_boxes(layer l, int w, int h, int netw, int neth, float thresh, float **probs, box *boxes, int only_objectness, int *map, float tree_thresh, int relative)
+/* Collects the cells of one objectness plane that score above thresh. */
+static int region_survivors(const float *obj, int size, float thresh, int *keep)
 {
-    int i,j,n,z;
+    int i;
+    int count = 0;
+    for(i = 0; i < size; ++i){
+        keep[count] = i;
+        count += obj[i] > thresh;
+    }
+    return count;
+}
+
+/* Reads the detections of the first image of l.output into dets: each box
+ * with its class scores above thresh and its objectness, the highest class
+ * score (the tree's objectness for softmax trees). Boxes with neither are
+ * left out. With only_objectness each box has the single score 0, its
+ * objectness. */
+void get_region_detections(layer l, int w, int h, int netw, int neth, float thresh, int only_objectness, int *map, float tree_thresh, int relative, detection_list *dets)
+{
+    int i,j,k,n,z;
     float *predictions = l.output;
     if (l.batch == 2) {
         float *flip = l.output + l.outputs;
@@ -374,60 +391,67 @@ void get_region_boxes(layer l, int w, int h, int netw, int neth, float thresh, f
             l.output[i] = (l.output[i] + flip[i])/2.;
         }
     }
-    for (i = 0; i < l.w*l.h; ++i){
-        int row = i / l.w;
-        int col = i % l.w;
-        for(n = 0; n < l.n; ++n){
-            int index = n*l.w*l.h + i;
-            for(j = 0; j < l.classes; ++j){
-                probs[index][j] = 0;
-            }
-            int obj_index = entry_index(l, 0, n*l.w*l.h + i, 4);
-            int box_index = entry_index(l, 0, n*l.w*l.h + i, 0);
+    /* Class scores are probabilities under softmax, so no class of a box can
+     * score above its objectness: boxes at or below thresh are skipped before
+     * their box is decoded or their classes are read. Such a box could only
+     * suppress boxes scoring lower still, none of which get reported. */
+    int size = l.w*l.h;
+    int gate = !l.background && (only_objectness || l.softmax || l.softmax_tree);
+    int *keep = detection_keep_buffer(dets, size);
+    reset_detections(dets);
+    for(n = 0; n < l.n; ++n){
+        int count = size;
+        if(gate){
+            count = region_survivors(predictions + entry_index(l, 0, n*size, 4), size, thresh, keep);
+        } else {
+            for(i = 0; i < size; ++i) keep[i] = i;
+        }
+        for(k = 0; k < count; ++k){
+            i = keep[k];
+            int row = i / l.w;
+            int col = i % l.w;
+            int obj_index = entry_index(l, 0, n*size + i, 4);
+            int box_index = entry_index(l, 0, n*size + i, 0);
             float scale = l.background ? 1 : predictions[obj_index];
-            boxes[index] = get_region_box(predictions, l.biases, n, box_index, col, row, l.w, l.h, l.w*l.h);
+            box b = get_region_box(predictions, l.biases, n, box_index, col, row, l.w, l.h, size);
+            add_detection(dets, b, 0);
+            detection *det = dets->dets + dets->n-1;
 
-            int class_index = entry_index(l, 0, n*l.w*l.h + i, l.coords + !l.background);
+            if(only_objectness){
+                det->objectness = scale;
+                if(scale != 0) add_detection_score(dets, 0, scale);
+                drop_empty_detection(dets);
+                continue;
+            }
+            int class_index = entry_index(l, 0, n*size + i, l.coords + !l.background);
+            const float *p = predictions + entry_index(l, 0, n*size + i, 5);
             if(l.softmax_tree){
 
-                hierarchy_predictions(predictions + class_index, l.classes, l.softmax_tree, 0, l.w*l.h);
+                hierarchy_predictions(predictions + class_index, l.classes, l.softmax_tree, 0, size);
                 if(map){
                     for(j = 0; j < 200; ++j){
-                        int class_index = entry_index(l, 0, n*l.w*l.h + i, 5 + map[j]);
-                        float prob = scale*predictions[class_index];
-                        probs[index][j] = (prob > thresh) ? prob : 0;
+                        float prob = scale*p[map[j]*size];
+                        if(prob > thresh) add_detection_score(dets, j, prob);
                     }
                 } else {
-                    int j =  hierarchy_top_prediction(predictions + class_index, l.softmax_tree, tree_thresh, l.w*l.h);
-                    probs[index][j] = (scale > thresh) ? scale : 0;
-                    probs[index][l.classes] = scale;
+                    int j =  hierarchy_top_prediction(predictions + class_index, l.softmax_tree, tree_thresh, size);
+                    if(j >= 0 && scale > thresh) add_detection_score(dets, j, scale);
+                    det->objectness = scale;
                 }
             } else {
                 float max = 0;
                 for(j = 0; j < l.classes; ++j){
-                    int class_index = entry_index(l, 0, n*l.w*l.h + i, 5 + j);
-                    float prob = scale*predictions[class_index];
-                    probs[index][j] = (prob > thresh) ? prob : 0;
+                    float prob = scale*p[j*size];
+                    if(prob > thresh) add_detection_score(dets, j, prob);
                     if(prob > max) max = prob;
-                    // TODO REMOVE
-                    // if (j == 56 ) probs[index][j] = 0; 
-                    /*
-                       if (j != 0) probs[index][j] = 0; 
-                       int blacklist[] = {121, 497, 482, 504, 122, 518,481, 418, 542, 491, 914, 478, 120, 510,500};
-                       int bb;
-                       for (bb = 0; bb < sizeof(blacklist)/sizeof(int); ++bb){
-                       if(index == blacklist[bb]) probs[index][j] = 0;
-                       }
-                     */
                 }
-                probs[index][l.classes] = max;
-            }
-            if(only_objectness){
-                probs[index][0] = scale;
+                det->objectness = max;
             }
+            drop_empty_detection(dets);
         }
     }
-    correct_region_boxes(boxes, l.w*l.h*l.n, w, h, netw, neth, relative);
+    finish_detections(dets);
+    correct_region_boxes(dets->dets, dets->n, w, h, netw, neth, relative);
 }
 
 #ifdef GPU
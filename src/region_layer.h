@@ -7,7 +7,7 @@
 layer make_region_layer(int batch, int h, int w, int n, int classes, int coords);
 void forward_region_layer(const layer l, network net);
 void backward_region_layer(const layer l, network net);
-void get_region_boxes(layer l, int w, int h, int netw, int neth, float thresh, float **probs, box *boxes, int only_objectness, int *map, float tree_thresh, int relative);
+void get_region_detections(layer l, int w, int h, int netw, int neth, float thresh, int only_objectness, int *map, float tree_thresh, int relative, detection_list *dets);
 void resize_region_layer(layer *l, int w, int h);
 void zero_objectness(layer l);
 
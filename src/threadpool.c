@@ -0,0 +1,111 @@
+#include "threadpool.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+ * One pool of CPU workers per process. parallel_for splits [0, n) into
+ * contiguous chunks, one per thread, always the same way for the same n and
+ * thread count, so kernels that write disjoint outputs give identical results
+ * however many threads run them. The calling thread takes chunk 0.
+ *
+ * Only one parallel_for runs on the pool at a time; a call made while the pool
+ * is busy (from a worker, or from another thread) just runs inline.
+ */
+
+typedef struct{
+    parallel_fn fn;
+    void *ctx;
+    int n;
+    int chunks;
+} pool_job;
+
+static int pool_threads = 0;
+static pthread_t *pool_workers = 0;
+static pool_job pool_current;
+static int pool_generation = 0;
+static int pool_pending = 0;
+static pthread_mutex_t pool_busy = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+static void run_chunk(pool_job job, int i)
+{
+    int start = (int)((long)job.n*i/job.chunks);
+    int end = (int)((long)job.n*(i+1)/job.chunks);
+    if(start < end) job.fn(job.ctx, start, end);
+}
+
+static void *pool_worker(void *ptr)
+{
+    int id = (int)(size_t)ptr;
+    int seen = 0;
+    while(1){
+        pthread_mutex_lock(&pool_mutex);
+        while(pool_generation == seen) pthread_cond_wait(&pool_start, &pool_mutex);
+        seen = pool_generation;
+        pool_job job = pool_current;
+        pthread_mutex_unlock(&pool_mutex);
+
+        if(id < job.chunks) run_chunk(job, id);
+
+        pthread_mutex_lock(&pool_mutex);
+        if(--pool_pending == 0) pthread_cond_signal(&pool_done);
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    return 0;
+}
+
+void set_cpu_threads(int n)
+{
+    if(n < 1) n = 1;
+    if(pool_threads){
+        if(n != pool_threads) fprintf(stderr, "CPU thread pool already running %d threads, ignoring request for %d\n", pool_threads, n);
+        return;
+    }
+    pool_threads = n;
+    if(n == 1) return;
+    pool_workers = calloc(n, sizeof(pthread_t));
+    int i;
+    for(i = 1; i < n; ++i){
+        if(pthread_create(pool_workers + i, 0, pool_worker, (void *)(size_t)i)) error("Thread creation failed");
+        pthread_detach(pool_workers[i]);
+    }
+    fprintf(stderr, "Using %d CPU threads\n", n);
+}
+
+int get_cpu_threads()
+{
+    return pool_threads ? pool_threads : 1;
+}
+
+void parallel_for(int n, int grain, parallel_fn fn, void *ctx)
+{
+    if(n <= 0) return;
+    if(grain < 1) grain = 1;
+    int chunks = (n + grain - 1)/grain;
+    if(chunks > pool_threads) chunks = pool_threads;
+    if(chunks <= 1 || pthread_mutex_trylock(&pool_busy)){
+        fn(ctx, 0, n);
+        return;
+    }
+    pool_job job = {fn, ctx, n, chunks};
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_current = job;
+    pool_pending = pool_threads - 1;
+    ++pool_generation;
+    pthread_cond_broadcast(&pool_start);
+    pthread_mutex_unlock(&pool_mutex);
+
+    run_chunk(job, 0);
+
+    pthread_mutex_lock(&pool_mutex);
+    while(pool_pending) pthread_cond_wait(&pool_done, &pool_mutex);
+    pthread_mutex_unlock(&pool_mutex);
+
+    pthread_mutex_unlock(&pool_busy);
+}
@@ -0,0 +1,11 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+#include "darknet.h"
+
+typedef void (*parallel_fn)(void *ctx, int start, int end);
+
+void set_cpu_threads(int n);
+int get_cpu_threads();
+void parallel_for(int n, int grain, parallel_fn fn, void *ctx);
+
+#endif
@@ -0,0 +1,487 @@
+#include "weights_container.h"
+#include "batchnorm_layer.h"
+#include "connected_layer.h"
+#include "convolutional_layer.h"
+#include "local_layer.h"
+#include "network.h"
+#include "utils.h"
+#include "winograd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Weights container. A header, the tensors, each starting on a 64 byte
+ * boundary, then a table of contents with one entry per tensor: the layer
+ * and sublayer it belongs to, that layer's type, which parameter it is,
+ * dtype, shape, offset and CRC-32. The header holds CRC-32s of itself and of
+ * the table. Loaders look tensors up in the table rather than reading them
+ * in layer order, so they can take any range of layers, stop on a cfg that
+ * does not match the file instead of reading garbage, and map payloads in
+ * place. Tensors are stored in the layout the layers use in memory.
+ */
+
+#define CONTAINER_VERSION 1
+#define CONTAINER_ALIGN 64
+#define TENSOR_FLOAT32 0
+
+typedef enum{
+    TENSOR_BIASES, TENSOR_SCALES, TENSOR_ROLLING_MEAN, TENSOR_ROLLING_VARIANCE, TENSOR_WEIGHTS
+} tensor_kind;
+
+static const char *tensor_names[] = {"biases", "scales", "rolling_mean", "rolling_variance", "weights"};
+
+typedef struct{
+    char magic[4];
+    int32_t version;
+    int32_t count;
+    int32_t reserved;
+    uint64_t seen;
+    uint64_t toc;
+    uint32_t toc_crc;
+    uint32_t header_crc;
+    char padding[24];
+} container_header;
+
+typedef struct{
+    int32_t layer;
+    int32_t sublayer;
+    int32_t type;
+    int32_t kind;
+    int32_t dtype;
+    int32_t ndims;
+    int32_t shape[4];
+    uint64_t offset;
+    uint64_t count;
+    uint32_t crc;
+    int32_t reserved;
+} container_tensor;
+
+typedef struct{
+    int kind;
+    float **data;
+    int ndims;
+    int shape[4];
+} layer_tensor;
+
+typedef struct{
+    unsigned char *map;
+    size_t size;
+    container_header *header;
+    container_tensor *toc;
+} container;
+
+static const char container_magic[4] = {'D', 'N', 'W', 'C'};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void make_crc_table()
+{
+    uint32_t i, k;
+    for(i = 0; i < 256; ++i){
+        uint32_t c = i;
+        for(k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t container_crc(const void *buf, size_t size)
+{
+    const unsigned char *p = buf;
+    uint32_t c = 0xFFFFFFFFu;
+    size_t i;
+    pthread_once(&crc_once, make_crc_table);
+    for(i = 0; i < size; ++i) c = crc_table[(c ^ p[i]) & 255] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static uint32_t header_crc(container_header h)
+{
+    h.header_crc = 0;
+    return container_crc(&h, sizeof(h));
+}
+
+static void set_tensor(layer_tensor *t, int kind, float **data, int ndims, int d0, int d1, int d2, int d3)
+{
+    t->kind = kind;
+    t->data = data;
+    t->ndims = ndims;
+    t->shape[0] = d0;
+    t->shape[1] = d1;
+    t->shape[2] = d2;
+    t->shape[3] = d3;
+}
+
+static int tensor_count(const int32_t *shape, int ndims)
+{
+    int i;
+    int count = 1;
+    for(i = 0; i < ndims; ++i) count *= shape[i];
+    return count;
+}
+
+/* The parameter tensors of a layer that owns weights, in the order save_weights writes them. */
+static int layer_tensors(layer *l, layer_tensor *t)
+{
+    int n = 0;
+    int outputs = (l->type == CONVOLUTIONAL || l->type == DECONVOLUTIONAL) ? l->n :
+        (l->type == BATCHNORM) ? l->c : l->outputs;
+    switch(l->type){
+        case CONVOLUTIONAL:
+        case DECONVOLUTIONAL:
+        case CONNECTED:
+        case LOCAL:
+            set_tensor(t + n++, TENSOR_BIASES, &l->biases, 1, outputs, 0, 0, 0);
+            break;
+        default:
+            break;
+    }
+    if((l->batch_normalize && (l->type == CONVOLUTIONAL || l->type == DECONVOLUTIONAL || l->type == CONNECTED))
+            || l->type == BATCHNORM){
+        set_tensor(t + n++, TENSOR_SCALES, &l->scales, 1, outputs, 0, 0, 0);
+        set_tensor(t + n++, TENSOR_ROLLING_MEAN, &l->rolling_mean, 1, outputs, 0, 0, 0);
+        set_tensor(t + n++, TENSOR_ROLLING_VARIANCE, &l->rolling_variance, 1, outputs, 0, 0, 0);
+    }
+    if(l->type == CONVOLUTIONAL || l->type == DECONVOLUTIONAL){
+        set_tensor(t + n++, TENSOR_WEIGHTS, &l->weights, 4, l->n, l->c, l->size, l->size);
+    } else if(l->type == CONNECTED){
+        set_tensor(t + n++, TENSOR_WEIGHTS, &l->weights, 2, l->outputs, l->inputs, 0, 0);
+    } else if(l->type == LOCAL){
+        set_tensor(t + n++, TENSOR_WEIGHTS, &l->weights, 3, l->out_h*l->out_w, l->n, l->c*l->size*l->size, 0);
+    }
+    return n;
+}
+
+/* The layers holding a layer's weights: itself, or the sublayers of a recurrent layer. */
+static int layer_parts(layer *l, layer **parts)
+{
+    switch(l->type){
+        case CONVOLUTIONAL:
+        case DECONVOLUTIONAL:
+        case CONNECTED:
+        case BATCHNORM:
+        case LOCAL:
+            parts[0] = l;
+            return 1;
+        case RNN:
+        case CRNN:
+            parts[0] = l->input_layer;
+            parts[1] = l->self_layer;
+            parts[2] = l->output_layer;
+            return 3;
+        case GRU:
+            parts[0] = l->input_z_layer;
+            parts[1] = l->input_r_layer;
+            parts[2] = l->input_h_layer;
+            parts[3] = l->state_z_layer;
+            parts[4] = l->state_r_layer;
+            parts[5] = l->state_h_layer;
+            return 6;
+        default:
+            return 0;
+    }
+}
+
+static void pull_part(layer *l)
+{
+#ifdef GPU
+    if(gpu_index < 0) return;
+    if(l->type == CONVOLUTIONAL || l->type == DECONVOLUTIONAL) pull_convolutional_layer(*l);
+    if(l->type == CONNECTED) pull_connected_layer(*l);
+    if(l->type == BATCHNORM) pull_batchnorm_layer(*l);
+    if(l->type == LOCAL) pull_local_layer(*l);
+#endif
+}
+
+/* What the legacy loaders do after reading a layer. No transpose: tensors are stored as laid out in memory. */
+static void finish_part(layer *l)
+{
+    update_batchnorm_affine(*l);
+    if(l->type == CONVOLUTIONAL) invalidate_winograd_weights(*l);
+#ifdef GPU
+    if(gpu_index < 0) return;
+    if(l->type == CONVOLUTIONAL || l->type == DECONVOLUTIONAL) push_convolutional_layer(*l);
+    if(l->type == CONNECTED) push_connected_layer(*l);
+    if(l->type == BATCHNORM) push_batchnorm_layer(*l);
+    if(l->type == LOCAL) push_local_layer(*l);
+#endif
+}
+
+static void container_write(FILE *fp, const void *buf, size_t size, uint64_t *offset)
+{
+    if(size && fwrite(buf, 1, size, fp) != size) error("Weights write failed");
+    *offset += size;
+}
+
+static void container_align(FILE *fp, uint64_t *offset, int align)
+{
+    static const char zeros[CONTAINER_ALIGN] = {0};
+    container_write(fp, zeros, (align - *offset % align) % align, offset);
+}
+
+int is_weights_container(char *filename)
+{
+    char magic[4];
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) return 0;
+    int yes = fread(magic, 1, 4, fp) == 4 && !memcmp(magic, container_magic, 4);
+    fclose(fp);
+    return yes;
+}
+
+void save_weights_container(network net, char *filename)
+{
+#ifdef GPU
+    if(net.gpu_index >= 0){
+        cuda_set_device(net.gpu_index);
+    }
+#endif
+    fprintf(stderr, "Saving weights to %s\n", filename);
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) file_error(filename);
+
+    container_header header = {{0}};
+    memcpy(header.magic, container_magic, 4);
+    header.version = CONTAINER_VERSION;
+    header.seen = *net.seen;
+    uint64_t offset = 0;
+    container_write(fp, &header, sizeof(header), &offset);
+
+    int count = 0;
+    int size = 64;
+    container_tensor *toc = calloc(size, sizeof(container_tensor));
+    int i, j, k;
+    for(i = 0; i < net.n; ++i){
+        layer *l = net.layers + i;
+        layer *parts[6];
+        int nparts = layer_parts(l, parts);
+        for(j = 0; j < nparts; ++j){
+            layer_tensor t[5];
+            pull_part(parts[j]);
+            int n = layer_tensors(parts[j], t);
+            for(k = 0; k < n; ++k){
+                if(count == size){
+                    size *= 2;
+                    toc = realloc(toc, size*sizeof(container_tensor));
+                }
+                container_tensor *e = toc + count++;
+                memset(e, 0, sizeof(container_tensor));
+                e->layer = i;
+                e->sublayer = (parts[j] == l) ? -1 : j;
+                e->type = parts[j]->type;
+                e->kind = t[k].kind;
+                e->dtype = TENSOR_FLOAT32;
+                e->ndims = t[k].ndims;
+                memcpy(e->shape, t[k].shape, sizeof(e->shape));
+                e->count = tensor_count(e->shape, e->ndims);
+                e->crc = container_crc(*t[k].data, e->count*sizeof(float));
+                container_align(fp, &offset, CONTAINER_ALIGN);
+                e->offset = offset;
+                container_write(fp, *t[k].data, e->count*sizeof(float), &offset);
+            }
+        }
+    }
+    container_align(fp, &offset, CONTAINER_ALIGN);
+    header.count = count;
+    header.toc = offset;
+    header.toc_crc = container_crc(toc, count*sizeof(container_tensor));
+    header.header_crc = header_crc(header);
+    container_write(fp, toc, count*sizeof(container_tensor), &offset);
+    fseek(fp, 0, SEEK_SET);
+    container_write(fp, &header, sizeof(header), &offset);
+    fclose(fp);
+    free(toc);
+}
+
+/* Maps a container and checks its header and table. Returns what is wrong with it, or 0. */
+static const char *open_container(char *filename, container *c, int writable)
+{
+    memset(c, 0, sizeof(container));
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) file_error(filename);
+    struct stat st;
+    if(fstat(fd, &st)) file_error(filename);
+    c->size = st.st_size;
+    c->map = mmap(0, c->size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(c->map == MAP_FAILED) file_error(filename);
+
+    c->header = (container_header *)c->map;
+    if(c->size < sizeof(container_header) || memcmp(c->header->magic, container_magic, 4)) return "not a weights container";
+    if(c->header->version != CONTAINER_VERSION) return "unsupported container version";
+    if(header_crc(*c->header) != c->header->header_crc) return "header checksum mismatch";
+    if(c->header->count < 0 || c->header->toc % 8
+            || c->header->toc + (uint64_t)c->header->count*sizeof(container_tensor) > c->size) return "truncated table of contents";
+    c->toc = (container_tensor *)(c->map + c->header->toc);
+    if(container_crc(c->toc, c->header->count*sizeof(container_tensor)) != c->header->toc_crc) return "table of contents checksum mismatch";
+    int i;
+    for(i = 0; i < c->header->count; ++i){
+        container_tensor *e = c->toc + i;
+        if(e->dtype != TENSOR_FLOAT32) return "unsupported tensor dtype";
+        if(e->kind < TENSOR_BIASES || e->kind > TENSOR_WEIGHTS || e->sublayer < -1) return "bad tensor entry";
+        if(e->ndims < 1 || e->ndims > 4 || e->count != tensor_count(e->shape, e->ndims)) return "bad tensor shape";
+        if(e->offset % CONTAINER_ALIGN || e->offset + e->count*sizeof(float) > c->size) return "truncated tensor data";
+    }
+    return 0;
+}
+
+static void close_container(container *c)
+{
+    munmap(c->map, c->size);
+}
+
+/* Drops the pages of a copied tensor so the file is not held in memory twice. */
+static void release_pages(container *c, uint64_t offset, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = (offset + page - 1) / page * page;
+    size_t end = (offset + size) / page * page;
+    if(end > start) madvise(c->map + start, end - start, MADV_DONTNEED);
+}
+
+static void shape_string(const int32_t *shape, int ndims, char *buf)
+{
+    int i;
+    buf += sprintf(buf, "%d", shape[0]);
+    for(i = 1; i < ndims; ++i) buf += sprintf(buf, "x%d", shape[i]);
+}
+
+static void container_mismatch(char *filename, container_tensor *e, const char *what)
+{
+    fprintf(stderr, "\n%s: layer %d", filename, e->layer);
+    if(e->sublayer >= 0) fprintf(stderr, " part %d", e->sublayer);
+    fprintf(stderr, " %s: %s\n", tensor_names[e->kind], what);
+    exit(-1);
+}
+
+/*
+ * Loads the tensors of layers start to cutoff - 1. With mapped set, the
+ * parameter arrays point into a private mapping of the file that the network
+ * keeps, like load_weights_mapped; otherwise they are copied and their
+ * checksums verified on the way.
+ */
+static void read_container(network *net, char *filename, int start, int cutoff, int mapped)
+{
+#ifdef GPU
+    if(net->gpu_index >= 0){
+        cuda_set_device(net->gpu_index);
+    }
+#endif
+    fprintf(stderr, "%s weights from %s...", mapped ? "Mapping" : "Loading", filename);
+    container c;
+    const char *bad = open_container(filename, &c, mapped);
+    if(bad){
+        fprintf(stderr, "\n%s: %s\n", filename, bad);
+        exit(-1);
+    }
+    *net->seen = c.header->seen;
+
+    int i, j;
+    int *loaded = calloc(net->n, sizeof(int));
+    for(i = 0; i < c.header->count; ++i){
+        container_tensor *e = c.toc + i;
+        if(e->layer < start || e->layer >= cutoff || e->layer >= net->n) continue;
+        layer *l = net->layers + e->layer;
+        if(l->dontload) continue;
+        layer *parts[6];
+        int nparts = layer_parts(l, parts);
+        if(e->sublayer >= nparts || (e->sublayer < 0 && (nparts != 1 || parts[0] != l))){
+            container_mismatch(filename, e, "no such layer in the cfg");
+        }
+        layer *p = (e->sublayer < 0) ? l : parts[e->sublayer];
+        if(p->type != e->type){
+            char what[256];
+            sprintf(what, "%s in the weights but %s in the cfg", get_layer_string(e->type), get_layer_string(p->type));
+            container_mismatch(filename, e, what);
+        }
+        layer_tensor t[5];
+        int n = layer_tensors(p, t);
+        for(j = 0; j < n && t[j].kind != e->kind; ++j);
+        if(j == n) container_mismatch(filename, e, "not used by the cfg");
+        if(t[j].ndims != e->ndims || memcmp(t[j].shape, e->shape, e->ndims*sizeof(int32_t))){
+            char what[256], want[64], got[64];
+            shape_string(e->shape, e->ndims, got);
+            shape_string(t[j].shape, t[j].ndims, want);
+            sprintf(what, "shape %s in the weights but %s in the cfg", got, want);
+            container_mismatch(filename, e, what);
+        }
+        if(e->kind != TENSOR_BIASES && e->kind != TENSOR_WEIGHTS && p->dontloadscales) continue;
+
+        float *data = (float *)(c.map + e->offset);
+        if(mapped){
+            free(*t[j].data);
+            *t[j].data = data;
+        } else {
+            if(container_crc(data, e->count*sizeof(float)) != e->crc) container_mismatch(filename, e, "checksum mismatch");
+            memcpy(*t[j].data, data, e->count*sizeof(float));
+            release_pages(&c, e->offset, e->count*sizeof(float));
+        }
+        loaded[e->layer] = 1;
+    }
+
+    int missing = 0;
+    for(i = start; i < net->n && i < cutoff; ++i){
+        layer *l = net->layers + i;
+        layer *parts[6];
+        int nparts = layer_parts(l, parts);
+        if(loaded[i]){
+            for(j = 0; j < nparts; ++j) finish_part(parts[j]);
+        } else if(nparts && !l->dontload){
+            ++missing;
+        }
+    }
+    free(loaded);
+    if(mapped){
+        net->weights_map = c.map;
+        net->weights_map_size = c.size;
+    } else {
+        close_container(&c);
+    }
+    fprintf(stderr, "Done!\n");
+    if(missing) fprintf(stderr, "%d layers have no weights in %s and keep their initialization\n", missing, filename);
+}
+
+void load_weights_container(network *net, char *filename, int start, int cutoff)
+{
+    read_container(net, filename, start, cutoff, 0);
+}
+
+void map_weights_container(network *net, char *filename)
+{
+    read_container(net, filename, 0, net->n, 1);
+}
+
+/* Verifies every checksum in a container and lists its tensors. Returns 1 if it is intact. */
+int check_weights_container(char *filename)
+{
+    container c;
+    const char *bad = open_container(filename, &c, 0);
+    if(bad){
+        printf("%s: %s\n", filename, bad);
+        return 0;
+    }
+    int i;
+    int ok = 1;
+    size_t bytes = 0;
+    for(i = 0; i < c.header->count; ++i){
+        container_tensor *e = c.toc + i;
+        char shape[64];
+        shape_string(e->shape, e->ndims, shape);
+        int good = container_crc(c.map + e->offset, e->count*sizeof(float)) == e->crc;
+        printf("%5d %3d %-16s %-17s %-20s %s\n", e->layer, e->sublayer, get_layer_string(e->type), tensor_names[e->kind], shape, good ? "ok" : "CHECKSUM MISMATCH");
+        ok = ok && good;
+        bytes += e->count*sizeof(float);
+    }
+    printf("%s: %d tensors, %.1f MB, seen %lu, %s\n", filename, c.header->count, bytes/1e6,
+            (unsigned long)c.header->seen, ok ? "intact" : "CORRUPT");
+    close_container(&c);
+    return ok;
+}
@@ -0,0 +1,11 @@
+#ifndef WEIGHTS_CONTAINER_H
+#define WEIGHTS_CONTAINER_H
+#include "darknet.h"
+
+int is_weights_container(char *filename);
+void save_weights_container(network net, char *filename);
+void load_weights_container(network *net, char *filename, int start, int cutoff);
+void map_weights_container(network *net, char *filename);
+int check_weights_container(char *filename);
+
+#endif
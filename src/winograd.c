@@ -0,0 +1,458 @@
+#include "winograd.h"
+#include "gemm.h"
+#include "threadpool.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Winograd minimal filtering (Lavin & Gray) for 3x3, stride 1, pad 1
+ * convolutions. F(m x m, 3 x 3) reads (m+2) x (m+2) input tiles: tiles and
+ * filters are transformed, each of the (m+2)^2 transformed planes becomes one
+ * gemm of tiles x channels by channels x filters, and the products are
+ * transformed back into m x m output tiles. F(2x2) spends 16 multiplies on 4
+ * outputs and F(4x4) 36 on 16, against 36 and 144 for the direct method.
+ */
+
+/* Transformed tiles plus their products for one chunk, in floats. */
+#define WINOGRAD_CHUNK_FLOATS (1<<21)
+
+/*
+ * The transforms run on WINOGRAD_LANES channels (or filters) at once: every
+ * tile element is a row of lanes, so each line below vectorizes and the
+ * transformed planes are written a contiguous run of channels at a time.
+ */
+#define WINOGRAD_LANES 16
+
+static inline void input_1d2(const float *d, int s, float *t, int ts)
+{
+    int l;
+    for(l = 0; l < WINOGRAD_LANES; ++l){
+        float d0 = d[l], d1 = d[s+l], d2 = d[2*s+l], d3 = d[3*s+l];
+        t[l]      = d0 - d2;
+        t[ts+l]   = d1 + d2;
+        t[2*ts+l] = d2 - d1;
+        t[3*ts+l] = d1 - d3;
+    }
+}
+
+static inline void input_1d4(const float *d, int s, float *t, int ts)
+{
+    int l;
+    for(l = 0; l < WINOGRAD_LANES; ++l){
+        float d0 = d[l], d1 = d[s+l], d2 = d[2*s+l], d3 = d[3*s+l], d4 = d[4*s+l], d5 = d[5*s+l];
+        t[l]      = 4*d0 - 5*d2 + d4;
+        t[ts+l]   = -4*d1 - 4*d2 + d3 + d4;
+        t[2*ts+l] = 4*d1 - 4*d2 - d3 + d4;
+        t[3*ts+l] = -2*d1 - d2 + 2*d3 + d4;
+        t[4*ts+l] = 2*d1 - d2 - 2*d3 + d4;
+        t[5*ts+l] = 4*d1 - 5*d3 + d5;
+    }
+}
+
+static inline void kernel_1d2(const float *g, int s, float *t, int ts)
+{
+    int l;
+    for(l = 0; l < WINOGRAD_LANES; ++l){
+        float g0 = g[l], g1 = g[s+l], g2 = g[2*s+l];
+        t[l]      = g0;
+        t[ts+l]   = .5f*(g0 + g1 + g2);
+        t[2*ts+l] = .5f*(g0 - g1 + g2);
+        t[3*ts+l] = g2;
+    }
+}
+
+static inline void kernel_1d4(const float *g, int s, float *t, int ts)
+{
+    int l;
+    for(l = 0; l < WINOGRAD_LANES; ++l){
+        float g0 = g[l], g1 = g[s+l], g2 = g[2*s+l];
+        t[l]      = g0/4;
+        t[ts+l]   = -(g0 + g1 + g2)/6;
+        t[2*ts+l] = -(g0 - g1 + g2)/6;
+        t[3*ts+l] = g0/24 + g1/12 + g2/6;
+        t[4*ts+l] = g0/24 - g1/12 + g2/6;
+        t[5*ts+l] = g2;
+    }
+}
+
+static inline void output_1d2(const float *m, int s, float *t, int ts)
+{
+    int l;
+    for(l = 0; l < WINOGRAD_LANES; ++l){
+        float m0 = m[l], m1 = m[s+l], m2 = m[2*s+l], m3 = m[3*s+l];
+        t[l]    = m0 + m1 + m2;
+        t[ts+l] = m1 - m2 - m3;
+    }
+}
+
+static inline void output_1d4(const float *m, int s, float *t, int ts)
+{
+    int l;
+    for(l = 0; l < WINOGRAD_LANES; ++l){
+        float m0 = m[l], m1 = m[s+l], m2 = m[2*s+l], m3 = m[3*s+l], m4 = m[4*s+l], m5 = m[5*s+l];
+        t[l]      = m0 + m1 + m2 + m3 + m4;
+        t[ts+l]   = m1 - m2 + 2*(m3 - m4);
+        t[2*ts+l] = m1 + m2 + 4*(m3 + m4);
+        t[3*ts+l] = m1 - m2 + 8*(m3 - m4) + m5;
+    }
+}
+
+/* v = B^T d B, both (m+2) x (m+2). Callers pass a constant m so each size inlines. */
+static inline void transform_input(int m, const float *d, float *v)
+{
+    int a = m + 2;
+    float t[36*WINOGRAD_LANES];
+    int i;
+    for(i = 0; i < a; ++i){
+        if(m == 4) input_1d4(d + i*WINOGRAD_LANES, a*WINOGRAD_LANES, t + i*WINOGRAD_LANES, a*WINOGRAD_LANES);
+        else input_1d2(d + i*WINOGRAD_LANES, a*WINOGRAD_LANES, t + i*WINOGRAD_LANES, a*WINOGRAD_LANES);
+    }
+    for(i = 0; i < a; ++i){
+        if(m == 4) input_1d4(t + i*a*WINOGRAD_LANES, WINOGRAD_LANES, v + i*a*WINOGRAD_LANES, WINOGRAD_LANES);
+        else input_1d2(t + i*a*WINOGRAD_LANES, WINOGRAD_LANES, v + i*a*WINOGRAD_LANES, WINOGRAD_LANES);
+    }
+}
+
+/* u = G g G^T, g is 3 x 3 and u is (m+2) x (m+2). */
+static inline void transform_kernel(int m, const float *g, float *u)
+{
+    int a = m + 2;
+    float t[18*WINOGRAD_LANES];
+    int i;
+    for(i = 0; i < 3; ++i){
+        if(m == 4) kernel_1d4(g + i*WINOGRAD_LANES, 3*WINOGRAD_LANES, t + i*WINOGRAD_LANES, 3*WINOGRAD_LANES);
+        else kernel_1d2(g + i*WINOGRAD_LANES, 3*WINOGRAD_LANES, t + i*WINOGRAD_LANES, 3*WINOGRAD_LANES);
+    }
+    for(i = 0; i < a; ++i){
+        if(m == 4) kernel_1d4(t + i*3*WINOGRAD_LANES, WINOGRAD_LANES, u + i*a*WINOGRAD_LANES, WINOGRAD_LANES);
+        else kernel_1d2(t + i*3*WINOGRAD_LANES, WINOGRAD_LANES, u + i*a*WINOGRAD_LANES, WINOGRAD_LANES);
+    }
+}
+
+/* y = A^T p A, p is (m+2) x (m+2) and y is m x m. */
+static inline void transform_output(int m, const float *p, float *y)
+{
+    int a = m + 2;
+    float t[24*WINOGRAD_LANES];
+    int i;
+    for(i = 0; i < a; ++i){
+        if(m == 4) output_1d4(p + i*WINOGRAD_LANES, a*WINOGRAD_LANES, t + i*WINOGRAD_LANES, a*WINOGRAD_LANES);
+        else output_1d2(p + i*WINOGRAD_LANES, a*WINOGRAD_LANES, t + i*WINOGRAD_LANES, a*WINOGRAD_LANES);
+    }
+    for(i = 0; i < m; ++i){
+        if(m == 4) output_1d4(t + i*a*WINOGRAD_LANES, WINOGRAD_LANES, y + i*m*WINOGRAD_LANES, WINOGRAD_LANES);
+        else output_1d2(t + i*a*WINOGRAD_LANES, WINOGRAD_LANES, y + i*m*WINOGRAD_LANES, WINOGRAD_LANES);
+    }
+}
+
+int winograd_tile_size(layer l)
+{
+    if(l.size != 3 || l.stride != 1 || l.pad != 1) return 0;
+    if(l.binary || l.xnor || l.c < 64) return 0;
+    return (l.out_w >= 16 && l.out_h >= 16) ? 4 : 2;
+}
+
+static int winograd_tiles(layer l)
+{
+    int m = l.winograd;
+    return ((l.out_w + m - 1)/m) * ((l.out_h + m - 1)/m);
+}
+
+static int winograd_chunk(layer l)
+{
+    int a = l.winograd + 2;
+    int tiles = winograd_tiles(l);
+    int chunk = WINOGRAD_CHUNK_FLOATS/(a*a*(l.c + l.n));
+    if(chunk < 16) chunk = 16;
+    if(chunk > tiles) chunk = tiles;
+    return chunk;
+}
+
+size_t winograd_workspace_size(layer l)
+{
+    if(!l.winograd) return 0;
+    int a = l.winograd + 2;
+    return (size_t)a*a*winograd_chunk(l)*(l.c + l.n)*sizeof(float);
+}
+
+/* The transformed weights are built from l.weights on the first inference
+ * forward after the weights change. Training steps only mark them stale, and
+ * a net that is never run for inference never allocates them. */
+winograd_weights *make_winograd_weights(layer l)
+{
+    winograd_weights *w = calloc(1, sizeof(winograd_weights));
+    w->stale = 1;
+    pthread_mutex_init(&w->lock, 0);
+    return w;
+}
+
+void free_winograd_weights(winograd_weights *w)
+{
+    if(!w) return;
+    pthread_mutex_destroy(&w->lock);
+    free(w->data);
+    free(w);
+}
+
+void invalidate_winograd_weights(layer l)
+{
+    if(l.winograd_weights) l.winograd_weights->stale = 1;
+}
+
+/* One gemm-packed c x n plane per transformed tap, aligned for the gemm kernels' panel loads. */
+static void transform_weights(layer l)
+{
+    int a = l.winograd + 2;
+    int plane = l.c*l.n;
+    size_t packed = gemm_packed_size(l.c, l.n);
+    winograd_weights *w = l.winograd_weights;
+    if(w->m != l.winograd){
+        free(w->data);
+        w->data = 0;
+        if(posix_memalign((void **)&w->data, 64, a*a*packed*sizeof(float))) malloc_error();
+        w->m = l.winograd;
+    }
+    float *u = calloc(a*a*plane, sizeof(float));
+    float g[9*WINOGRAD_LANES], v[36*WINOGRAD_LANES];
+    int f, k, i, j;
+    memset(g, 0, sizeof(g));
+    for(f = 0; f < l.n; f += WINOGRAD_LANES){
+        int lanes = (l.n - f < WINOGRAD_LANES) ? l.n - f : WINOGRAD_LANES;
+        for(k = 0; k < l.c; ++k){
+            for(j = 0; j < lanes; ++j){
+                float *w = l.weights + ((f + j)*l.c + k)*9;
+                for(i = 0; i < 9; ++i) g[i*WINOGRAD_LANES + j] = w[i];
+            }
+            if(l.winograd == 4) transform_kernel(4, g, v);
+            else transform_kernel(2, g, v);
+            for(i = 0; i < a*a; ++i) memcpy(u + i*plane + k*l.n + f, v + i*WINOGRAD_LANES, lanes*sizeof(float));
+        }
+    }
+    for(i = 0; i < a*a; ++i) gemm_prepack_b(l.c, l.n, u + i*plane, l.n, w->data + i*packed);
+    free(u);
+}
+
+/* Copies of a layer share its winograd_weights, so the check is locked. */
+void winograd_transform_weights(layer l)
+{
+    winograd_weights *w = l.winograd_weights;
+    pthread_mutex_lock(&w->lock);
+    if(w->stale || w->m != l.winograd){
+        transform_weights(l);
+        w->stale = 0;
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+typedef struct{
+    int m;
+    int c, h, w;
+    int n, out_h, out_w;
+    int tiles_w;
+    int first;
+    int count;
+    float *input;
+    float *v;
+    float *prod;
+    float *output;
+    gemm_epilogue *e;
+} winograd_job;
+
+/* v holds (m+2)^2 planes of count x c transformed tiles. */
+static void winograd_input_part(void *ptr, int start, int end)
+{
+    winograd_job job = *(winograd_job *)ptr;
+    int m = job.m;
+    int a = m + 2;
+    int plane = job.count*job.c;
+    int size = job.h*job.w;
+    float d[36*WINOGRAD_LANES], v[36*WINOGRAD_LANES];
+    int t, k, i, j, l;
+    memset(d, 0, sizeof(d));
+    for(k = 0; k < job.c; k += WINOGRAD_LANES){
+        int lanes = (job.c - k < WINOGRAD_LANES) ? job.c - k : WINOGRAD_LANES;
+        float *im = job.input + k*size;
+        for(t = start; t < end; ++t){
+            int tile = job.first + t;
+            int y0 = (tile / job.tiles_w)*m - 1;
+            int x0 = (tile % job.tiles_w)*m - 1;
+            int inside = y0 >= 0 && x0 >= 0 && y0 + a <= job.h && x0 + a <= job.w;
+            for(i = 0; i < a; ++i){
+                int y = y0 + i;
+                for(j = 0; j < a; ++j){
+                    int x = x0 + j;
+                    float *e = d + (i*a + j)*WINOGRAD_LANES;
+                    if(inside || (y >= 0 && y < job.h && x >= 0 && x < job.w)){
+                        float *in = im + y*job.w + x;
+                        for(l = 0; l < lanes; ++l) e[l] = in[l*size];
+                    } else {
+                        for(l = 0; l < lanes; ++l) e[l] = 0;
+                    }
+                }
+            }
+            if(m == 4) transform_input(4, d, v);
+            else transform_input(2, d, v);
+            float *dst = job.v + t*job.c + k;
+            for(i = 0; i < a*a; ++i) memcpy(dst + i*plane, v + i*WINOGRAD_LANES, lanes*sizeof(float));
+        }
+    }
+}
+
+/* prod holds (m+2)^2 planes of count x n, scattered back into m x m output tiles. */
+static void winograd_output_part(void *ptr, int start, int end)
+{
+    winograd_job job = *(winograd_job *)ptr;
+    int m = job.m;
+    int a = m + 2;
+    int plane = job.count*job.n;
+    int size = job.out_h*job.out_w;
+    float p[36*WINOGRAD_LANES], y[16*WINOGRAD_LANES];
+    int t, k, i, j, l;
+    memset(p, 0, sizeof(p));
+    for(k = 0; k < job.n; k += WINOGRAD_LANES){
+        int lanes = (job.n - k < WINOGRAD_LANES) ? job.n - k : WINOGRAD_LANES;
+        for(t = start; t < end; ++t){
+            int tile = job.first + t;
+            int oy = (tile / job.tiles_w)*m;
+            int ox = (tile % job.tiles_w)*m;
+            int rows = (job.out_h - oy < m) ? job.out_h - oy : m;
+            int cols = (job.out_w - ox < m) ? job.out_w - ox : m;
+            float *src = job.prod + t*job.n + k;
+            for(i = 0; i < a*a; ++i) memcpy(p + i*WINOGRAD_LANES, src + i*plane, lanes*sizeof(float));
+            if(m == 4) transform_output(4, p, y);
+            else transform_output(2, p, y);
+            if(job.e) gemm_epilogue_apply(job.e, 0, k, m*m, lanes, y, WINOGRAD_LANES);
+            float *out = job.output + k*size + oy*job.out_w + ox;
+            for(i = 0; i < rows; ++i){
+                for(j = 0; j < cols; ++j){
+                    float *e = y + (i*m + j)*WINOGRAD_LANES;
+                    float *o = out + i*job.out_w + j;
+                    for(l = 0; l < lanes; ++l) o[l*size] = e[l];
+                }
+            }
+        }
+    }
+}
+
+/* l.output = conv(input), followed by e applied per output channel if it is given. */
+void forward_winograd_cpu(layer l, float *input, float *workspace, const gemm_epilogue *e)
+{
+    int m = l.winograd;
+    int a = m + 2;
+    int tiles = winograd_tiles(l);
+    int chunk = winograd_chunk(l);
+    size_t packed = gemm_packed_size(l.c, l.n);
+    int b, t, i;
+
+    winograd_job job = {0};
+    job.m = m;
+    job.c = l.c;
+    job.h = l.h;
+    job.w = l.w;
+    job.n = l.n;
+    job.out_h = l.out_h;
+    job.out_w = l.out_w;
+    job.tiles_w = (l.out_w + m - 1)/m;
+    job.v = workspace;
+    job.prod = workspace + a*a*chunk*l.c;
+    winograd_transform_weights(l);
+    float *weights = l.winograd_weights->data;
+
+    /* Transformed tiles hold channels in lanes, so per-row terms of the epilogue become per-column. */
+    gemm_epilogue lane_e;
+    if(e){
+        lane_e = *e;
+        lane_e.per_column = 1;
+        job.e = &lane_e;
+    }
+
+    for(b = 0; b < l.batch; ++b){
+        job.input = input + b*l.inputs;
+        job.output = l.output + b*l.outputs;
+        for(t = 0; t < tiles; t += chunk){
+            job.first = t;
+            job.count = (tiles - t < chunk) ? tiles - t : chunk;
+            parallel_for(job.count, 4, winograd_input_part, &job);
+            for(i = 0; i < a*a; ++i){
+                gemm_packed_cpu(0,job.count,l.n,l.c,1,
+                        job.v + i*job.count*l.c, l.c,
+                        weights + i*packed,
+                        0,
+                        job.prod + i*job.count*l.n, l.n);
+            }
+            parallel_for(job.count, 4, winograd_output_part, &job);
+        }
+    }
+}
+
+static void test_winograd_shape(int m, int c, int n, int h, int w)
+{
+    srand(0);
+    layer l = {0};
+    l.batch = 1;
+    l.c = c;
+    l.n = n;
+    l.h = l.out_h = h;
+    l.w = l.out_w = w;
+    l.size = 3;
+    l.stride = 1;
+    l.pad = 1;
+    l.inputs = c*h*w;
+    l.outputs = n*h*w;
+    l.winograd = m;
+
+    int i;
+    float scale = sqrt(2./(9*c));
+    l.weights = calloc(9*c*n, sizeof(float));
+    for(i = 0; i < 9*c*n; ++i) l.weights[i] = scale*rand_normal();
+    float *input = calloc(l.inputs, sizeof(float));
+    for(i = 0; i < l.inputs; ++i) input[i] = rand_uniform(-1, 1);
+    l.winograd_weights = make_winograd_weights(l);
+    l.output = calloc(l.outputs, sizeof(float));
+    float *ref = calloc(l.outputs, sizeof(float));
+    float *workspace = calloc(1, winograd_workspace_size(l));
+
+    double direct = 1e9, wino = 1e9;
+    int r;
+    for(r = 0; r < 5; ++r){
+        double start = what_time_is_it_now();
+        gemm_conv_cpu(n,1,l.weights,9*c,input,c,h,w,3,1,1,0,ref,h*w,0);
+        double t = what_time_is_it_now() - start;
+        if(t < direct) direct = t;
+        start = what_time_is_it_now();
+        forward_winograd_cpu(l, input, workspace, 0);
+        t = what_time_is_it_now() - start;
+        if(t < wino) wino = t;
+    }
+
+    double max_err = 0, max_ref = 0;
+    for(i = 0; i < l.outputs; ++i){
+        double err = fabs(l.output[i] - ref[i]);
+        if(err > max_err) max_err = err;
+        if(fabs(ref[i]) > max_ref) max_ref = fabs(ref[i]);
+    }
+    max_err /= max_ref;
+    printf("Winograd F(%dx%d,3x3) %4d -> %4d, %3d x %3d: direct %8.2f ms, winograd %8.2f ms, %g max rel err %s\n",
+            m, m, c, n, w, h, direct*1000, wino*1000, max_err, (max_err < ((m == 4) ? 1e-3 : 1e-4)) ? "" : "FAILED");
+
+    free(l.weights);
+    free_winograd_weights(l.winograd_weights);
+    free(l.output);
+    free(input);
+    free(ref);
+    free(workspace);
+}
+
+void test_winograd()
+{
+    int shapes[][4] = {{8, 5, 7, 9}, {16, 32, 208, 208}, {32, 64, 104, 104}, {64, 128, 52, 52}, {128, 256, 26, 26}, {256, 512, 26, 26}, {256, 512, 13, 13}, {512, 1024, 13, 13}, {1024, 1024, 13, 13}, {33, 47, 17, 11}};
+    int i;
+    for(i = 0; i < sizeof(shapes)/sizeof(shapes[0]); ++i){
+        test_winograd_shape(2, shapes[i][0], shapes[i][1], shapes[i][2], shapes[i][3]);
+        test_winograd_shape(4, shapes[i][0], shapes[i][1], shapes[i][2], shapes[i][3]);
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef WINOGRAD_H
+#define WINOGRAD_H
+#include "layer.h"
+#include <pthread.h>
+
+typedef struct winograd_weights{
+    int m;
+    int stale;
+    float *data;
+    pthread_mutex_t lock;
+} winograd_weights;
+
+struct gemm_epilogue;
+
+int winograd_tile_size(layer l);
+size_t winograd_workspace_size(layer l);
+winograd_weights *make_winograd_weights(layer l);
+void free_winograd_weights(winograd_weights *w);
+void invalidate_winograd_weights(layer l);
+void winograd_transform_weights(layer l);
+void forward_winograd_cpu(layer l, float *input, float *workspace, const struct gemm_epilogue *e);
+void test_winograd();
+
+#endif